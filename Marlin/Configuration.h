@@ -367,6 +367,12 @@ const bool Z_ENDSTOPS_INVERTING = false; // set to true to invert the logic of t
 #define DEFAULT_ZJERK                 0.4     // (mm/sec)
 #define DEFAULT_EJERK                 {17, 17}    // E0... (mm/sec) per extruder, max initial speed for retract moves
 
+// Limit the speed at the junction of two moves by the angle between them instead of the XY and Z jerk.
+// The path is assumed to round the corner at most DEFAULT_JUNCTION_DEVIATION away from it, at the move's 
+// acceleration, so curves made of many short segments keep their speed. The E jerk still applies.
+//#define JUNCTION_DEVIATION
+#define DEFAULT_JUNCTION_DEVIATION    0.05    // (mm)
+
 //===========================================================================
 //=============================Additional Features===========================
 //===========================================================================
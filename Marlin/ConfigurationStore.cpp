@@ -3,11 +3,12 @@
 #include "temperature.h"
 #include "ultralcd.h"
 #include "ConfigurationStore.h"
+#include "motion_control.h"
 
 void _EEPROM_writeData(int &pos, uint8_t* value, uint8_t size)
 {
     do {
-        eeprom_write_byte((unsigned char*)pos, *value);
+        eeprom_write_byte((unsigned char*)(uintptr_t)pos, *value);
         pos++;
         value++;
     } while(--size);
@@ -17,7 +18,7 @@ void _EEPROM_writeData(int &pos, uint8_t* value, uint8_t size)
 void _EEPROM_readData(int &pos, uint8_t* value, uint8_t size)
 {
     do {
-        *value = eeprom_read_byte((unsigned char*)pos);
+        *value = eeprom_read_byte((unsigned char*)(uintptr_t)pos);
         pos++;
         value++;
     } while(--size);
@@ -38,7 +39,7 @@ void _EEPROM_readData(int &pos, uint8_t* value, uint8_t size)
 // wrong data being written to the variables.
 // ALSO:  always make sure the variables in the Store and retrieve sections are in 
 // the same order.
-#define EEPROM_VERSION "X08"
+#define EEPROM_VERSION "X10"
 
 
 #ifdef EEPROM_SETTINGS
@@ -60,6 +61,11 @@ void Config_StoreSettings()
   EEPROM_WRITE_VAR(i,max_xy_jerk);
   EEPROM_WRITE_VAR(i,max_z_jerk);
   EEPROM_WRITE_VAR(i,max_e_jerk);
+  #ifndef JUNCTION_DEVIATION
+  float junction_deviation = DEFAULT_JUNCTION_DEVIATION;
+  #endif // JUNCTION_DEVIATION
+  EEPROM_WRITE_VAR(i,junction_deviation);
+  EEPROM_WRITE_VAR(i,arc_tolerance);
   #ifdef ENABLE_ADD_HOMEING
   EEPROM_WRITE_VAR(i,add_homeing);
   #else  // ENABLE_ADD_HOMEING
@@ -178,7 +184,12 @@ void Config_PrintSettings()
     #endif
 
     SERIAL_ECHO_START;
-    SERIAL_ECHOLNPGM("Advanced variables: S=Min feedrate (mm/s), M=Min travel feedrate (mm/s), B=minimum segment time (us), X=max XY jerk (mm/s), Z=max Z jerk (mm/s), E=max E jerk (mm/s)");
+    SERIAL_ECHOPGM("Advanced variables: S=Min feedrate (mm/s), M=Min travel feedrate (mm/s), B=minimum segment time (us), X=max XY jerk (mm/s), Z=max Z jerk (mm/s), E=max E jerk (mm/s)");
+    #ifdef JUNCTION_DEVIATION
+    SERIAL_ECHOPGM(", J=junction deviation (mm)");
+    #endif // JUNCTION_DEVIATION
+    SERIAL_ECHOPGM(", A=arc tolerance (mm)");
+    SERIAL_ECHOLN("");
     SERIAL_ECHO_START;
     SERIAL_ECHOPAIR("  M205 S",minimumfeedrate ); 
     SERIAL_ECHOPAIR(" V" ,mintravelfeedrate ); 
@@ -186,6 +197,10 @@ void Config_PrintSettings()
     SERIAL_ECHOPAIR(" X" ,max_xy_jerk ); 
     SERIAL_ECHOPAIR(" Z" ,max_z_jerk);
     SERIAL_ECHOPAIR(" E" ,max_e_jerk[0]);
+    #ifdef JUNCTION_DEVIATION
+    SERIAL_ECHOPAIR(" J" ,junction_deviation);
+    #endif // JUNCTION_DEVIATION
+    SERIAL_ECHOPAIR(" A" ,arc_tolerance);
     SERIAL_ECHOLN(""); 
     #if (EXTRUDERS > 1)
     for(i = 1; i < EXTRUDERS; i++)
@@ -268,6 +283,11 @@ void Config_RetrieveSettings()
       EEPROM_READ_VAR(i,max_xy_jerk);
       EEPROM_READ_VAR(i,max_z_jerk);
       EEPROM_READ_VAR(i,max_e_jerk);
+      #ifndef JUNCTION_DEVIATION
+      float junction_deviation;
+      #endif // JUNCTION_DEVIATION
+      EEPROM_READ_VAR(i,junction_deviation);
+      EEPROM_READ_VAR(i,arc_tolerance);
       #ifdef ENABLE_ADD_HOMEING
       EEPROM_READ_VAR(i,add_homeing);
       #else // ENABLE_ADD_HOMEING
@@ -311,6 +331,9 @@ void Config_RetrieveSettings()
       #endif
       updatePID();
       #endif
+      #ifdef C_COMPENSATION
+      plan_compile_c_comp();
+      #endif
       SERIAL_ECHO_START;
       SERIAL_ECHOLNPGM("Stored settings retreived:");
       Config_PrintSettings();
@@ -392,6 +415,10 @@ void Config_ResetDefault()
     mintravelfeedrate = DEFAULT_MINTRAVELFEEDRATE;
     max_xy_jerk = DEFAULT_XYJERK;
     max_z_jerk=DEFAULT_ZJERK;
+#ifdef JUNCTION_DEVIATION
+    junction_deviation = DEFAULT_JUNCTION_DEVIATION;
+#endif
+    arc_tolerance = DEFAULT_ARC_TOLERANCE;
 #ifdef ULTIPANEL
     plaPreheatHotendTemp = PLA_PREHEAT_HOTEND_TEMP;
     plaPreheatHPBTemp = PLA_PREHEAT_HPB_TEMP;
@@ -408,6 +435,9 @@ void Config_ResetDefault()
     Kc = DEFAULT_Kc;
 #endif//PID_ADD_EXTRUSION_RATE
 #endif//PIDTEMP
+#ifdef C_COMPENSATION
+    plan_compile_c_comp();
+#endif
     SERIAL_ECHO_START;
     SERIAL_ECHOLN("Using Default settings:");
     Config_PrintSettings();
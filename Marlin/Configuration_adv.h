@@ -197,8 +197,11 @@
 // Minimum time in microseconds that a movement needs to take if the buffer is emptied.
 #define DEFAULT_MINSEGMENTTIME        20000
 
-// If defined the movements slow down when the look ahead buffer is only half full
+// If defined the movements slow down when the look ahead buffer holds less than SLOWDOWN_BUFFER_TIME 
+// worth of moves: segments shorter than the minimum segment time are stretched towards it, the more 
+// the emptier the buffer is.
 #define SLOWDOWN
+#define SLOWDOWN_BUFFER_TIME          100000 // (us) M576 reports what is buffered, also used for arcs
 
 // Frequency limit
 // See nophead's blog for more info
@@ -210,6 +213,24 @@
 // if unwanted behavior is observed on a user's machine when running at very slow speeds.
 #define MINIMUM_PLANNER_SPEED 0.05 // (mm/sec)
 
+// Ramp the step rate along an S-curve (3rd order polynomial of time) instead of a straight line.
+// The ramps take the same time and steps as with constant acceleration, but the acceleration starts
+// and ends at zero and peaks at 1.5 times the set value, which excites much less ringing.
+// Costs a few 32 bit multiplications per step interrupt while accelerating.
+//#define S_CURVE_ACCELERATION
+
+// Let the main loop cut the blocks into short runs of steps at a constant rate (segments) ahead of the
+// stepper interrupt, which then only pops a segment and pulses the pins instead of computing the speed
+// ramp on every step. The buffer has to last longer than the main loop ever takes between two calls
+// of manage_inactivity(), otherwise the stepper pauses until the next segment is ready (M576 counts
+// those pauses).
+//#define STEP_SEGMENT_BUFFER
+#ifdef STEP_SEGMENT_BUFFER
+  #define SEGMENT_BUFFER_SIZE 16    // Must be a power of 2
+  #define SEGMENTS_PER_SECOND 500   // Length of the segments while accelerating and decelerating
+  #define SEGMENT_LOOKAHEAD_MS 20   // Start on the next block only when less motion than this is prepared
+#endif
+
 // MS1 MS2 Stepper Driver Microstepping mode table
 #define MICROSTEP1 LOW,LOW
 #define MICROSTEP2 HIGH,LOW
@@ -234,6 +255,24 @@
 // For some machines might want to keep the z enabled so your bed stays in place.
 #define SD_FINISHED_RELEASECOMMAND "M84 X Y Z E"
 
+// Bytes of the printed file read from the SD card at a time, so get() usually 
+// just takes the next one from RAM. 512 is a whole card block; 0 reads every 
+// byte through the file system. The buffer is static SRAM on top of the 32 
+// planner blocks and the serial buffers, so it ships off: check the free 
+// memory reported at startup before setting it on a 1280/2560.
+#define SD_READ_BUFFER_SIZE 0
+
+// Stream the printed file from the card with one multiple block read (CMD18)
+// per run of contiguous clusters instead of a read command per block. Two
+// 512 byte blocks take the place of the buffer above: get() reads one while
+// the next is read ahead whenever the printer waits for the planner.
+//#define SD_READ_AHEAD
+
+#ifdef SD_READ_AHEAD
+  #undef SD_READ_BUFFER_SIZE
+  #define SD_READ_BUFFER_SIZE 512
+#endif
+
 // The hardware watchdog should reset the Microcontroller disabling all outputs, 
 // in case the firmware gets stuck and doesn't do temperature regulation.
 //#define USE_WATCHDOG
@@ -251,7 +290,11 @@
 //#define ABORT_ON_ENDSTOP_HIT_FEATURE_ENABLED
 
 // Arc interpretation settings:
-#define MM_PER_ARC_SEGMENT 1
+// Arcs are cut into the fewest segments that stay within the tolerance of the true arc (M205 A).
+// While less than SLOWDOWN_BUFFER_TIME of moves is buffered the segments are made to last up to 
+// the minimum segment time (M205 B) as well, so that the planner keeps up.
+#define DEFAULT_ARC_TOLERANCE 0.01 // (mm)
+#define MIN_MM_PER_ARC_SEGMENT 0.1
 #define N_ARC_CORRECTION 25
 
 // Defines the number of memory slots for saving/restoring position (M331/M332)
@@ -261,6 +304,19 @@
 // Everything with less than this number of steps will be ignored as move and joined with the next movement
 const unsigned int dropsegments = 5; 
 
+// Runs of short G0/G1 moves that are nearly collinear (curved perimeters cut into tiny segments) are 
+// merged into one planner block before they reach the planner. A move is merged into the run before it 
+// when the feedrate and the extrusion per mm match, the direction turns by less than COALESCE_ANGLE and 
+// no dropped end point is further than COALESCE_TOLERANCE from the merged move.
+//#define COALESCE_MOVES
+#ifdef COALESCE_MOVES
+  #define COALESCE_TOLERANCE     0.005  // (mm)
+  #define COALESCE_ANGLE         2.0    // (degrees)
+  #define COALESCE_E_TOLERANCE   0.02   // largest relative difference of the extrusion per mm
+  #define COALESCE_MAX_MOVES     8      // moves merged into one block at most
+  #define COALESCE_HOLD_TIME     50000  // (us) moves are only held back while the buffer holds more than this
+#endif
+
 // If you are using a RAMPS board or cheap E-bay purchased boards that do not detect when an SD card is inserted
 // You can get round this by connecting a push button or single throw switch to the pin defined as SDCARDCARDDETECT 
 // in the pins.h file.  When using a push button pulling the pin to ground this will need inverted.  This setting should
@@ -288,11 +344,24 @@ const unsigned int dropsegments = 5;
   #define PS_ON_ASLEEP LOW
 #endif
 
+// This is advanced filament compression compensation (C_COMPENSATION) parameter. 
+// Makes the E-steps from their own timer interrupt (timer3, ATmega1280/2560 only). The 
+// stepper interrupt only schedules them and timer3 spaces them evenly at the E rate of 
+// the block plus the compensation rate, so the X/Y steps do not wait behind bursts of 
+// E-steps. The timer3 PWM pins (2, 3 and 5 on the Mega) can't be used for analogWrite().
+// Other MCUs make the E-steps from the stepper interrupt, split as below.
+#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+  #define C_COMPENSATION_E_TIMER
+#endif
+
 // This is advanced filament compression compensation (C_COMPENSATION) parameter. 
 // Uncomment the below define if expecting long slow moves with too many E-steps 
 // per time slice due to the compensation. The define enables code splitting those 
-// steps into chunks of 4 or less.
+// steps into chunks of 4 or less. Not used with C_COMPENSATION_E_TIMER.
 #define C_COMPENSATION_SPLIT_E_STEPS
+#ifdef C_COMPENSATION_E_TIMER
+  #undef C_COMPENSATION_SPLIT_E_STEPS
+#endif
 
 //===========================================================================
 //=============================Buffers           ============================
@@ -301,10 +370,14 @@ const unsigned int dropsegments = 5;
 // The number of linear motions that can be in the plan at any give time.  
 // THE BLOCK_BUFFER_SIZE NEEDS TO BE A POWER OF 2, i.g. 8,16,32 because shifts 
 // and ors are used to do the ringbuffering.
-#if defined SDSUPPORT
-  #define BLOCK_BUFFER_SIZE 16   // SD,LCD,Buttons take more memory, block buffer needs to be smaller
+// "make" reports the RAM the buffer takes after the build, the firmware prints it at startup.
+// 32 blocks need the 8K of SRAM of the 1280/2560 or the 16K of the 1284P. Packed, a block_t still 
+// takes about 70 bytes (the step counts and ramp step indexes stay 32 bit), so 32 of them don't 
+// fit on the 4K boards (644P); those keep 16, which take less SRAM than before block_t was packed.
+#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__) || defined(__AVR_ATmega1284P__)
+  #define BLOCK_BUFFER_SIZE 32
 #else
-  #define BLOCK_BUFFER_SIZE 16 // maximize block buffer
+  #define BLOCK_BUFFER_SIZE 16   // SD,LCD,Buttons take more memory, block buffer needs to be smaller
 #endif
 
 
@@ -312,6 +385,41 @@ const unsigned int dropsegments = 5;
 #define MAX_CMD_SIZE 96
 #define BUFSIZE 4
 
+// Uncomment to have every "ok" carry the number of the last line and the free 
+// planner and command buffer slots ("ok N123 P14 B3"), so that the host can 
+// keep several lines in flight instead of waiting for each "ok". The command 
+// buffer is then filled up to its last slot.
+//#define ADVANCED_OK
+
+// Uncomment to accept moves as binary packets after M580, about a third of the
+// bytes of a G1 line and no parsing: 0xA5, opcode, sequence number, argument,
+// payload, CRC16. host/binary_stream.py documents the packets and converts
+// G-code. Leave binary mode before writing to the SD card (M28). Files of
+// packets print from the SD card as well, without the G-code parsing.
+//#define BINARY_PROTOCOL
+
+// Bytes of serial output queued for the transmit interrupt, so replies like 
+// "ok" and temperature reports don't hold up the main loop while they go out. 
+// Has to be a power of 2 no bigger than 256; 0 waits for every byte instead.
+#define TX_BUFFER_SIZE 64
+
+// Bytes of serial input buffered ahead of the command parser, a power of 2. 
+// Up to 256 the buffer indexes are single bytes.
+#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+  #define RX_BUFFER_SIZE 256
+#else
+  #define RX_BUFFER_SIZE 128
+#endif
+
+// Uncomment to send XOFF when the serial input buffer is nearly full and XON 
+// once it has room again, so the host can stream lines without waiting for 
+// each "ok". Turn on XON/XOFF flow control in the host program. XOFF goes out 
+// with RX_XOFF_FREE bytes left, enough for what the host and its USB adapter 
+// still send after it. Needs TX_BUFFER_SIZE.
+//#define SERIAL_XON_XOFF
+#define RX_XOFF_FREE 64
+#define RX_XON_FREE (RX_BUFFER_SIZE/2)
+
 
 // Firmware based and LCD controled retract
 // M207 and M208 can be used to define parameters for the retraction. 
@@ -363,6 +471,25 @@ const unsigned int dropsegments = 5;
 // be used to re-enable the output during printing without re-compilation.
 #define NO_ECHO_WHILE_PRINTING
 
+// Uncomment to count the cycles the stepper, temperature and serial receive 
+// interrupts take (min/avg/max and a histogram) and the steps the stepper 
+// interrupt returned too late for. M577 reports them, M577 R clears them. 
+// Uses timer5, so it needs an ATmega1280/2560. Its PWM pins (44, 45 and 46 
+// on the Mega) then lose analogWrite(), and setPwmFrequency() (FAST_PWM_FAN) 
+// on them would change the prescaler and with it the counts.
+//#define ISR_PROFILER
+
+// Uncomment to have the interrupt handlers log debug output (the C_COMP and 
+// ACCEL_STEPS debug flags, stepper rate too high) as binary records in a ring 
+// buffer instead of printing it from inside the interrupt. Without it those 
+// flags print from the interrupt as before, which holds up the stepper. The main loop 
+// sends them out as "trace:" lines, or with M578 S2 <file> to the SD card. 
+// host/trace_decode.py converts either to CSV. With several debug flags on 
+// the serial port can't keep up, the lost records are counted in the trace. 
+// The buffer takes 21 bytes of RAM per record, its size is a power of 2.
+//#define ISR_TRACE
+#define TRACE_BUFFER_SIZE 16
+
 //===========================================================================
 //=============================  Define Defines  ============================
 //===========================================================================
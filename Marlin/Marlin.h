@@ -34,8 +34,6 @@
 # define analogInputToDigitalPin(p) ((p) + A0)
 #endif
 
-#include "MarlinSerial.h"
-
 #ifndef cbi
 #define cbi(sfr, bit) (_SFR_BYTE(sfr) &= ~_BV(bit))
 #endif
@@ -43,6 +41,8 @@
 #define sbi(sfr, bit) (_SFR_BYTE(sfr) |= _BV(bit))
 #endif
 
+#include "MarlinSerial.h"
+
 #include "WString.h"
 
 #ifdef AT90USB
@@ -196,6 +196,10 @@ void ClearToSend();
 
 void get_coordinates();
 void prepare_move();
+#ifdef COALESCE_MOVES
+void flush_pending_move();
+void discard_pending_move();
+#endif
 void kill();
 void Stop();
 
@@ -203,6 +207,7 @@ bool IsStopped();
 
 void enquecommand(const char *cmd); //put an ascii command at the end of the current buffer.
 void enquecommand_P(const char *cmd); //put an ascii command at the end of the current buffer, read from flash
+float parse_float(const char *p); //strtod() for the numbers of a G-code line
 void prepare_arc_move(char isclockwise);
 void clamp_to_software_endstops(float target[3]);
 
@@ -22,6 +22,7 @@
 
 #include "Marlin.h"
 #include "MarlinSerial.h"
+#include "isr_profiler.h"
 
 #ifndef AT90USB
 // this next line disables the entire HardwareSerial.cpp, 
@@ -32,19 +33,14 @@
   ring_buffer rx_buffer  =  { { 0 }, 0, 0 };
 #endif
 
-FORCE_INLINE void store_char(unsigned char c)
-{
-  int i = (unsigned int)(rx_buffer.head + 1) % RX_BUFFER_SIZE;
-
-  // if we should be storing the received character into the location
-  // just before the tail (meaning that the head would advance to the
-  // current location of the tail), we're about to overflow the buffer
-  // and so we don't write the character or advance the head.
-  if (i != rx_buffer.tail) {
-    rx_buffer.buffer[rx_buffer.head] = c;
-    rx_buffer.head = i;
-  }
-}
+volatile unsigned long rx_dropped;
+volatile unsigned long rx_framing_errors;
+volatile unsigned long rx_data_overruns;
+
+#ifdef SERIAL_XON_XOFF
+  volatile bool rx_xoff_sent;
+  volatile unsigned char tx_xon_xoff;
+#endif
 
 
 //#elif defined(SIG_USART_RECV)
@@ -53,11 +49,27 @@ FORCE_INLINE void store_char(unsigned char c)
   //SIGNAL(SIG_USART_RECV)
   SIGNAL(M_USARTx_RX_vect)
   {
-    unsigned char c  =  M_UDRx;
-    store_char(c);
+    #ifdef ISR_PROFILER
+    unsigned short start = isr_profile_start();
+    #endif
+    receive_char();
+    #ifdef ISR_PROFILER
+    isr_profile_end(ISR_PROFILE_SERIAL_RX, start);
+    #endif
   }
 #endif
 
+#if TX_BUFFER_SIZE > 0
+  tx_ring_buffer tx_buffer = { { 0 }, 0, 0 };
+
+  #if defined(M_USARTx_UDRE_vect)
+  SIGNAL(M_USARTx_UDRE_vect)
+  {
+    tx_send_next();
+  }
+  #endif
+#endif // TX_BUFFER_SIZE > 0
+
 // Constructors ////////////////////////////////////////////////////////////////
 
 MarlinSerial::MarlinSerial()
@@ -103,13 +115,60 @@ void MarlinSerial::end()
   cbi(M_UCSRxB, M_RXENx);
   cbi(M_UCSRxB, M_TXENx);
   cbi(M_UCSRxB, M_RXCIEx);  
+#if TX_BUFFER_SIZE > 0
+  cbi(M_UCSRxB, M_UDRIEx);
+  tx_buffer.head = tx_buffer.tail;
+#endif
 }
 
+#if TX_BUFFER_SIZE > 0
+void MarlinSerial::write(uint8_t c)
+{
+  // With interrupts off (in an interrupt handler, kill()) nothing would empty
+  // the buffer, so send what is queued and the byte itself the blocking way.
+  if (!(SREG & 0x80)) {
+    while (tx_pending()) {
+      while (!((M_UCSRxA) & (1 << M_UDREx)))
+        ;
+      tx_send_next();
+    }
+    while (!((M_UCSRxA) & (1 << M_UDREx)))
+      ;
+    M_UDRx = c;
+    return;
+  }
+  // Nothing queued and the data register free: skip the buffer. The receive
+  // interrupt may queue an XON/XOFF in between, so check and send in one go.
+  {
+    CRITICAL_SECTION_START;
+    bool sent = !tx_pending() && ((M_UCSRxA) & (1 << M_UDREx));
+    if (sent)
+      M_UDRx = c;
+    CRITICAL_SECTION_END;
+    if (sent)
+      return;
+  }
+  unsigned char h = tx_buffer.head;
+  unsigned char i = (h + 1) & (TX_BUFFER_SIZE - 1);
+  // Full: rather than wait for the interrupt, which a long stepper interrupt
+  // can hold up, make room by sending the oldest byte from here
+  while (i == tx_buffer.tail) {
+    CRITICAL_SECTION_START;
+    if (i == tx_buffer.tail && ((M_UCSRxA) & (1 << M_UDREx)))
+      tx_send_next();
+    CRITICAL_SECTION_END;
+  }
+  tx_buffer.buffer[h] = c;
+  tx_buffer.head = i;
+  sbi(M_UCSRxB, M_UDRIEx);
+}
+#endif // TX_BUFFER_SIZE > 0
+
 
 
 int MarlinSerial::peek(void)
 {
-  if (rx_buffer.head == rx_buffer.tail) {
+  if (rx_head() == rx_buffer.tail) {
     return -1;
   } else {
     return rx_buffer.buffer[rx_buffer.tail];
@@ -119,11 +178,17 @@ int MarlinSerial::peek(void)
 int MarlinSerial::read(void)
 {
   // if the head isn't ahead of the tail, we don't have any characters
-  if (rx_buffer.head == rx_buffer.tail) {
+  if (rx_head() == rx_buffer.tail) {
     return -1;
   } else {
-    unsigned char c = rx_buffer.buffer[rx_buffer.tail];
-    rx_buffer.tail = (unsigned int)(rx_buffer.tail + 1) % RX_BUFFER_SIZE;
+    rx_index_t t = rx_buffer.tail;
+    unsigned char c = rx_buffer.buffer[t];
+    rx_set_tail((rx_index_t)(t + 1) & (RX_BUFFER_SIZE - 1));
+    #ifdef SERIAL_XON_XOFF
+    if (rx_xoff_sent && RX_BUFFER_SIZE - 1 - available() >= RX_XON_FREE) {
+      resume();
+    }
+    #endif
     return c;
   }
 }
@@ -139,7 +204,51 @@ void MarlinSerial::flush()
   // the value to rx_buffer_tail; the previous value of rx_buffer_head
   // may be written to rx_buffer_tail, making it appear as if the buffer
   // were full, not empty.
+  CRITICAL_SECTION_START;
   rx_buffer.head = rx_buffer.tail;
+  CRITICAL_SECTION_END;
+  #ifdef SERIAL_XON_XOFF
+  if (rx_xoff_sent) {
+    resume();
+  }
+  #endif
+}
+
+#ifdef SERIAL_XON_XOFF
+// Lets the host go on after an XOFF
+void MarlinSerial::resume()
+{
+  CRITICAL_SECTION_START;
+  rx_xoff_sent = false;
+  tx_xon_xoff = XON;
+  sbi(M_UCSRxB, M_UDRIEx);
+  CRITICAL_SECTION_END;
+}
+#endif
+
+// Serial RX dropped:N framing:N overrun:N
+void MarlinSerial::reportErrors()
+{
+  CRITICAL_SECTION_START;
+  unsigned long dropped = rx_dropped;
+  unsigned long framing = rx_framing_errors;
+  unsigned long overruns = rx_data_overruns;
+  CRITICAL_SECTION_END;
+  SERIAL_PROTOCOLPGM("Serial RX dropped:");
+  SERIAL_PROTOCOL(dropped);
+  SERIAL_PROTOCOLPGM(" framing:");
+  SERIAL_PROTOCOL(framing);
+  SERIAL_PROTOCOLPGM(" overrun:");
+  SERIAL_PROTOCOLLN(overruns);
+}
+
+void MarlinSerial::resetErrors()
+{
+  CRITICAL_SECTION_START;
+  rx_dropped = 0;
+  rx_framing_errors = 0;
+  rx_data_overruns = 0;
+  CRITICAL_SECTION_END;
 }
 
 
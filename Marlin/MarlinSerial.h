@@ -27,10 +27,30 @@
 #define SERIAL_PORT 0
 #endif
 
-// The presence of the UBRRH register is used to detect a UART.
-#define UART_PRESENT(port) ((port == 0 && (defined(UBRRH) || defined(UBRR0H))) || \
-						(port == 1 && defined(UBRR1H)) || (port == 2 && defined(UBRR2H)) || \
-						(port == 3 && defined(UBRR3H)))				
+// The presence of the UBRRH register is used to detect a UART. "defined" is evaluated here,
+// a macro expanding to it in an #if is not portable.
+#if defined(UBRRH) || defined(UBRR0H)
+#define UART0_PRESENT 1
+#else
+#define UART0_PRESENT 0
+#endif
+#ifdef UBRR1H
+#define UART1_PRESENT 1
+#else
+#define UART1_PRESENT 0
+#endif
+#ifdef UBRR2H
+#define UART2_PRESENT 1
+#else
+#define UART2_PRESENT 0
+#endif
+#ifdef UBRR3H
+#define UART3_PRESENT 1
+#else
+#define UART3_PRESENT 0
+#endif
+#define UART_PRESENT(port) ((port == 0 && UART0_PRESENT) || (port == 1 && UART1_PRESENT) || \
+						(port == 2 && UART2_PRESENT) || (port == 3 && UART3_PRESENT))
 						
 // These are macros to build serial port register names for the selected SERIAL_PORT (C preprocessor
 // requires two levels of indirection to expand macro values properly)
@@ -49,11 +69,15 @@
 #define M_TXENx SERIAL_REGNAME(TXEN,SERIAL_PORT,)    
 #define M_RXCIEx SERIAL_REGNAME(RXCIE,SERIAL_PORT,)    
 #define M_UDREx SERIAL_REGNAME(UDRE,SERIAL_PORT,)    
+#define M_UDRIEx SERIAL_REGNAME(UDRIE,SERIAL_PORT,)    
 #define M_UDRx SERIAL_REGNAME(UDR,SERIAL_PORT,)  
 #define M_UBRRxH SERIAL_REGNAME(UBRR,SERIAL_PORT,H)
 #define M_UBRRxL SERIAL_REGNAME(UBRR,SERIAL_PORT,L)
 #define M_RXCx SERIAL_REGNAME(RXC,SERIAL_PORT,)
+#define M_FEx SERIAL_REGNAME(FE,SERIAL_PORT,)
+#define M_DORx SERIAL_REGNAME(DOR,SERIAL_PORT,)
 #define M_USARTx_RX_vect SERIAL_REGNAME(USART,SERIAL_PORT,_RX_vect)
+#define M_USARTx_UDRE_vect SERIAL_REGNAME(USART,SERIAL_PORT,_UDRE_vect)
 #define M_U2Xx SERIAL_REGNAME(U2X,SERIAL_PORT,)
 
 
@@ -70,20 +94,168 @@
 // using a ring buffer (I think), in which rx_buffer_head is the index of the
 // location to which to write the next incoming character and rx_buffer_tail
 // is the index of the location from which to read.
+#ifndef RX_BUFFER_SIZE
 #define RX_BUFFER_SIZE 128
+#endif
 
+#if (RX_BUFFER_SIZE & (RX_BUFFER_SIZE - 1)) != 0
+#error "RX_BUFFER_SIZE must be a power of 2"
+#endif
+
+// Up to 256 bytes the indexes fit a byte, and the interrupt and the main
+// context can read each other's index without turning interrupts off.
+// Bigger buffers take two loads or stores per index, so the main context
+// goes through rx_head() and rx_set_tail() below.
+#if RX_BUFFER_SIZE <= 256
+typedef unsigned char rx_index_t;
+#else
+typedef unsigned int rx_index_t;
+#endif
 
 struct ring_buffer
 {
   unsigned char buffer[RX_BUFFER_SIZE];
-  int head;
-  int tail;
+  volatile rx_index_t head;
+  volatile rx_index_t tail;
 };
 
 #if UART_PRESENT(SERIAL_PORT)
   extern ring_buffer rx_buffer;
+
+// The head the interrupt moves, as the main context sees it
+FORCE_INLINE rx_index_t rx_head()
+{
+  #if RX_BUFFER_SIZE <= 256
+  return rx_buffer.head;
+  #else
+  unsigned char sreg = SREG;
+  cli();
+  rx_index_t h = rx_buffer.head;
+  SREG = sreg;
+  return h;
+  #endif
+}
+
+// Moves the tail the interrupt reads, from the main context
+FORCE_INLINE void rx_set_tail(rx_index_t t)
+{
+  #if RX_BUFFER_SIZE <= 256
+  rx_buffer.tail = t;
+  #else
+  unsigned char sreg = SREG;
+  cli();
+  rx_buffer.tail = t;
+  SREG = sreg;
+  #endif
+}
+#endif
+
+// Receive errors, counted since startup or the last M579 R
+extern volatile unsigned long rx_dropped;        // The buffer was full
+extern volatile unsigned long rx_framing_errors; // Bad stop bit, usually a baud rate mismatch
+extern volatile unsigned long rx_data_overruns;  // The USART lost a byte before it was read
+
+#ifndef TX_BUFFER_SIZE
+#define TX_BUFFER_SIZE 0
+#endif
+
+#ifdef SERIAL_XON_XOFF
+#if TX_BUFFER_SIZE == 0
+#error "SERIAL_XON_XOFF needs TX_BUFFER_SIZE"
+#endif
+#define XON  0x11
+#define XOFF 0x13
+extern volatile bool rx_xoff_sent;
+extern volatile unsigned char tx_xon_xoff; // Goes out ahead of the queued output, 0 for none
 #endif
 
+#if TX_BUFFER_SIZE > 0
+#if (TX_BUFFER_SIZE & (TX_BUFFER_SIZE - 1)) != 0 || TX_BUFFER_SIZE > 256
+#error "TX_BUFFER_SIZE must be a power of 2 no bigger than 256"
+#endif
+
+// Output waiting for the data register empty interrupt. The main context
+// only moves the head, the interrupt only the tail.
+struct tx_ring_buffer
+{
+  unsigned char buffer[TX_BUFFER_SIZE];
+  volatile unsigned char head;
+  volatile unsigned char tail;
+};
+
+extern tx_ring_buffer tx_buffer;
+
+// Sends the next byte (with the data register free), turns the data register
+// empty interrupt off once nothing is left
+FORCE_INLINE void tx_send_next()
+{
+  #ifdef SERIAL_XON_XOFF
+  if (tx_xon_xoff) {
+    M_UDRx = tx_xon_xoff;
+    tx_xon_xoff = 0;
+    return;
+  }
+  #endif
+  unsigned char t = tx_buffer.tail;
+  if (t != tx_buffer.head) {
+    M_UDRx = tx_buffer.buffer[t];
+    t = (t + 1) & (TX_BUFFER_SIZE - 1);
+    tx_buffer.tail = t;
+  }
+  if (t == tx_buffer.head) {
+    cbi(M_UCSRxB, M_UDRIEx);
+  }
+}
+
+// True while there is something for tx_send_next()
+FORCE_INLINE bool tx_pending()
+{
+  #ifdef SERIAL_XON_XOFF
+  if (tx_xon_xoff) return true;
+  #endif
+  return tx_buffer.head != tx_buffer.tail;
+}
+#endif // TX_BUFFER_SIZE > 0
+
+// Called from the receive interrupt and the stepper interrupt
+FORCE_INLINE void store_char(unsigned char c)
+{
+  rx_index_t h = rx_buffer.head;
+  rx_index_t i = (rx_index_t)(h + 1) & (RX_BUFFER_SIZE - 1);
+
+  // if we should be storing the received character into the location
+  // just before the tail (meaning that the head would advance to the
+  // current location of the tail), we're about to overflow the buffer
+  // and so we don't write the character or advance the head.
+  if (i != rx_buffer.tail) {
+    rx_buffer.buffer[h] = c;
+    rx_buffer.head = i;
+  } else {
+    rx_dropped++;
+  }
+  #ifdef SERIAL_XON_XOFF
+  // Ask the host to stop while what it already has on the way still fits
+  if (!rx_xoff_sent && ((rx_index_t)(rx_buffer.tail - i - 1) & (RX_BUFFER_SIZE - 1)) < RX_XOFF_FREE) {
+    rx_xoff_sent = true;
+    tx_xon_xoff = XOFF;
+    sbi(M_UCSRxB, M_UDRIEx);
+  }
+  #endif
+}
+
+// Reads a byte off the USART, with its error flags
+FORCE_INLINE void receive_char()
+{
+  unsigned char status = M_UCSRxA;
+  unsigned char c = M_UDRx;
+  if (status & (1 << M_DORx)) rx_data_overruns++;
+  if (status & (1 << M_FEx)) {
+    rx_framing_errors++;
+    return;
+  }
+  store_char(c);
+}
+
 class MarlinSerial //: public Stream
 {
 
@@ -97,9 +269,21 @@ class MarlinSerial //: public Stream
     
     FORCE_INLINE int available(void)
     {
-      return (unsigned int)(RX_BUFFER_SIZE + rx_buffer.head - rx_buffer.tail) % RX_BUFFER_SIZE;
+      return (rx_index_t)(rx_head() - rx_buffer.tail) & (RX_BUFFER_SIZE - 1);
     }
     
+#if TX_BUFFER_SIZE > 0
+    void write(uint8_t c);
+    
+    // Moves the next queued byte to the data register if it is free. For the 
+    // places that keep interrupts off for long (the stepper interrupt).
+    FORCE_INLINE void checkTx(void)
+    {
+      if(tx_pending() && ((M_UCSRxA) & (1 << M_UDREx))) {
+        tx_send_next();
+      }
+    }
+#else
     FORCE_INLINE void write(uint8_t c)
     {
       while (!((M_UCSRxA) & (1 << M_UDREx)))
@@ -107,25 +291,22 @@ class MarlinSerial //: public Stream
 
       M_UDRx = c;
     }
+#endif
     
     
     FORCE_INLINE void checkRx(void)
     {
       if((M_UCSRxA & (1<<M_RXCx)) != 0) {
-        unsigned char c  =  M_UDRx;
-        int i = (unsigned int)(rx_buffer.head + 1) % RX_BUFFER_SIZE;
-
-        // if we should be storing the received character into the location
-        // just before the tail (meaning that the head would advance to the
-        // current location of the tail), we're about to overflow the buffer
-        // and so we don't write the character or advance the head.
-        if (i != rx_buffer.tail) {
-          rx_buffer.buffer[rx_buffer.head] = c;
-          rx_buffer.head = i;
-        }
+        receive_char();
       }
     }
     
+    void reportErrors(void);
+    void resetErrors(void);
+    #ifdef SERIAL_XON_XOFF
+    void resume(void);
+    #endif
+    
     
     private:
     void printNumber(unsigned long, uint8_t);
@@ -38,6 +38,8 @@
 #include "watchdog.h"
 #include "ConfigurationStore.h"
 #include "language.h"
+#include "isr_profiler.h"
+#include "trace.h"
 #include "pins_arduino.h"
 #include "stdio.h"
 
@@ -92,6 +94,7 @@
 // M30  - Delete file from SD (M30 filename.g)
 // M31  - Output time since last M109 or SD card start to serial
 // M42  - Change pin status via gcode Use M42 Px Sy to set pin x to value y, when omitting Px the onboard led will be used.
+// M78  - Output the planned motion time in seconds: done, still queued and, while printing from SD, left. R resets done.
 // M80  - Turn on Power Supply
 // M81  - Turn off Power Supply
 // M82  - Set E codes absolute (default)
@@ -111,7 +114,7 @@
 // M202 - Set max acceleration in units/s^2 for travel moves (M202 X1000 Y1000) Unused in Marlin!!
 // M203 - Set maximum feedrate that your machine can sustain (M203 X200 Y200 Z300 E10000) in mm/sec
 // M204 - Set default acceleration: S normal moves R filament only moves (M204 S3000 R7000) im mm/sec^2  also sets minimum segment time in ms (B20000) to prevent buffer underruns and M20 minimum feedrate, T sets the extruder R applies to
-// M205 - Advanced settings:  minimum travel speed S=while printing V=travel only,  B=minimum segment time X= maximum xy jerk, Z=maximum Z jerk, E=maximum E jerk (for retracts), T=extruder E applies to
+// M205 - Advanced settings:  minimum travel speed S=while printing V=travel only,  B=minimum segment time X= maximum xy jerk, Z=maximum Z jerk, E=maximum E jerk (for retracts), T=extruder E applies to, J=junction deviation (mm), A=arc tolerance (mm)
 // M206 - set additional homeing offset
 // M207 - set retract length S[positive mm] F[feedrate mm/sec] Z[additional zlift/hop]
 // M208 - set recover=unretract length S[positive mm surplus to the M207 S*] F[feedrate mm/sec]
@@ -144,6 +147,12 @@
 // M502 - reverts to the default "factory settings".  You still need to store them in EEPROM afterwards if you want to.
 // M503 - print the current settings (from memory not from eeprom)
 // M540 - Use S[0|1] to enable or disable the stop SD card print on endstop hit (requires ABORT_ON_ENDSTOP_HIT_FEATURE_ENABLED)
+// M576 - Report the planner buffer: queued moves, the time in us they take and the segment underruns (R clears them)
+// M577 - Report the interrupt cycle counts, R clears them (requires ISR_PROFILER)
+// M578 - Interrupt trace output: S0 off, S1 serial, S2 <filename> SD file (requires ISR_TRACE)
+// M579 - Report the serial receive errors, R clears them
+// M580 - Switch the serial line to binary move packets (requires BINARY_PROTOCOL)
+// M581 - Report the SD block cache hits and misses, R clears them
 // M600 - Pause for filament change X[pos] Y[pos] Z[relative lift] E[initial retract] L[later retract distance for removal]
 // M907 - Set digital trimpot motor current using axis codes.
 // M908 - Control digital trimpot directly.
@@ -216,6 +225,7 @@ float extruder_offset[2][EXTRUDERS] = {
   int gCComp_size[EXTRUDERS];
   int gCComp_max_size = sizeof(gCComp) / ((EXTRUDERS * sizeof(float)) << 1);
   float gCCom_min_speed[EXTRUDERS] = C_COMPENSATION_MIN_SPEED;
+  c_comp_segment_t gCCompTable[sizeof(gCComp) / sizeof(gCComp[0]) + 1][EXTRUDERS];
 #endif // C_COMPENSATION
 
 #ifdef FWRETRACT
@@ -253,6 +263,12 @@ static bool relative_mode = false;  //Determines Absolute or Relative Coordinate
 
 static char cmdbuffer[BUFSIZE][MAX_CMD_SIZE];
 static bool fromsd[BUFSIZE];
+#ifdef ADVANCED_OK
+static long cmdbuffer_N[BUFSIZE];           // Line number each command came with, for its "ok"
+#define QUEUED_LINE(slot) cmdbuffer_N[slot]
+#else
+#define QUEUED_LINE(slot) 0
+#endif
 static int bufindr = 0;
 static int bufindw = 0;
 static int buflen = 0;
@@ -261,6 +277,36 @@ static int serial_count = 0;
 static int recovery_count = 0;
 static boolean comment_mode = false;
 static char *strchr_pointer; // just a pointer to find chars in the cmd string like X, Y, Z, E, etc
+#ifdef BINARY_PROTOCOL
+// Packets: 0xA5, opcode, sequence number, argument, payload, CRC16 over opcode to payload.
+// Values are little endian, positions in um, the feedrate in mm/min.
+#define BINARY_SYNC     0xA5
+#define BINARY_MOVE_ABS 1    // Argument: axes present (bits 0-3 XYZE, bit 4 F). Payload: int32 positions, uint16 F
+#define BINARY_MOVE_REL 2    // The same with int16 distances
+#define BINARY_TEXT     3    // Argument: length. Payload: a G-code line without line number and checksum
+#define BINARY_EXIT     4    // Back to G-code lines
+#define BINARY_F        0x10
+#define BINARY_TIMEOUT  200  // ms without a byte before a packet cut short is asked for again
+static bool binary_mode = false;
+static bool frombinary[BUFSIZE];            // Slot holds opcode, argument and payload of a move packet
+static unsigned char binary_header[3];      // Opcode, sequence number, argument of the packet being received
+static unsigned char binary_count;          // Bytes of it received, sync included
+static unsigned char binary_length;         // Payload and CRC bytes it has
+static unsigned char binary_seq;            // Sequence number expected next
+static bool binary_resend;                  // Packets are dropped until the one asked for arrives
+static unsigned long binary_last_byte;      // millis() when the last byte of the packet came in
+static long binary_position[NUM_AXIS];      // um, where the packets left the axes
+static bool binary_position_known = false;  // Cleared by G-code, which may move or redefine the axes
+#ifdef SDSUPPORT
+static bool sd_binary = false;              // The file being printed has reached packets
+#endif
+#endif
+
+// The command being processed, scanned once by parse_command(): where each 
+// letter first occurs (offset + 1, 0 if it doesn't) and the number after it
+static unsigned char code_pos[26];
+static float code_values[26];
+static unsigned char code_index; // Letter of the last code_seen() - 'A'
 
 const int sensitive_pins[] = SENSITIVE_PINS; // Sensitive pin list for M42
 
@@ -280,6 +326,7 @@ bool do_print = true;
 
 unsigned long starttime=0;
 unsigned long stoptime=0;
+static float motion_time_start = 0; // plan_executed_time() at the last M78 R
 
 static uint8_t tmp_extruder;
 
@@ -288,6 +335,18 @@ bool Stopped=false;
 bool pos_saved=false;
 float saved_position[NUM_POSITON_SLOTS][NUM_AXIS];
 
+#ifdef COALESCE_MOVES
+// Run of collinear moves held back by prepare_move(), planned by flush_pending_move()
+static bool pending_move = false;
+static uint8_t pending_count;                         // Moves merged into the run
+static float pending_start[2];                        // XY where the run starts
+static float pending_target[NUM_AXIS];                // and where it ends
+static float pending_points[COALESCE_MAX_MOVES-1][2]; // XY end points of the merged moves but the last
+static float pending_direction[2];                    // Unit XY direction of the last move
+static float pending_feedrate;                        // mm/sec
+static float pending_e_per_mm;                        // Extrusion per mm of XY travel of the first move
+#endif
+
 //===========================================================================
 //=============================ROUTINES=============================
 //===========================================================================
@@ -303,10 +362,10 @@ extern "C"{
   int freeMemory() {
     int free_memory;
 
-    if((int)__brkval == 0)
-      free_memory = ((int)&free_memory) - ((int)&__bss_end);
+    if(__brkval == 0)
+      free_memory = (char *)&free_memory - (char *)&__bss_end;
     else
-      free_memory = ((int)&free_memory) - ((int)__brkval);
+      free_memory = (char *)&free_memory - (char *)__brkval;
 
     return free_memory;
   }
@@ -321,6 +380,9 @@ void enquecommand(const char *cmd)
   {
     //this is dangerous if a mixing of serial and this happsens
     strcpy(&(cmdbuffer[bufindw][0]),cmd);
+    #ifdef BINARY_PROTOCOL
+    frombinary[bufindw] = false;
+    #endif
     SERIAL_ECHO_START;
     SERIAL_ECHOPGM("enqueing \"");
     SERIAL_ECHO(cmdbuffer[bufindw]);
@@ -336,6 +398,9 @@ void enquecommand_P(const char *cmd)
   {
     //this is dangerous if a mixing of serial and this happsens
     strcpy_P(&(cmdbuffer[bufindw][0]),cmd);
+    #ifdef BINARY_PROTOCOL
+    frombinary[bufindw] = false;
+    #endif
     SERIAL_ECHO_START;
     SERIAL_ECHOPGM("enqueing \"");
     SERIAL_ECHO(cmdbuffer[bufindw]);
@@ -421,7 +486,10 @@ void setup()
   SERIAL_ECHOPGM(MSG_FREE_MEMORY);
   SERIAL_ECHO(freeMemory());
   SERIAL_ECHOPGM(MSG_PLANNER_BUFFER_BYTES);
-  SERIAL_ECHOLN((int)sizeof(block_t)*BLOCK_BUFFER_SIZE);
+  SERIAL_ECHO((int)sizeof(block_t)*BLOCK_BUFFER_SIZE);
+  SERIAL_ECHOPAIR(" (", (int)BLOCK_BUFFER_SIZE);
+  SERIAL_ECHOPAIR(" x ", (int)sizeof(block_t));
+  SERIAL_ECHOLNPGM(")");
   for(int8_t i = 0; i < BUFSIZE; i++)
   {
     fromsd[i] = false;
@@ -439,6 +507,9 @@ void setup()
   
   Config_RetrieveSettings(); // loads data from EEPROM if available
 
+  #ifdef ISR_PROFILER
+  isr_profiler_init();
+  #endif
   tp_init();    // Initialize temperature loop 
   plan_init();  // Initialize planner;
   watchdog_init();
@@ -494,7 +565,11 @@ void printHeatersState(bool new_mode, uint8_t e)
 
 void loop()
 {
+  #ifdef ADVANCED_OK
+  if(buflen < BUFSIZE)
+  #else
   if(buflen < (BUFSIZE-1))
+  #endif
     get_command();
   #ifdef SDSUPPORT
   card.checkautostart(false);
@@ -525,6 +600,13 @@ void loop()
     buflen = (buflen-1);
     bufindr = (bufindr + 1)%BUFSIZE;
   }
+  #ifdef COALESCE_MOVES
+  else if(plan_buffered_time() < COALESCE_HOLD_TIME)
+  {
+    // Nothing follows the held back moves yet, don't let the planner run dry waiting for it
+    flush_pending_move();
+  }
+  #endif
   //check heater every n milliseconds
   manage_heater();
   manage_inactivity();
@@ -532,8 +614,319 @@ void loop()
   lcd_update();
 }
 
+// "ok", with ADVANCED_OK followed by the number of the line it answers and the free planner and
+// command buffer slots
+static void send_ok(long line, unsigned char free_commands)
+{
+  #ifdef ADVANCED_OK
+  SERIAL_PROTOCOLPGM(MSG_OK);
+  SERIAL_PROTOCOLPGM(" N");
+  SERIAL_PROTOCOL(line);
+  SERIAL_PROTOCOLPGM(" P");
+  SERIAL_PROTOCOL((int)(BLOCK_BUFFER_SIZE - 1 - movesplanned()));
+  SERIAL_PROTOCOLPGM(" B");
+  SERIAL_PROTOCOLLN((int)free_commands);
+  #else
+  (void)line; // Only ADVANCED_OK reports them
+  (void)free_commands;
+  SERIAL_PROTOCOLLNPGM(MSG_OK); 
+  #endif
+}
+
+static const double pow10_table[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+// Beyond this a float is infinite or 0 whatever the digits
+#define PARSE_FLOAT_MAX_EXPONENT 60
+
+// strtod() for G-code numbers: blanks, a sign, digits and a decimal point,
+// no exponent (an 'E' after a number is the next parameter). Keeps 9 digits.
+// Scales in double, which the AVR has as float anyway, so that the host build
+// rounds like strtod().
+float parse_float(const char *p)
+{
+  while(*p == ' ' || *p == '\t') p++;
+  bool negative = (*p == '-');
+  if(*p == '-' || *p == '+') p++;
+  unsigned long mantissa = 0;
+  signed char exponent = 0; // Held within +-PARSE_FLOAT_MAX_EXPONENT
+  for(; *p >= '0' && *p <= '9'; p++) {
+    if(mantissa < 100000000UL) mantissa = mantissa * 10 + (*p - '0');
+    else if(exponent < PARSE_FLOAT_MAX_EXPONENT) exponent++;
+  }
+  if(*p == '.') {
+    for(p++; *p >= '0' && *p <= '9'; p++) {
+      if(mantissa < 100000000UL && exponent > -PARSE_FLOAT_MAX_EXPONENT) {
+        mantissa = mantissa * 10 + (*p - '0');
+        exponent--;
+      }
+    }
+  }
+  double value = mantissa;
+  if(exponent != 0) {
+    unsigned char n = exponent < 0 ? -exponent : exponent;
+    double scale = pow10_table[n > 9 ? 9 : n];
+    // More than 9 integer digits or leading zeros after the point: powers up
+    // to 1e22 are still exact in double
+    while(n > 9) {
+      n -= 9;
+      scale *= pow10_table[n > 9 ? 9 : n];
+    }
+    value = exponent < 0 ? value / scale : value * scale;
+  }
+  return negative ? -value : value;
+}
+
+// strtol(p, NULL, 10) without the locale and overflow handling
+static long parse_long(const char *p)
+{
+  while(*p == ' ' || *p == '\t') p++;
+  bool negative = (*p == '-');
+  if(*p == '-' || *p == '+') p++;
+  long value = 0;
+  for(; *p >= '0' && *p <= '9'; p++)
+    value = value * 10 + (*p - '0');
+  return negative ? -value : value;
+}
+
+#ifdef SDSUPPORT
+static void finish_sd_print()
+{
+  SERIAL_PROTOCOLLNPGM(MSG_FILE_PRINTED);
+  stoptime=millis();
+  char time[30];
+  unsigned long t=(stoptime-starttime)/1000;
+  int hours, minutes;
+  minutes=(t/60)%60;
+  hours=t/60/60;
+  sprintf_P(time, PSTR("%i hours %i minutes"),hours, minutes);
+  SERIAL_ECHO_START;
+  SERIAL_ECHOLN(time);
+  lcd_setstatus(time);
+  #ifdef BINARY_PROTOCOL
+  sd_binary = false;
+  #endif
+  card.printingHasFinished();
+  card.checkautostart(true);
+}
+#endif //SDSUPPORT
+
+// Queues the G-code line received into cmdbuffer[bufindw]. Moves are acknowledged right away.
+static void commit_serial_command()
+{
+  #ifdef ADVANCED_OK
+  cmdbuffer_N[bufindw] = gcode_LastN;
+  #endif
+  strchr_pointer = strchr(cmdbuffer[bufindw], 'G');
+  if(strchr_pointer != NULL)
+  {
+    switch(parse_long(strchr_pointer + 1)) {
+    case 0:
+    case 1:
+    case 2:
+    case 3:
+      if(Stopped == false) { // If printer is stopped by an error the G[0-3] codes are ignored.
+        #ifdef SDSUPPORT
+        if(card.saving)
+          break;
+        #endif //SDSUPPORT
+        send_ok(QUEUED_LINE(bufindw), BUFSIZE - buflen - 1); // This line takes a slot
+      }
+      else {
+        SERIAL_ERRORLNPGM(MSG_ERR_STOPPED);
+        LCD_MESSAGEPGM(MSG_STOPPED);
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  bufindw = (bufindw + 1)%BUFSIZE;
+  buflen += 1;
+}
+
+#ifdef BINARY_PROTOCOL
+// CRC16-CCITT, polynomial 0x1021
+static uint16_t crc16_update(uint16_t crc, uint8_t data)
+{
+  crc ^= (uint16_t)data << 8;
+  for(uint8_t i = 0; i < 8; i++)
+    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  return crc;
+}
+
+static uint8_t binary_axes(uint8_t mask)
+{
+  uint8_t axes = 0;
+  for(int8_t i = 0; i < NUM_AXIS; i++)
+    if(mask & (1 << i)) axes++;
+  return axes;
+}
+
+// Payload and CRC bytes of a packet, 0 for an unknown opcode or a text too long for a slot
+static uint8_t binary_packet_length(uint8_t opcode, uint8_t arg)
+{
+  switch(opcode) {
+  case BINARY_MOVE_ABS: return binary_axes(arg) * 4 + ((arg & BINARY_F) ? 2 : 0) + 2;
+  case BINARY_MOVE_REL: return binary_axes(arg) * 2 + ((arg & BINARY_F) ? 2 : 0) + 2;
+  case BINARY_TEXT: return arg <= MAX_CMD_SIZE - 5 ? arg + 2 : 0;
+  case BINARY_EXIT: return 2;
+  }
+  return 0;
+}
+
+static void binary_request_resend()
+{
+  MYSERIAL.flush();
+  binary_count = 0;
+  binary_resend = true;
+  SERIAL_PROTOCOLPGM(MSG_RESEND);
+  SERIAL_PROTOCOLLN((int)binary_seq);
+  send_ok(gcode_LastN, BUFSIZE - buflen);
+}
+
+// Checks the CRC of a packet whose payload and CRC are in the command slot
+static bool binary_crc_ok(const uint8_t *header, uint8_t packet_length)
+{
+  const uint8_t *payload = (const uint8_t *)cmdbuffer[bufindw] + 2;
+  uint8_t length = packet_length - 2;
+  uint16_t crc = 0xFFFF;
+  for(uint8_t i = 0; i < 3; i++)
+    crc = crc16_update(crc, header[i]);
+  for(uint8_t i = 0; i < length; i++)
+    crc = crc16_update(crc, payload[i]);
+  return crc == (payload[length] | ((uint16_t)payload[length + 1] << 8));
+}
+
+// Queues the packet in header and the command slot. Returns false for EXIT.
+static bool commit_binary_packet(const uint8_t *header, uint8_t packet_length, bool sd)
+{
+  uint8_t *slot = (uint8_t *)cmdbuffer[bufindw];
+  uint8_t length = packet_length - 2;
+  switch(header[0]) {
+  case BINARY_MOVE_ABS:
+  case BINARY_MOVE_REL:
+    slot[0] = header[0];
+    slot[1] = header[2];
+    fromsd[bufindw] = sd;
+    frombinary[bufindw] = true;
+    #ifdef ADVANCED_OK
+    cmdbuffer_N[bufindw] = gcode_LastN; // Packets have no line number
+    #endif
+    if(!sd) {
+      if(Stopped == false)
+        send_ok(QUEUED_LINE(bufindw), BUFSIZE - buflen - 1); // This packet takes a slot
+      else
+        SERIAL_ERRORLNPGM(MSG_ERR_STOPPED);
+    }
+    break;
+  case BINARY_TEXT:
+    memmove(slot, slot + 2, length);
+    slot[length] = 0;
+    fromsd[bufindw] = sd;
+    frombinary[bufindw] = false;
+    if(!sd) {
+      commit_serial_command();
+      return true;
+    }
+    break;
+  default:
+    return false;
+  }
+  bufindw = (bufindw + 1)%BUFSIZE;
+  buflen += 1;
+  return true;
+}
+
+// get_command() in binary mode. The payload goes straight to the command slot,
+// after the opcode and argument: no text to collect, check or parse.
+static void get_binary_commands()
+{
+  if(binary_count != 0 && MYSERIAL.available() == 0 && millis() - binary_last_byte > BINARY_TIMEOUT) {
+    // The rest of the packet got lost on the way, the host waits for an answer
+    binary_request_resend();
+    return;
+  }
+  while(MYSERIAL.available() > 0 && buflen < BUFSIZE) {
+    uint8_t c = MYSERIAL.read();
+    binary_last_byte = millis();
+    uint8_t *slot = (uint8_t *)cmdbuffer[bufindw];
+    if(binary_count == 0) {
+      if(c == BINARY_SYNC) binary_count = 1; // Anything else is noise between packets
+      continue;
+    }
+    if(binary_count < 4) {
+      binary_header[binary_count - 1] = c;
+      if(++binary_count < 4)
+        continue;
+      binary_length = binary_packet_length(binary_header[0], binary_header[2]);
+      if(binary_length == 0)
+        binary_request_resend();
+      continue;
+    }
+    slot[2 + binary_count - 4] = c;
+    if(++binary_count < 4 + binary_length)
+      continue;
+    binary_count = 0;
+
+    if(!binary_crc_ok(binary_header, binary_length)) {
+      binary_request_resend();
+      continue;
+    }
+    if(binary_header[1] != binary_seq) {
+      // Packets sent after a lost one are dropped until the host sends that again
+      if(!binary_resend) binary_request_resend();
+      continue;
+    }
+    binary_resend = false;
+    binary_seq++;
+
+    if(!commit_binary_packet(binary_header, binary_length, false)) {
+      binary_mode = false;
+      send_ok(gcode_LastN, BUFSIZE - buflen);
+      return;
+    }
+  }
+}
+
+#ifdef SDSUPPORT
+// The SD part of get_command() after an M580 line in the file: whole packets
+// read into the command slot, no line assembly
+static void get_sd_binary_commands()
+{
+  while(!card.eof() && buflen < BUFSIZE) {
+    uint8_t *slot = (uint8_t *)cmdbuffer[bufindw];
+    uint8_t sync;
+    uint8_t sd_binary_header[3]; // Not binary_header: a serial packet may be half received
+    uint8_t sd_binary_length = 0;
+    if(card.read(&sync, 1) == 1 && sync == BINARY_SYNC && card.read(sd_binary_header, 3) == 3)
+      sd_binary_length = binary_packet_length(sd_binary_header[0], sd_binary_header[2]);
+    if(sd_binary_length == 0 || card.read(slot + 2, sd_binary_length) != sd_binary_length
+       || !binary_crc_ok(sd_binary_header, sd_binary_length)) {
+      // A file can't send it again
+      SERIAL_ERROR_START;
+      SERIAL_ERRORPGM("Bad packet in file, byte ");
+      SERIAL_ERRORLN(card.getIndex());
+      card.pauseSDPrint();
+      return;
+    }
+    if(!commit_binary_packet(sd_binary_header, sd_binary_length, true)) {
+      sd_binary = false; // G-code lines follow, if anything
+      break;
+    }
+  }
+  if(card.eof())
+    finish_sd_print();
+}
+#endif //SDSUPPORT
+#endif // BINARY_PROTOCOL
+
 void get_command() 
 { 
+  #ifdef BINARY_PROTOCOL
+  if(binary_mode) {
+    get_binary_commands(); // An SD print started by a text packet still reads its file below
+  }
+  else
+  #endif
   while( MYSERIAL.available() > 0  && buflen < BUFSIZE) {
     serial_char = MYSERIAL.read();
     if(serial_char == '\n' || 
@@ -550,7 +943,7 @@ void get_command()
       strchr_pointer = strchr(cmdbuffer[bufindw], 'N');
       if(strchr_pointer != NULL)
       {
-        gcode_N = (strtol(strchr_pointer + 1, NULL, 10));
+        gcode_N = parse_long(strchr_pointer + 1);
         if(gcode_N != (gcode_LastN + 1) && (strstr(cmdbuffer[bufindw], "M110") == NULL)) {
           if(recovery_count <= 0) {
             SERIAL_ERROR_START;
@@ -578,7 +971,7 @@ void get_command()
           }
           checksum = checksum^(*strchr_pointer);
         }
-        if(strtol(strchr_pointer + 1, NULL, 10) != checksum)
+        if(parse_long(strchr_pointer + 1) != checksum)
         {
           SERIAL_ERROR_START;
           SERIAL_ERRORPGM(MSG_ERR_CHECKSUM_MISMATCH);
@@ -601,33 +994,27 @@ void get_command()
           return;
         }
       }
-      strchr_pointer = strchr(cmdbuffer[bufindw], 'G');
-      if(strchr_pointer != NULL)
-      {
-        switch(strtol(strchr_pointer + 1, NULL, 10)) {
-        case 0:
-        case 1:
-        case 2:
-        case 3:
-          if(Stopped == false) { // If printer is stopped by an error the G[0-3] codes are ignored.
-            #ifdef SDSUPPORT
-            if(card.saving)
-              break;
-            #endif //SDSUPPORT
-            SERIAL_PROTOCOLLNPGM(MSG_OK); 
-          }
-          else {
-            SERIAL_ERRORLNPGM(MSG_ERR_STOPPED);
-            LCD_MESSAGEPGM(MSG_STOPPED);
-          }
-          break;
-        default:
-          break;
-        }
+      #ifdef BINARY_PROTOCOL
+      frombinary[bufindw] = false;
+      strchr_pointer = strchr(cmdbuffer[bufindw], 'M');
+      #ifdef SDSUPPORT
+      if(card.saving) // An M580 being written to a file, the upload itself stays text
+        strchr_pointer = NULL;
+      #endif
+      if(strchr_pointer != NULL && parse_long(strchr_pointer + 1) == 580) {
+        // What follows the M580 line is packets. Its ok comes from process_commands().
+        binary_mode = true;
+        binary_seq = 0;
+        binary_count = 0;
+        binary_resend = false;
       }
-      bufindw = (bufindw + 1)%BUFSIZE;
-      buflen += 1;
+      #endif
+      commit_serial_command();
       serial_count = 0; //clear buffer
+      #ifdef BINARY_PROTOCOL
+      if(binary_mode)
+        break;
+      #endif
     }
     else
     {
@@ -639,8 +1026,17 @@ void get_command()
   if(!card.sdprinting || serial_count!=0){
     return;
   }
+  #ifdef BINARY_PROTOCOL
+  if(binary_count != 0) // A serial packet is being received into cmdbuffer[bufindw]
+    return;
+  if(sd_binary) {
+    get_sd_binary_commands();
+    return;
+  }
+  #endif
   while(!card.eof() && buflen < BUFSIZE) 
   {
+    if(comment_mode) card.skipToLineEnd();
     int16_t n=card.get();
     serial_char = (char)n;
     if(serial_char == '\n' || 
@@ -650,19 +1046,7 @@ void get_command()
     {
       comment_mode = false; //for new command
       if(card.eof()){
-        SERIAL_PROTOCOLLNPGM(MSG_FILE_PRINTED);
-        stoptime=millis();
-        char time[30];
-        unsigned long t=(stoptime-starttime)/1000;
-        int hours, minutes;
-        minutes=(t/60)%60;
-        hours=t/60/60;
-        sprintf_P(time, PSTR("%i hours %i minutes"),hours, minutes);
-        SERIAL_ECHO_START;
-        SERIAL_ECHOLN(time);
-        lcd_setstatus(time);
-        card.printingHasFinished();
-        card.checkautostart(true);
+        finish_sd_print();
       }
       if(!serial_count)
       {
@@ -670,6 +1054,18 @@ void get_command()
       }
       cmdbuffer[bufindw][serial_count] = 0; //terminate string
       fromsd[bufindw] = true;
+      #ifdef BINARY_PROTOCOL
+      frombinary[bufindw] = false;
+      strchr_pointer = strchr(cmdbuffer[bufindw], 'M');
+      if(strchr_pointer != NULL && parse_long(strchr_pointer + 1) == 580) {
+        // A job converted by host/binary_stream.py, packets from here on
+        sd_binary = true;
+        buflen += 1;
+        bufindw = (bufindw + 1)%BUFSIZE;
+        serial_count = 0;
+        return;
+      }
+      #endif
       buflen += 1;
       bufindw = (bufindw + 1)%BUFSIZE;
       serial_count = 0; //clear buffer
@@ -684,20 +1080,46 @@ void get_command()
 }
 
 
+// Scans the command at bufindr for code_seen()/code_value(), once per command
+static void parse_command()
+{
+  const char *line = cmdbuffer[bufindr];
+  memset(code_pos, 0, sizeof(code_pos));
+  for(const char *p = line; *p; p++) {
+    unsigned char i = *p - 'A';
+    if(i < 26 && code_pos[i] == 0) {
+      code_pos[i] = p - line + 1;
+      code_values[i] = parse_float(p + 1);
+    }
+  }
+  code_index = 0xff;
+}
+
 float code_value() 
 { 
-  return (strtod(&cmdbuffer[bufindr][strchr_pointer - cmdbuffer[bufindr] + 1], NULL)); 
+  if(code_index < 26 && strchr_pointer == cmdbuffer[bufindr] + code_pos[code_index] - 1)
+    return code_values[code_index];
+  return parse_float(strchr_pointer + 1); 
 }
 
 long code_value_long() 
 { 
-  return (strtol(&cmdbuffer[bufindr][strchr_pointer - cmdbuffer[bufindr] + 1], NULL, 10)); 
+  return parse_long(strchr_pointer + 1); 
 }
 
 bool code_seen(char code)
 {
-  strchr_pointer = strchr(cmdbuffer[bufindr], code);
-  return (strchr_pointer != NULL);  //Return True if a character was found
+  unsigned char i = code - 'A';
+  if(i >= 26) {
+    code_index = 0xff;
+    strchr_pointer = strchr(cmdbuffer[bufindr], code);
+    return (strchr_pointer != NULL);
+  }
+  if(code_pos[i] == 0)
+    return false;
+  code_index = i;
+  strchr_pointer = cmdbuffer[bufindr] + code_pos[i] - 1;
+  return true;  //Return True if a character was found
 }
 
 #define DEFINE_PGM_READ_ANY(type, reader)		\
@@ -829,15 +1251,74 @@ static void set_active_extruder(uint8_t to_extruder,
 }
 #endif // EXTRUDERS > 1
 
+#ifdef BINARY_PROTOCOL
+// The G1 of a move packet. Positions are kept in um so relative packets don't pile up rounding errors.
+static void process_binary_move()
+{
+  const uint8_t *p = (const uint8_t *)cmdbuffer[bufindr];
+  uint8_t opcode = p[0], mask = p[1];
+  p += 2;
+  if(Stopped) {
+    ClearToSend();
+    return;
+  }
+  if(!binary_position_known) {
+    for(int8_t i = 0; i < NUM_AXIS; i++)
+      binary_position[i] = lround(current_position[i] * 1000.0);
+    binary_position_known = true;
+  }
+  for(int8_t i = 0; i < NUM_AXIS; i++) {
+    if(mask & (1 << i)) {
+      if(opcode == BINARY_MOVE_ABS) {
+        int32_t position;
+        memcpy(&position, p, 4); // Little endian like the AVR
+        binary_position[i] = position;
+        p += 4;
+      }
+      else {
+        int16_t distance;
+        memcpy(&distance, p, 2);
+        binary_position[i] += distance;
+        p += 2;
+      }
+      destination[i] = binary_position[i] / 1000.0;
+    }
+    else destination[i] = current_position[i];
+  }
+  if(mask & BINARY_F) {
+    uint16_t f;
+    memcpy(&f, p, 2);
+    if(f > 0) feedrate = f;
+  }
+  prepare_move();
+}
+#endif // BINARY_PROTOCOL
+
 void process_commands()
 {
   unsigned long codenum; //throw away variable
   char *starpos = NULL;
-  
+
 #ifdef NO_ECHO_WHILE_PRINTING
   machine_printing = (num_blocks_queued() >= MACHINE_PRINTING_BLOCKS);
 #endif // NO_ECHO_WHILE_PRINTING
 
+#ifdef BINARY_PROTOCOL
+  if(frombinary[bufindr]) {
+    process_binary_move();
+    return;
+  }
+  binary_position_known = false;
+#endif
+
+  parse_command();
+
+#ifdef COALESCE_MOVES
+  // Any command but G0/G1 sees all moves before it in the planner
+  if(!(code_seen('G') && ((int)code_value() == 0 || (int)code_value() == 1)))
+    flush_pending_move();
+#endif
+
   if(code_seen('G'))
   {
     switch((int)code_value())
@@ -1093,6 +1574,9 @@ void process_commands()
       if(starpos!=NULL)
         *(starpos-1)='\0';
       card.openFile(strchr_pointer + 4,true);
+      #ifdef BINARY_PROTOCOL
+      sd_binary = false;
+      #endif
       break;
       
     case 24: //M24 - Start SD print
@@ -1183,6 +1667,21 @@ void process_commands()
       }
      break;
 
+    case 78: // M78 - Report the motion time
+      if(code_seen('R')) motion_time_start = plan_executed_time();
+      SERIAL_PROTOCOLPGM("Motion time done:");
+      SERIAL_PROTOCOL(lround(plan_executed_time() - motion_time_start));
+      SERIAL_PROTOCOLPGM(" queued:");
+      SERIAL_PROTOCOL(lround(plan_buffered_time() / 1000000.0));
+      #ifdef SDSUPPORT
+      if(card.sdprinting) {
+        SERIAL_PROTOCOLPGM(" left:");
+        SERIAL_PROTOCOL(card.timeLeft());
+      }
+      #endif //SDSUPPORT
+      SERIAL_PROTOCOLLN("");
+      break;
+
     case 104: // M104
       if(setTargetedHotend(104)){
         break;
@@ -1536,6 +2035,9 @@ void process_commands()
       st_synchronize();
       // This recalculates position in steps in case user has changed steps/unit
       plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+      #ifdef C_COMPENSATION
+      plan_compile_c_comp();
+      #endif // C_COMPENSATION
       break;
     case 115: // M115
       SERIAL_PROTOCOLPGM(MSG_M115_REPORT);
@@ -1647,6 +2149,10 @@ void process_commands()
       if(code_seen('X')) max_xy_jerk = code_value() ;
       if(code_seen('Z')) max_z_jerk = code_value() ;
       if(code_seen('E')) max_e_jerk[tmp_extruder] = code_value() ;
+      #ifdef JUNCTION_DEVIATION
+      if(code_seen('J')) junction_deviation = code_value() ;
+      #endif // JUNCTION_DEVIATION
+      if(code_seen('A')) arc_tolerance = code_value() ;
     }
     break;
     #ifdef ENABLE_ADD_HOMEING
@@ -2006,6 +2512,7 @@ void process_commands()
             size < gCComp_max_size && gCComp[size][tmp_extruder][0] > 0.0;
             size++);
         gCComp_size[tmp_extruder] = size;
+        plan_compile_c_comp();
       }
       if(code_seen('R')) {
         gCCom_min_speed[tmp_extruder] = code_value();
@@ -2106,6 +2613,69 @@ void process_commands()
     }
     break;
     #endif
+    case 576: // M576 report planner buffer
+    {
+      SERIAL_PROTOCOLPGM("Planner buffer: ");
+      SERIAL_PROTOCOL((int)movesplanned());
+      SERIAL_PROTOCOLPGM(" moves, ");
+      SERIAL_PROTOCOL(plan_buffered_time());
+      SERIAL_PROTOCOLPGM(" us");
+      #ifdef STEP_SEGMENT_BUFFER
+      SERIAL_PROTOCOLPGM(", segment underruns: ");
+      SERIAL_PROTOCOL(st_segment_underruns());
+      if(code_seen('R')) st_reset_segment_underruns();
+      #endif // STEP_SEGMENT_BUFFER
+      SERIAL_PROTOCOLLNPGM("");
+    }
+    break;
+    #ifdef ISR_PROFILER
+    case 577: // M577 report interrupt cycle counts
+    {
+      isr_profiler_report();
+      if(code_seen('R')) isr_profiler_reset();
+    }
+    break;
+    #endif // ISR_PROFILER
+    #ifdef ISR_TRACE
+    case 578: // M578 set interrupt trace output
+    {
+      if(code_seen('S')) {
+        unsigned char output = code_value();
+        char *filename = strchr(strchr_pointer, ' ');
+        starpos = strchr(strchr_pointer, '*');
+        if(starpos != NULL) {
+          while(starpos[-1] == ' ') starpos--;
+          *starpos = '\0';
+        }
+        if(filename == NULL || filename[1] == '\0')
+          filename = (char *)"trace.bin";
+        else
+          filename++;
+        trace_set_output(output, filename);
+      }
+    }
+    break;
+    #endif // ISR_TRACE
+    #ifndef AT90USB
+    case 579: // M579 report serial receive errors
+    {
+      MSerial.reportErrors();
+      if(code_seen('R')) MSerial.resetErrors();
+    }
+    break;
+    #endif // !AT90USB
+    #ifdef BINARY_PROTOCOL
+    case 580: // M580 binary move packets follow, get_command() switched over already
+    break;
+    #endif // BINARY_PROTOCOL
+    #ifdef SDSUPPORT
+    case 581: // M581 report SD cache hits and misses
+    {
+      card.reportCacheCounts();
+      if(code_seen('R')) card.resetCacheCounts();
+    }
+    break;
+    #endif // SDSUPPORT
     #ifdef FILAMENTCHANGEENABLE
     case 600: //Pause for filament change X[pos] Y[pos] Z[relative lift] E[initial retract] L[later retract distance for removal]
     {
@@ -2303,6 +2873,16 @@ void process_commands()
   ClearToSend();
 }
 
+static void clear_to_send(long line)
+{
+  previous_millis_cmd = millis();
+  #ifdef SDSUPPORT
+  if(fromsd[bufindr])
+    return;
+  #endif //SDSUPPORT
+  send_ok(line, BUFSIZE - buflen);
+}
+
 void FlushSerialRequestResend()
 {
   //char cmdbuffer[bufindr][100]="Resend:";
@@ -2310,19 +2890,16 @@ void FlushSerialRequestResend()
   SERIAL_PROTOCOLPGM(MSG_RESEND);
   SERIAL_PROTOCOLLN(gcode_LastN + 1);
   recovery_count = buflen + 1; // Give it a chance to grind through stuff received after the error
-  ClearToSend();
+  clear_to_send(gcode_LastN);
 }
 
+// The "ok" for the command in cmdbuffer[bufindr]
 void ClearToSend()
 {
-  previous_millis_cmd = millis();
-  #ifdef SDSUPPORT
-  if(fromsd[bufindr])
-    return;
-  #endif //SDSUPPORT
-  SERIAL_PROTOCOLLNPGM(MSG_OK); 
+  clear_to_send(QUEUED_LINE(bufindr));
 }
 
+
 void get_coordinates()
 {
   bool seen[4]={false,false,false,false};
@@ -2416,6 +2993,87 @@ void clamp_to_software_endstops(float target[3])
   }
 }
 
+#ifdef COALESCE_MOVES
+void flush_pending_move()
+{
+  if(!pending_move)
+    return;
+  pending_move = false;
+  plan_buffer_line(pending_target[X_AXIS], pending_target[Y_AXIS], pending_target[Z_AXIS], pending_target[E_AXIS], pending_feedrate, active_extruder);
+}
+
+// Called by quickStop(): the held back run is dropped along with the planner queue. current_position
+// already points at its end, so the planner is taken there as if the run had been queued and discarded.
+void discard_pending_move()
+{
+  if(!pending_move)
+    return;
+  pending_move = false;
+  plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+}
+
+// Holds back the XY move from current_position to destination so that the following moves can be 
+// merged into it. Returns false if the move is not a candidate and has to be planned as it is.
+static bool coalesce_move(float feed_rate)
+{
+  float dx = destination[X_AXIS] - current_position[X_AXIS];
+  float dy = destination[Y_AXIS] - current_position[Y_AXIS];
+  float length = sqrt(dx*dx + dy*dy);
+  if((length == 0) || (destination[Z_AXIS] != current_position[Z_AXIS])) {
+    flush_pending_move();
+    return false;
+  }
+  dx /= length;
+  dy /= length;
+  float e_per_mm = (destination[E_AXIS] - current_position[E_AXIS])/length;
+
+  if(pending_move) {
+    if((feed_rate == pending_feedrate) && (pending_count < COALESCE_MAX_MOVES) &&
+       (dx*pending_direction[0] + dy*pending_direction[1] >= cos(radians(COALESCE_ANGLE))) &&
+       (fabs(e_per_mm - pending_e_per_mm) <= COALESCE_E_TOLERANCE*fabs(pending_e_per_mm)))
+    {
+      // The end of the run so far becomes an intermediate point, all of which have to stay
+      // within the tolerance of the merged move
+      pending_points[pending_count-1][0] = pending_target[X_AXIS];
+      pending_points[pending_count-1][1] = pending_target[Y_AXIS];
+      float chord_x = destination[X_AXIS] - pending_start[0];
+      float chord_y = destination[Y_AXIS] - pending_start[1];
+      float max_cross = COALESCE_TOLERANCE*sqrt(chord_x*chord_x + chord_y*chord_y);
+      uint8_t i = 0;
+      for(; i < pending_count; i++) {
+        float cross = chord_x*(pending_points[i][1] - pending_start[1]) - chord_y*(pending_points[i][0] - pending_start[0]);
+        if(fabs(cross) > max_cross)
+          break;
+      }
+      if(i == pending_count) {
+        memcpy(pending_target, destination, sizeof(pending_target));
+        pending_direction[0] = dx;
+        pending_direction[1] = dy;
+        pending_count++;
+        return true;
+      }
+    }
+    flush_pending_move();
+  }
+
+  // With the buffer running low the move is planned right away, SLOWDOWN paces it better than
+  // a run that waits for more moves
+  if(plan_buffered_time() < COALESCE_HOLD_TIME)
+    return false;
+
+  pending_start[0] = current_position[X_AXIS];
+  pending_start[1] = current_position[Y_AXIS];
+  memcpy(pending_target, destination, sizeof(pending_target));
+  pending_direction[0] = dx;
+  pending_direction[1] = dy;
+  pending_feedrate = feed_rate;
+  pending_e_per_mm = e_per_mm;
+  pending_count = 1;
+  pending_move = true;
+  return true;
+}
+#endif // COALESCE_MOVES
+
 void prepare_move()
 {
   clamp_to_software_endstops(destination);
@@ -2423,9 +3081,15 @@ void prepare_move()
   previous_millis_cmd = millis(); 
   // Do not use feedmultiply for E or Z only moves
   if( (current_position[X_AXIS] == destination [X_AXIS]) && (current_position[Y_AXIS] == destination [Y_AXIS])) {
-      plan_buffer_line(destination[X_AXIS], destination[Y_AXIS], destination[Z_AXIS], destination[E_AXIS], feedrate/60, active_extruder);
+#ifdef COALESCE_MOVES
+    flush_pending_move();
+#endif
+    plan_buffer_line(destination[X_AXIS], destination[Y_AXIS], destination[Z_AXIS], destination[E_AXIS], feedrate/60, active_extruder);
   }
   else {
+#ifdef COALESCE_MOVES
+    if(!coalesce_move(feedrate*feedmultiply/60/100.0))
+#endif
     plan_buffer_line(destination[X_AXIS], destination[Y_AXIS], destination[Z_AXIS], destination[E_AXIS], feedrate*feedmultiply/60/100.0, active_extruder);
   }
   for(int8_t i=0; i < NUM_AXIS; i++) {
@@ -2484,6 +3148,9 @@ void controllerFan()
 
 void manage_inactivity() 
 { 
+  #ifdef STEP_SEGMENT_BUFFER
+  st_prepare_segments();
+  #endif // STEP_SEGMENT_BUFFER
   if( (millis() - previous_millis_cmd) >  max_inactive_time ) 
     if(max_inactive_time) 
       kill(); 
@@ -2510,7 +3177,7 @@ void manage_inactivity()
   controllerFan(); //Check if fan should be turned on to cool stepper drivers down
   #endif
 
-  #ifdef EXTRUDER_RUNOUT_PREVENT && (EXTRUDERS == 1) 
+  #ifdef EXTRUDER_RUNOUT_PREVENT
   if( (millis() - previous_millis_cmd) >  EXTRUDER_RUNOUT_SECONDS * 1000 ) 
     if(degHotend(0) > EXTRUDER_RUNOUT_MINTEMP)
     {
@@ -2518,6 +3185,9 @@ void manage_inactivity()
       enable_e0();
       float oldepos=current_position[E_AXIS];
       float oldedes=destination[E_AXIS];
+      #ifdef COALESCE_MOVES
+      flush_pending_move(); // current_position is past the held back run
+      #endif
       plan_buffer_line(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], 
                        current_position[E_AXIS]+EXTRUDER_RUNOUT_EXTRUDE*EXTRUDER_RUNOUT_ESTEPS/axis_steps_per_unit[E_AXIS], 
                        EXTRUDER_RUNOUT_SPEED/60.*EXTRUDER_RUNOUT_ESTEPS/axis_steps_per_unit[E_AXIS], active_extruder);
@@ -2528,9 +3198,16 @@ void manage_inactivity()
       st_synchronize();
       WRITE(E0_ENABLE_PIN,oldstatus);
     }
-  #endif // EXTRUDER_RUNOUT_PREVENT && (EXTRUDERS == 1)
+  #endif // EXTRUDER_RUNOUT_PREVENT
   
   check_axes_activity();
+  #ifdef ISR_TRACE
+  trace_drain(); // Here rather than in loop() so the buffer also drains while waiting on the planner
+  #endif
+  #if defined(SDSUPPORT) && defined(SD_READ_AHEAD)
+  if(card.sdprinting)
+    card.readAhead(); // The next block of the file, get_command() would have to wait for it otherwise
+  #endif
 }
 
 void kill()
@@ -152,6 +152,9 @@ static void spiSend(uint8_t data) {
 //------------------------------------------------------------------------------
 // send command and return error code.  Return zero for OK
 uint8_t Sd2Card::cardCommand(uint8_t cmd, uint32_t arg) {
+  // end a multiple block read left open
+  if (readingMultiple_ && cmd != CMD12) readStop();
+
   // select card
   chipSelectLow();
 
@@ -285,6 +288,7 @@ bool Sd2Card::eraseSingleBlockEnable() {
  */
 bool Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
   errorCode_ = type_ = 0;
+  readingMultiple_ = false;
   chipSelectPin_ = chipSelectPin;
   // 16-bit init start time allows over a minute
   uint16_t t0 = (uint16_t)millis();
@@ -445,6 +449,7 @@ bool Sd2Card::readRegister(uint8_t cmd, void* buf) {
  *
  * \note This function is used with readData() and readStop() for optimized
  * multiple block reads.  SPI chipSelect must be low for the entire sequence.
+ * Any other command ends the sequence first.
  *
  * \return The value one, true, is returned for success and
  * the value zero, false, is returned for failure.
@@ -455,6 +460,7 @@ bool Sd2Card::readStart(uint32_t blockNumber) {
     error(SD_CARD_ERROR_CMD18);
     goto fail;
   }
+  readingMultiple_ = true;
   chipSelectHigh();
   return true;
 
@@ -469,6 +475,7 @@ bool Sd2Card::readStart(uint32_t blockNumber) {
  * the value zero, false, is returned for failure.
  */
 bool Sd2Card::readStop() {
+  readingMultiple_ = false;
   chipSelectLow();
   if (cardCommand(CMD12, 0)) {
     error(SD_CARD_ERROR_CMD12);
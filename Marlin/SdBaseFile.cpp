@@ -51,19 +51,19 @@ bool SdBaseFile::addDirCluster() {
   if (fileSize_/sizeof(dir_t) >= 0XFFFF) goto fail;
 
   if (!addCluster()) goto fail;
-  if (!vol_->cacheFlush()) goto fail;
 
   block = vol_->clusterStartBlock(curCluster_);
 
   // set cache to first block of cluster
-  vol_->cacheSetBlockNumber(block, true);
+  if (!vol_->cacheRawBlock(block, SdVolume::CACHE_RESERVE_FOR_WRITE)) goto fail;
 
   // zero first block of cluster
-  memset(vol_->cacheBuffer_.data, 0, 512);
+  memset(vol_->cache()->data, 0, 512);
 
-  // zero rest of cluster
+  // zero rest of cluster, around the cache: forget stale copies in other entries
   for (uint8_t i = 1; i < vol_->blocksPerCluster_; i++) {
-    if (!vol_->writeBlock(block + i, vol_->cacheBuffer_.data)) goto fail;
+    vol_->cacheInvalidate(block + i);
+    if (!vol_->writeBlock(block + i, vol_->cache()->data)) goto fail;
   }
   // Increase directory file size by cluster size
   fileSize_ += 512UL << vol_->clusterSizeShift_;
@@ -129,6 +129,62 @@ bool SdBaseFile::contiguousRange(uint32_t* bgnBlock, uint32_t* endBlock) {
   return false;
 }
 //------------------------------------------------------------------------------
+/** Find the blocks that follow the current position on the card without a gap
+ * and move the position past them.
+ *
+ * The run ends at the end of the file, at the first cluster that doesn't
+ * follow its predecessor or after \a maxBlocks blocks.
+ *
+ * \param[in] maxBlocks Upper limit for \a count.
+ * \param[out] block The block at the current position, which must be at the
+ * start of a block.
+ * \param[out] count Number of blocks in the run, the last may be used in part.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ * Reasons for failure include not a file, position not at a block start,
+ * position at end of file or an I/O error occurred.
+ */
+bool SdBaseFile::contiguousRun(uint32_t maxBlocks, uint32_t* block,
+  uint32_t* count) {
+  uint32_t left;  // blocks from the position to the end of the file
+  uint32_t n;
+  uint8_t blockOfCluster;
+
+  if (!isFile() || (curPosition_ & 0X1FF) || curPosition_ >= fileSize_) {
+    goto fail;
+  }
+  left = (fileSize_ - curPosition_ + 511) >> 9;
+  if (left > maxBlocks) left = maxBlocks;
+
+  // as in read(), curCluster_ holds the byte before the position
+  blockOfCluster = vol_->blockOfCluster(curPosition_);
+  if (blockOfCluster == 0) {
+    if (curPosition_ == 0) {
+      curCluster_ = firstCluster_;
+    } else {
+      if (!vol_->fatGet(curCluster_, &curCluster_)) goto fail;
+    }
+  }
+  *block = vol_->clusterStartBlock(curCluster_) + blockOfCluster;
+  n = vol_->blocksPerCluster_ - blockOfCluster;
+  while (n < left) {
+    uint32_t next;
+    if (!vol_->fatGet(curCluster_, &next)) goto fail;
+    if (next != (curCluster_ + 1)) break;
+    curCluster_ = next;
+    n += vol_->blocksPerCluster_;
+  }
+  if (n > left) n = left;
+  *count = n;
+  curPosition_ += n << 9;
+  if (curPosition_ > fileSize_) curPosition_ = fileSize_;
+  return true;
+
+ fail:
+  return false;
+}
+//------------------------------------------------------------------------------
 /** Create and open a new contiguous file of a specified size.
  *
  * \note This function only supports short DOS 8.3 names.
@@ -672,8 +728,11 @@ bool SdBaseFile::open(SdBaseFile* dirFile,
 
     // set timestamps
     if (dateTime_) {
-      // call user date/time function
-      dateTime_(&p->creationDate, &p->creationTime);
+      // call user date/time function, the packed entry may be unaligned
+      uint16_t date, time;
+      dateTime_(&date, &time);
+      p->creationDate = date;
+      p->creationTime = time;
     } else {
       // use default date/time
       p->creationDate = FAT_DEFAULT_DATE;
@@ -856,7 +915,7 @@ bool SdBaseFile::openParent(SdBaseFile* dir) {
   if (!vol_->cacheRawBlock(lbn, SdVolume::CACHE_FOR_READ)) {
     goto fail;
   }
-  p = &vol_->cacheBuffer_.dir[1];
+  p = &vol_->cache()->dir[1];
   // verify name for '../..'
   if (p->name[0] != '.' || p->name[1] != '.') goto fail;
   // '..' is pointer to first cluster of parent. open '../..' to find parent
@@ -1080,7 +1139,7 @@ int16_t SdBaseFile::read(void* buf, uint16_t nbyte) {
     if (n > (512 - offset)) n = 512 - offset;
 
     // no buffering needed if n == 512
-    if (n == 512 && block != vol_->cacheBlockNumber()) {
+    if (n == 512 && !vol_->cacheHolds(block)) {
       if (!vol_->readBlock(block, dst)) goto fail;
     } else {
       // read block to cache and copy data to caller
@@ -1523,8 +1582,11 @@ bool SdBaseFile::sync() {
 
     // set modify time if user supplied a callback date/time function
     if (dateTime_) {
-      dateTime_(&d->lastWriteDate, &d->lastWriteTime);
-      d->lastAccessDate = d->lastWriteDate;
+      uint16_t date, time;
+      dateTime_(&date, &time);
+      d->lastWriteDate = date;
+      d->lastWriteTime = time;
+      d->lastAccessDate = date;
     }
     // clear directory dirty
     flags_ &= ~F_FILE_DIR_DIRTY;
@@ -1774,17 +1836,15 @@ int16_t SdBaseFile::write(const void* buf, uint16_t nbyte) {
     uint32_t block = vol_->clusterStartBlock(curCluster_) + blockOfCluster;
     if (n == 512) {
       // full block - don't need to use cache
-      if (vol_->cacheBlockNumber() == block) {
-        // invalidate cache if block is in cache
-        vol_->cacheSetBlockNumber(0XFFFFFFFF, false);
-      }
+      // invalidate cache if block is in cache
+      vol_->cacheInvalidate(block);
       if (!vol_->writeBlock(block, src)) goto fail;
     } else {
       if (blockOffset == 0 && curPosition_ >= fileSize_) {
         // start of new block don't need to read into cache
-        if (!vol_->cacheFlush()) goto fail;
-        // set cache dirty and SD address of block
-        vol_->cacheSetBlockNumber(block, true);
+        if (!vol_->cacheRawBlock(block, SdVolume::CACHE_RESERVE_FOR_WRITE)) {
+          goto fail;
+        }
       } else {
         // rewrite part of block
         if (!vol_->cacheRawBlock(block, SdVolume::CACHE_FOR_WRITE)) goto fail;
@@ -204,6 +204,7 @@ class SdBaseFile {
   //----------------------------------------------------------------------------
   bool close();
   bool contiguousRange(uint32_t* bgnBlock, uint32_t* endBlock);
+  bool contiguousRun(uint32_t maxBlocks, uint32_t* block, uint32_t* count);
   bool createContiguous(SdBaseFile* dirFile,
           const char* path, uint32_t size);
   /** \return The current cluster number for a file or directory. */
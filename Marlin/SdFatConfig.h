@@ -37,6 +37,27 @@
  */
 #define USE_MULTIPLE_CARDS 0
 //------------------------------------------------------------------------------
+/**
+ * Set USE_SEPARATE_FAT_CACHE nonzero to keep FAT blocks in a 512 byte cache
+ * of their own.
+ *
+ * Following a cluster chain then doesn't evict the data or directory block
+ * in use, and writing a file doesn't write back the FAT block and its
+ * mirror in the second FAT and read it again at each new cluster.
+ *
+ * Off by default, the 1280/2560 already spend their spare SRAM on the
+ * planner and serial buffers.
+ */
+#define USE_SEPARATE_FAT_CACHE 0
+//------------------------------------------------------------------------------
+/**
+ * Number of 512 byte blocks cached for file data and directories.
+ *
+ * With more than one, the least recently used is replaced, so a directory
+ * block and the data block of a file written can stay in the cache together.
+ */
+#define DATA_CACHE_BLOCKS 1
+//------------------------------------------------------------------------------
 /**
  * Call flush for endl if ENDL_CALLS_FLUSH is nonzero
  *
@@ -30,14 +30,14 @@ int SdFatUtil::FreeRam() {
   extern int  __bss_end;
   extern int* __brkval;
   int free_memory;
-  if (reinterpret_cast<int>(__brkval) == 0) {
+  if (__brkval == 0) {
     // if no heap use from end of bss section
-    free_memory = reinterpret_cast<int>(&free_memory)
-                  - reinterpret_cast<int>(&__bss_end);
+    free_memory = reinterpret_cast<char*>(&free_memory)
+                  - reinterpret_cast<char*>(&__bss_end);
   } else {
     // use from top of stack to heap
-    free_memory = reinterpret_cast<int>(&free_memory)
-                  - reinterpret_cast<int>(__brkval);
+    free_memory = reinterpret_cast<char*>(&free_memory)
+                  - reinterpret_cast<char*>(__brkval);
   }
   return free_memory;
 }
@@ -24,11 +24,17 @@
 //------------------------------------------------------------------------------
 #if !USE_MULTIPLE_CARDS
 // raw block cache
-uint32_t SdVolume::cacheBlockNumber_;  // current block number
-cache_t  SdVolume::cacheBuffer_;       // 512 byte cache for Sd2Card
+uint32_t SdVolume::cacheBlockNumber_[CACHE_ENTRIES];  // block number in each entry
+cache_t  SdVolume::cacheBuffer_[CACHE_ENTRIES];       // 512 byte caches for Sd2Card
 Sd2Card* SdVolume::sdCard_;            // pointer to SD card object
-bool     SdVolume::cacheDirty_;        // cacheFlush() will write block if true
-uint32_t SdVolume::cacheMirrorBlock_;  // mirror  block for second FAT
+bool     SdVolume::cacheDirty_[CACHE_ENTRIES];        // cacheFlush() will write block if true
+uint32_t SdVolume::cacheMirrorBlock_[CACHE_ENTRIES];  // mirror  block for second FAT
+uint8_t  SdVolume::cacheLru_[DATA_CACHE_BLOCKS];      // data entries by last use
+uint8_t  SdVolume::cacheCurrent_;      // entry cache() returns
+uint32_t SdVolume::cacheHits_;
+uint32_t SdVolume::cacheMisses_;
+uint32_t SdVolume::fatCacheHits_;
+uint32_t SdVolume::fatCacheMisses_;
 #endif  // USE_MULTIPLE_CARDS
 //------------------------------------------------------------------------------
 // find a contiguous group of clusters
@@ -104,19 +110,76 @@ bool SdVolume::allocContiguous(uint32_t count, uint32_t* curCluster) {
   return false;
 }
 //------------------------------------------------------------------------------
+// data cache entry holding a block, DATA_CACHE_BLOCKS if none
+uint8_t SdVolume::cacheFind(uint32_t blockNumber) {
+  uint8_t i;
+  for (i = 0; i < DATA_CACHE_BLOCKS; i++) {
+    if (cacheBlockNumber_[i] == blockNumber) break;
+  }
+  return i;
+}
+//------------------------------------------------------------------------------
 bool SdVolume::cacheFlush() {
-  if (cacheDirty_) {
-    if (!sdCard_->writeBlock(cacheBlockNumber_, cacheBuffer_.data)) {
+  for (uint8_t i = 0; i < CACHE_ENTRIES; i++) {
+    if (!cacheWriteBack(i)) return false;
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+// forget a block about to be written around the cache
+void SdVolume::cacheInvalidate(uint32_t blockNumber) {
+  uint8_t i = cacheFind(blockNumber);
+  if (i < DATA_CACHE_BLOCKS) {
+    cacheBlockNumber_[i] = 0XFFFFFFFF;
+    cacheDirty_[i] = false;
+    cacheMirrorBlock_[i] = 0;
+  }
+}
+//------------------------------------------------------------------------------
+bool SdVolume::cacheRawBlock(uint32_t blockNumber, uint8_t options) {
+  uint8_t n;
+  uint8_t i = cacheFind(blockNumber);
+  if (i < DATA_CACHE_BLOCKS) {
+    cacheHits_++;
+  } else {
+    // replace the least recently used block
+    i = cacheLru_[DATA_CACHE_BLOCKS - 1];
+    if (!cacheWriteBack(i)) goto fail;
+    cacheBlockNumber_[i] = 0XFFFFFFFF;
+    if (!(options & CACHE_OPTION_NO_READ)) {
+      if (!sdCard_->readBlock(blockNumber, cacheBuffer_[i].data)) goto fail;
+      cacheMisses_++;
+    }
+    cacheBlockNumber_[i] = blockNumber;
+  }
+  // move to the front of the use order
+  n = 0;
+  while (cacheLru_[n] != i) n++;
+  for (; n > 0; n--) cacheLru_[n] = cacheLru_[n - 1];
+  cacheLru_[0] = i;
+  cacheCurrent_ = i;
+  if (options & CACHE_FOR_WRITE) cacheDirty_[i] = true;
+  return true;
+
+ fail:
+  return false;
+}
+//------------------------------------------------------------------------------
+bool SdVolume::cacheWriteBack(uint8_t entry) {
+  if (cacheDirty_[entry]) {
+    if (!sdCard_->writeBlock(cacheBlockNumber_[entry],
+                             cacheBuffer_[entry].data)) {
       goto fail;
     }
     // mirror FAT tables
-    if (cacheMirrorBlock_) {
-      if (!sdCard_->writeBlock(cacheMirrorBlock_, cacheBuffer_.data)) {
+    if (cacheMirrorBlock_[entry]) {
+      if (!sdCard_->writeBlock(cacheMirrorBlock_[entry],
+                               cacheBuffer_[entry].data)) {
         goto fail;
       }
-      cacheMirrorBlock_ = 0;
+      cacheMirrorBlock_[entry] = 0;
     }
-    cacheDirty_ = 0;
+    cacheDirty_[entry] = false;
   }
   return true;
 
@@ -124,17 +187,33 @@ bool SdVolume::cacheFlush() {
   return false;
 }
 //------------------------------------------------------------------------------
-bool SdVolume::cacheRawBlock(uint32_t blockNumber, bool dirty) {
-  if (cacheBlockNumber_ != blockNumber) {
-    if (!cacheFlush()) goto fail;
-    if (!sdCard_->readBlock(blockNumber, cacheBuffer_.data)) goto fail;
-    cacheBlockNumber_ = blockNumber;
+// cache a FAT block, in its own entry with USE_SEPARATE_FAT_CACHE
+cache_t* SdVolume::cacheFetchFat(uint32_t blockNumber, uint8_t options) {
+  uint8_t i;
+#if USE_SEPARATE_FAT_CACHE
+  i = DATA_CACHE_BLOCKS;
+  if (cacheBlockNumber_[i] == blockNumber) {
+    fatCacheHits_++;
+  } else {
+    if (!cacheWriteBack(i)) goto fail;
+    cacheBlockNumber_[i] = 0XFFFFFFFF;
+    if (!sdCard_->readBlock(blockNumber, cacheBuffer_[i].data)) goto fail;
+    cacheBlockNumber_[i] = blockNumber;
+    fatCacheMisses_++;
   }
-  if (dirty) cacheDirty_ = true;
-  return true;
+  if (options & CACHE_FOR_WRITE) cacheDirty_[i] = true;
+#else  // USE_SEPARATE_FAT_CACHE
+  if (!cacheRawBlock(blockNumber, options)) goto fail;
+  i = cacheCurrent_;
+#endif  // USE_SEPARATE_FAT_CACHE
+  // mirror second FAT
+  if ((options & CACHE_FOR_WRITE) && fatCount_ > 1) {
+    cacheMirrorBlock_[i] = blockNumber + blocksPerFat_;
+  }
+  return &cacheBuffer_[i];
 
  fail:
-  return false;
+  return 0;
 }
 //------------------------------------------------------------------------------
 // return the size in bytes of a cluster chain
@@ -154,20 +233,21 @@ bool SdVolume::chainSize(uint32_t cluster, uint32_t* size) {
 // Fetch a FAT entry
 bool SdVolume::fatGet(uint32_t cluster, uint32_t* value) {
   uint32_t lba;
+  cache_t* pc;
   if (cluster > (clusterCount_ + 1)) goto fail;
   if (FAT12_SUPPORT && fatType_ == 12) {
     uint16_t index = cluster;
     index += index >> 1;
     lba = fatStartBlock_ + (index >> 9);
-    if (!cacheRawBlock(lba, CACHE_FOR_READ)) goto fail;
+    if (!(pc = cacheFetchFat(lba, CACHE_FOR_READ))) goto fail;
     index &= 0X1FF;
-    uint16_t tmp = cacheBuffer_.data[index];
+    uint16_t tmp = pc->data[index];
     index++;
     if (index == 512) {
-      if (!cacheRawBlock(lba + 1, CACHE_FOR_READ)) goto fail;
+      if (!(pc = cacheFetchFat(lba + 1, CACHE_FOR_READ))) goto fail;
       index = 0;
     }
-    tmp |= cacheBuffer_.data[index] << 8;
+    tmp |= pc->data[index] << 8;
     *value = cluster & 1 ? tmp >> 4 : tmp & 0XFFF;
     return true;
   }
@@ -178,13 +258,11 @@ bool SdVolume::fatGet(uint32_t cluster, uint32_t* value) {
   } else {
     goto fail;
   }
-  if (lba != cacheBlockNumber_) {
-    if (!cacheRawBlock(lba, CACHE_FOR_READ)) goto fail;
-  }
+  if (!(pc = cacheFetchFat(lba, CACHE_FOR_READ))) goto fail;
   if (fatType_ == 16) {
-    *value = cacheBuffer_.fat16[cluster & 0XFF];
+    *value = pc->fat16[cluster & 0XFF];
   } else {
-    *value = cacheBuffer_.fat32[cluster & 0X7F] & FAT32MASK;
+    *value = pc->fat32[cluster & 0X7F] & FAT32MASK;
   }
   return true;
 
@@ -195,6 +273,7 @@ bool SdVolume::fatGet(uint32_t cluster, uint32_t* value) {
 // Store a FAT entry
 bool SdVolume::fatPut(uint32_t cluster, uint32_t value) {
   uint32_t lba;
+  cache_t* pc;
   // error if reserved cluster
   if (cluster < 2) goto fail;
 
@@ -205,28 +284,24 @@ bool SdVolume::fatPut(uint32_t cluster, uint32_t value) {
     uint16_t index = cluster;
     index += index >> 1;
     lba = fatStartBlock_ + (index >> 9);
-    if (!cacheRawBlock(lba, CACHE_FOR_WRITE)) goto fail;
-    // mirror second FAT
-    if (fatCount_ > 1) cacheMirrorBlock_ = lba + blocksPerFat_;
+    if (!(pc = cacheFetchFat(lba, CACHE_FOR_WRITE))) goto fail;
     index &= 0X1FF;
     uint8_t tmp = value;
     if (cluster & 1) {
-      tmp = (cacheBuffer_.data[index] & 0XF) | tmp << 4;
+      tmp = (pc->data[index] & 0XF) | tmp << 4;
     }
-    cacheBuffer_.data[index] = tmp;
+    pc->data[index] = tmp;
     index++;
     if (index == 512) {
       lba++;
       index = 0;
-      if (!cacheRawBlock(lba, CACHE_FOR_WRITE)) goto fail;
-      // mirror second FAT
-      if (fatCount_ > 1) cacheMirrorBlock_ = lba + blocksPerFat_;
+      if (!(pc = cacheFetchFat(lba, CACHE_FOR_WRITE))) goto fail;
     }
     tmp = value >> 4;
     if (!(cluster & 1)) {
-      tmp = ((cacheBuffer_.data[index] & 0XF0)) | tmp >> 4;
+      tmp = ((pc->data[index] & 0XF0)) | tmp >> 4;
     }
-    cacheBuffer_.data[index] = tmp;
+    pc->data[index] = tmp;
     return true;
   }
   if (fatType_ == 16) {
@@ -236,15 +311,14 @@ bool SdVolume::fatPut(uint32_t cluster, uint32_t value) {
   } else {
     goto fail;
   }
-  if (!cacheRawBlock(lba, CACHE_FOR_WRITE)) goto fail;
+  // cacheFetchFat() also marks the block for the second FAT
+  if (!(pc = cacheFetchFat(lba, CACHE_FOR_WRITE))) goto fail;
   // store entry
   if (fatType_ == 16) {
-    cacheBuffer_.fat16[cluster & 0XFF] = value;
+    pc->fat16[cluster & 0XFF] = value;
   } else {
-    cacheBuffer_.fat32[cluster & 0X7F] = value;
+    pc->fat32[cluster & 0X7F] = value;
   }
-  // mirror second FAT
-  if (fatCount_ > 1) cacheMirrorBlock_ = lba + blocksPerFat_;
   return true;
 
  fail:
@@ -292,15 +366,16 @@ int32_t SdVolume::freeClusterCount() {
   }
 
   for (uint32_t lba = fatStartBlock_; todo; todo -= n, lba++) {
-    if (!cacheRawBlock(lba, CACHE_FOR_READ)) return -1;
+    cache_t* pc = cacheFetchFat(lba, CACHE_FOR_READ);
+    if (!pc) return -1;
     if (todo < n) n = todo;
     if (fatType_ == 16) {
       for (uint16_t i = 0; i < n; i++) {
-        if (cacheBuffer_.fat16[i] == 0) free++;
+        if (pc->fat16[i] == 0) free++;
       }
     } else {
       for (uint16_t i = 0; i < n; i++) {
-        if (cacheBuffer_.fat32[i] == 0) free++;
+        if (pc->fat32[i] == 0) free++;
       }
     }
   }
@@ -329,16 +404,21 @@ bool SdVolume::init(Sd2Card* dev, uint8_t part) {
   sdCard_ = dev;
   fatType_ = 0;
   allocSearchStart_ = 2;
-  cacheDirty_ = 0;  // cacheFlush() will write block if true
-  cacheMirrorBlock_ = 0;
-  cacheBlockNumber_ = 0XFFFFFFFF;
+  for (uint8_t i = 0; i < CACHE_ENTRIES; i++) {
+    cacheDirty_[i] = false;  // cacheFlush() will write block if true
+    cacheMirrorBlock_[i] = 0;
+    cacheBlockNumber_[i] = 0XFFFFFFFF;
+  }
+  for (uint8_t i = 0; i < DATA_CACHE_BLOCKS; i++) cacheLru_[i] = i;
+  cacheCurrent_ = 0;
+  cacheResetCounts();
 
   // if part == 0 assume super floppy with FAT boot sector in block zero
   // if part > 0 assume mbr volume with partition table
   if (part) {
     if (part > 4)goto fail;
     if (!cacheRawBlock(volumeStartBlock, CACHE_FOR_READ)) goto fail;
-    part_t* p = &cacheBuffer_.mbr.part[part-1];
+    part_t* p = &cache()->mbr.part[part-1];
     if ((p->boot & 0X7F) !=0  ||
       p->totalSectors < 100 ||
       p->firstSector == 0) {
@@ -348,7 +428,7 @@ bool SdVolume::init(Sd2Card* dev, uint8_t part) {
     volumeStartBlock = p->firstSector;
   }
   if (!cacheRawBlock(volumeStartBlock, CACHE_FOR_READ)) goto fail;
-  fbs = &cacheBuffer_.fbs32;
+  fbs = &cache()->fbs32;
   if (fbs->bytesPerSector != 512 ||
     fbs->fatCount == 0 ||
     fbs->reservedSectorCount == 0 ||
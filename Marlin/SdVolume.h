@@ -53,6 +53,10 @@ union cache_t {
   fat32_fsinfo_t fsinfo;
 };
 //------------------------------------------------------------------------------
+/** Cache entries: DATA_CACHE_BLOCKS for data and directory blocks, then one
+ * for FAT blocks if USE_SEPARATE_FAT_CACHE is nonzero. */
+uint8_t const CACHE_ENTRIES = DATA_CACHE_BLOCKS + (USE_SEPARATE_FAT_CACHE != 0);
+//------------------------------------------------------------------------------
 /**
  * \class SdVolume
  * \brief Access FAT16 and FAT32 volumes on SD and SDHC cards.
@@ -67,8 +71,21 @@ class SdVolume {
    */
   cache_t* cacheClear() {
     if (!cacheFlush()) return 0;
-    cacheBlockNumber_ = 0XFFFFFFFF;
-    return &cacheBuffer_;
+    cacheBlockNumber_[cacheCurrent_] = 0XFFFFFFFF;
+    return &cacheBuffer_[cacheCurrent_];
+  }
+  /** \return Data and directory blocks found in the cache since init() or
+   * cacheResetCounts(), FAT blocks too without USE_SEPARATE_FAT_CACHE. */
+  uint32_t cacheHits() const {return cacheHits_;}
+  /** \return Data and directory blocks read into the cache. */
+  uint32_t cacheMisses() const {return cacheMisses_;}
+  /** \return FAT blocks found in the FAT cache. */
+  uint32_t fatCacheHits() const {return fatCacheHits_;}
+  /** \return FAT blocks read into the FAT cache. */
+  uint32_t fatCacheMisses() const {return fatCacheMisses_;}
+  /** Clear the cache hit and miss counts. */
+  void cacheResetCounts() {
+    cacheHits_ = cacheMisses_ = fatCacheHits_ = fatCacheMisses_ = 0;
   }
   /** Initialize a FAT volume.  Try partition one first then try super
    * floppy format.
@@ -122,23 +139,40 @@ class SdVolume {
   // Allow SdBaseFile access to SdVolume private data.
   friend class SdBaseFile;
 
-  // value for dirty argument in cacheRawBlock to indicate read from cache
-  static bool const CACHE_FOR_READ = false;
-  // value for dirty argument in cacheRawBlock to indicate write to cache
-  static bool const CACHE_FOR_WRITE = true;
+  // value for options argument in cacheRawBlock to indicate read from cache
+  static uint8_t const CACHE_FOR_READ = 0;
+  // value for options argument in cacheRawBlock to indicate write to cache
+  static uint8_t const CACHE_FOR_WRITE = 1;
+  // cacheRawBlock option to skip reading a block that will be overwritten
+  static uint8_t const CACHE_OPTION_NO_READ = 2;
+  // cache a block for write without reading it, all of it will be written
+  static uint8_t const CACHE_RESERVE_FOR_WRITE =
+                       CACHE_FOR_WRITE | CACHE_OPTION_NO_READ;
 
 #if USE_MULTIPLE_CARDS
-  cache_t cacheBuffer_;        // 512 byte cache for device blocks
-  uint32_t cacheBlockNumber_;  // Logical number of block in the cache
-  Sd2Card* sdCard_;            // Sd2Card object for cache
-  bool cacheDirty_;            // cacheFlush() will write block if true
-  uint32_t cacheMirrorBlock_;  // block number for mirror FAT
+  cache_t cacheBuffer_[CACHE_ENTRIES];        // 512 byte caches for device blocks
+  uint32_t cacheBlockNumber_[CACHE_ENTRIES];  // Logical number of block in each
+  Sd2Card* sdCard_;                           // Sd2Card object for cache
+  bool cacheDirty_[CACHE_ENTRIES];            // cacheFlush() will write block if true
+  uint32_t cacheMirrorBlock_[CACHE_ENTRIES];  // block number for mirror FAT
+  uint8_t cacheLru_[DATA_CACHE_BLOCKS];       // data entries, most recently used first
+  uint8_t cacheCurrent_;                      // entry cache() returns
+  uint32_t cacheHits_;
+  uint32_t cacheMisses_;
+  uint32_t fatCacheHits_;
+  uint32_t fatCacheMisses_;
 #else  // USE_MULTIPLE_CARDS
-  static cache_t cacheBuffer_;        // 512 byte cache for device blocks
-  static uint32_t cacheBlockNumber_;  // Logical number of block in the cache
-  static Sd2Card* sdCard_;            // Sd2Card object for cache
-  static bool cacheDirty_;            // cacheFlush() will write block if true
-  static uint32_t cacheMirrorBlock_;  // block number for mirror FAT
+  static cache_t cacheBuffer_[CACHE_ENTRIES];        // 512 byte caches for device blocks
+  static uint32_t cacheBlockNumber_[CACHE_ENTRIES];  // Logical number of block in each
+  static Sd2Card* sdCard_;                           // Sd2Card object for cache
+  static bool cacheDirty_[CACHE_ENTRIES];            // cacheFlush() will write block if true
+  static uint32_t cacheMirrorBlock_[CACHE_ENTRIES];  // block number for mirror FAT
+  static uint8_t cacheLru_[DATA_CACHE_BLOCKS];       // data entries, most recently used first
+  static uint8_t cacheCurrent_;                      // entry cache() returns
+  static uint32_t cacheHits_;
+  static uint32_t cacheMisses_;
+  static uint32_t fatCacheHits_;
+  static uint32_t fatCacheMisses_;
 #endif  // USE_MULTIPLE_CARDS
   uint32_t allocSearchStart_;   // start cluster for alloc search
   uint8_t blocksPerCluster_;    // cluster size in blocks
@@ -159,21 +193,27 @@ class SdVolume {
            return dataStartBlock_ + ((cluster - 2) << clusterSizeShift_);}
   uint32_t blockNumber(uint32_t cluster, uint32_t position) const {
            return clusterStartBlock(cluster) + blockOfCluster(position);}
-  cache_t *cache() {return &cacheBuffer_;}
-  uint32_t cacheBlockNumber() {return cacheBlockNumber_;}
+  cache_t *cache() {return &cacheBuffer_[cacheCurrent_];}
+  uint32_t cacheBlockNumber() {return cacheBlockNumber_[cacheCurrent_];}
 #if USE_MULTIPLE_CARDS
+  uint8_t cacheFind(uint32_t blockNumber);
   bool cacheFlush();
-  bool cacheRawBlock(uint32_t blockNumber, bool dirty);
+  void cacheInvalidate(uint32_t blockNumber);
+  bool cacheRawBlock(uint32_t blockNumber, uint8_t options);
+  bool cacheWriteBack(uint8_t entry);
 #else  // USE_MULTIPLE_CARDS
+  static uint8_t cacheFind(uint32_t blockNumber);
   static bool cacheFlush();
-  static bool cacheRawBlock(uint32_t blockNumber, bool dirty);
+  static void cacheInvalidate(uint32_t blockNumber);
+  static bool cacheRawBlock(uint32_t blockNumber, uint8_t options);
+  static bool cacheWriteBack(uint8_t entry);
 #endif  // USE_MULTIPLE_CARDS
-  // used by SdBaseFile write to assign cache to SD location
-  void cacheSetBlockNumber(uint32_t blockNumber, bool dirty) {
-    cacheDirty_ = dirty;
-    cacheBlockNumber_  = blockNumber;
+  cache_t* cacheFetchFat(uint32_t blockNumber, uint8_t options);
+  // true if a data cache entry holds the block
+  bool cacheHolds(uint32_t blockNumber) {
+    return cacheFind(blockNumber) < DATA_CACHE_BLOCKS;
   }
-  void cacheSetDirty() {cacheDirty_ |= CACHE_FOR_WRITE;}
+  void cacheSetDirty() {cacheDirty_[cacheCurrent_] = true;}
   bool chainSize(uint32_t beginCluster, uint32_t* size);
   bool fatGet(uint32_t cluster, uint32_t* value);
   bool fatPut(uint32_t cluster, uint32_t value);
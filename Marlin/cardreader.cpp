@@ -13,6 +13,17 @@ CardReader::CardReader()
 {
   filesize = 0;
   sdpos = 0;
+  startpos = 0;
+  startMotionTime = 0;
+  #if SD_READ_BUFFER_SIZE > 0
+  readStart = 0;
+  readIndex = readCount = 0;
+  #endif
+  #ifdef SD_READ_AHEAD
+  readBuffer = readBlocks[0];
+  aheadCount = 0;
+  aheadPos = aheadBlock = aheadLeft = 0;
+  #endif
   sdprinting = false;
   cardOK = false;
   saving = false;
@@ -199,7 +210,8 @@ void CardReader::startFileprint()
   if(cardOK)
   {
     sdprinting = true;
-    
+    startpos = sdpos;
+    startMotionTime = plan_executed_time();
   }
 }
 
@@ -229,12 +241,12 @@ void CardReader::openFile(char* name,bool read)
   if(name[0]=='/')
   {
     dirname_start=strchr(name,'/')+1;
-    while(dirname_start>0)
+    while(dirname_start!=NULL)
     {
       dirname_end=strchr(dirname_start,'/');
       //SERIAL_ECHO("start:");SERIAL_ECHOLN((int)(dirname_start-name));
       //SERIAL_ECHO("end  :");SERIAL_ECHOLN((int)(dirname_end-name));
-      if(dirname_end>0 && dirname_end>dirname_start)
+      if(dirname_end!=NULL && dirname_end>dirname_start)
       {
         char subdirname[13];
         strncpy(subdirname, dirname_start, dirname_end-dirname_start);
@@ -279,6 +291,14 @@ void CardReader::openFile(char* name,bool read)
       SERIAL_PROTOCOLPGM(MSG_SD_SIZE);
       SERIAL_PROTOCOLLN(filesize);
       sdpos = 0;
+      #if SD_READ_BUFFER_SIZE > 0
+      readStart = 0;
+      readIndex = readCount = 0;
+      #endif
+      #ifdef SD_READ_AHEAD
+      stopReadAhead();
+      aheadPos = 0;
+      #endif
       
       SERIAL_PROTOCOLLNPGM(MSG_SD_FILE_SELECTED);
       lcd_setstatus(fname);
@@ -325,12 +345,12 @@ void CardReader::removeFile(char* name)
   if(name[0]=='/')
   {
     dirname_start=strchr(name,'/')+1;
-    while(dirname_start>0)
+    while(dirname_start!=NULL)
     {
       dirname_end=strchr(dirname_start,'/');
       //SERIAL_ECHO("start:");SERIAL_ECHOLN((int)(dirname_start-name));
       //SERIAL_ECHO("end  :");SERIAL_ECHOLN((int)(dirname_end-name));
-      if(dirname_end>0 && dirname_end>dirname_start)
+      if(dirname_end!=NULL && dirname_end>dirname_start)
       {
         char subdirname[13];
         strncpy(subdirname, dirname_start, dirname_end-dirname_start);
@@ -392,6 +412,146 @@ void CardReader::getStatus()
     SERIAL_PROTOCOLLNPGM(MSG_SD_NOT_PRINTING);
   }
 }
+
+void CardReader::reportCacheCounts()
+{
+  SERIAL_PROTOCOLPGM("SD cache hits:");
+  SERIAL_PROTOCOL(volume.cacheHits());
+  SERIAL_PROTOCOLPGM(" misses:");
+  #if USE_SEPARATE_FAT_CACHE
+  SERIAL_PROTOCOL(volume.cacheMisses());
+  SERIAL_PROTOCOLPGM(" FAT hits:");
+  SERIAL_PROTOCOL(volume.fatCacheHits());
+  SERIAL_PROTOCOLPGM(" misses:");
+  SERIAL_PROTOCOLLN(volume.fatCacheMisses());
+  #else
+  SERIAL_PROTOCOLLN(volume.cacheMisses());
+  #endif
+}
+
+void CardReader::resetCacheCounts()
+{
+  volume.cacheResetCounts();
+}
+
+// Seconds left of the print: the motion time of the moves read since the print started (accelerations 
+// included) scaled to the rest of the file, plus what is still queued. Unlike percentDone() this knows 
+// that a stretch of short moves takes longer per byte than one of long moves. 0 until the first moves.
+unsigned long CardReader::timeLeft()
+{
+  if(!isFileOpen() || sdpos <= startpos)
+    return 0;
+  float buffered_time = plan_buffered_time() / 1000000.0;
+  float planned_time = plan_executed_time() - startMotionTime + buffered_time;
+  return planned_time * (filesize - sdpos) / (sdpos - startpos) + buffered_time;
+}
+
+#if SD_READ_BUFFER_SIZE > 0
+#ifdef SD_READ_AHEAD
+// Longest run of blocks read with one CMD18, bounds the walk along the FAT before it
+#define READ_AHEAD_MAX_BLOCKS 256
+
+// Swaps in the block read ahead, reading it now if there was no time before, false at the end of the file
+bool CardReader::fillReadBuffer()
+{
+  readStart += readCount;
+  readIndex = 0;
+  if(!aheadCount)
+    readAhead();
+  readBuffer = readBlocks[readBuffer == readBlocks[0]];
+  readCount = aheadCount;
+  aheadCount = 0;
+  return readCount != 0;
+}
+
+// Reads the block that follows readBuffer into the other half of readBlocks. Called from 
+// manage_inactivity() while the printer waits, so that get() usually finds it there.
+void CardReader::readAhead()
+{
+  if(aheadCount || aheadPos >= filesize || !isFileOpen())
+    return;
+  uint8_t *dst = readBlocks[readBuffer == readBlocks[0]];
+  if(!aheadLeft) {
+    // Next run of contiguous blocks, the multiple block read of the last one has been stopped
+    if(!file.seekSet(aheadPos) || !file.contiguousRun(READ_AHEAD_MAX_BLOCKS, &aheadBlock, &aheadLeft))
+      return;
+  }
+  bool ok;
+  if(card.readingMultiple())
+    ok = card.readData(dst);
+  else if(aheadLeft == 1) //a run of one block (one block clusters, the end of the file) isn't worth a CMD18 and CMD12
+    ok = card.readBlock(aheadBlock, dst);
+  else //start of a run, or another command has ended the read since
+    ok = card.readStart(aheadBlock) && card.readData(dst);
+  if(!ok) {
+    stopReadAhead();
+    return;
+  }
+  aheadBlock++;
+  if(--aheadLeft == 0 && card.readingMultiple())
+    card.readStop();
+  aheadCount = min(512, filesize - aheadPos);
+  aheadPos += aheadCount;
+}
+
+void CardReader::stopReadAhead()
+{
+  aheadCount = 0;
+  aheadLeft = 0;
+  if(card.readingMultiple())
+    card.readStop();
+}
+
+void CardReader::setIndex(long index)
+{
+  stopReadAhead();
+  sdpos = index;
+  aheadPos = index & ~0x1FFL;
+  file.seekSet(aheadPos);
+  readStart = aheadPos;
+  readCount = 0;
+  fillReadBuffer();
+  readIndex = min(index - readStart, readCount);
+}
+#else
+// Reads the next SD_READ_BUFFER_SIZE bytes of the file, false at its end
+bool CardReader::fillReadBuffer()
+{
+  readStart += readCount;
+  readIndex = 0;
+  int16_t n = file.read(readBuffer, SD_READ_BUFFER_SIZE);
+  readCount = n > 0 ? n : 0;
+  return readCount != 0;
+}
+#endif //SD_READ_AHEAD
+
+int16_t CardReader::read(void* buf, uint16_t nbyte)
+{
+  uint8_t *dst = (uint8_t *)buf;
+  uint16_t done = 0;
+  while(done < nbyte && (readIndex < readCount || fillReadBuffer())) {
+    uint16_t n = min(nbyte - done, readCount - readIndex);
+    memcpy(dst + done, readBuffer + readIndex, n);
+    readIndex += n;
+    done += n;
+  }
+  sdpos = readStart + readIndex;
+  return done;
+}
+
+// Passes over a comment: the next get() returns the '\n' or '\r' that ends it
+void CardReader::skipToLineEnd()
+{
+  do {
+    for(; readIndex < readCount; readIndex++) {
+      uint8_t c = readBuffer[readIndex];
+      if(c == '\n' || c == '\r')
+        return;
+    }
+  } while(fillReadBuffer());
+}
+#endif //SD_READ_BUFFER_SIZE
+
 void CardReader::write_command(char *buf)
 {
   char* begin = buf;
@@ -473,6 +633,40 @@ void CardReader::closefile()
   saving = false; 
 }
 
+#ifdef ISR_TRACE
+bool CardReader::openTrace(char* name)
+{
+  if(!cardOK)
+    return false;
+  traceFile.close();
+  if (!traceFile.open(&root, name, O_CREAT | O_WRITE | O_TRUNC))
+  {
+    SERIAL_PROTOCOLPGM(MSG_SD_OPEN_FILE_FAIL);
+    SERIAL_PROTOCOL(name);
+    SERIAL_PROTOCOLLNPGM(".");
+    return false;
+  }
+  return true;
+}
+
+void CardReader::writeTrace(const void* buf, uint16_t nbyte)
+{
+  traceFile.writeError = false;
+  traceFile.write(buf, nbyte);
+  if (traceFile.writeError)
+  {
+    SERIAL_ERROR_START;
+    SERIAL_ERRORLNPGM(MSG_SD_ERR_WRITE_TO_FILE);
+  }
+}
+
+void CardReader::closeTrace()
+{
+  traceFile.sync();
+  traceFile.close();
+}
+#endif // ISR_TRACE
+
 void CardReader::getfilename(const uint8_t nr)
 {
   curDir=&workDir;
@@ -23,7 +23,10 @@ public:
   void startFileprint();
   void pauseSDPrint();
   void getStatus();
+  unsigned long timeLeft();
   void printingHasFinished();
+  void reportCacheCounts();
+  void resetCacheCounts();
 
   void getfilename(const uint8_t nr);
   uint16_t getnrfilenames();
@@ -34,11 +37,32 @@ public:
   void updir();
   void setroot();
 
+  #ifdef ISR_TRACE
+  bool openTrace(char* name);
+  void writeTrace(const void* buf, uint16_t nbyte);
+  void closeTrace();
+  #endif
 
   FORCE_INLINE bool isFileOpen() { return file.isOpen(); }
   FORCE_INLINE bool eof() { return sdpos>=filesize ;};
+  #if SD_READ_BUFFER_SIZE > 0
+  // sdpos is the position of the byte returned, as with file.read() one byte at a time
+  FORCE_INLINE int16_t get() { sdpos = readStart + readIndex; if(readIndex == readCount && !fillReadBuffer()) return -1; return readBuffer[readIndex++]; };
+  #ifdef SD_READ_AHEAD
+  void setIndex(long index);
+  void readAhead();
+  #else
+  FORCE_INLINE void setIndex(long index) {sdpos = index;file.seekSet(index);readStart = file.curPosition();readIndex = readCount = 0;};
+  #endif
+  int16_t read(void* buf, uint16_t nbyte);
+  void skipToLineEnd();
+  #else
   FORCE_INLINE int16_t get() {  sdpos = file.curPosition();return (int16_t)file.read();};
   FORCE_INLINE void setIndex(long index) {sdpos = index;file.seekSet(index);};
+  FORCE_INLINE int16_t read(void* buf, uint16_t nbyte) { int16_t n = file.read(buf, nbyte); sdpos = file.curPosition(); return n; };
+  FORCE_INLINE void skipToLineEnd() {};
+  #endif
+  FORCE_INLINE uint32_t getIndex() { return sdpos; };
   FORCE_INLINE uint8_t percentDone(){if(!isFileOpen()) return 0; if(filesize) return sdpos/((filesize+99)/100); else return 0;};
   FORCE_INLINE char* getWorkDirName(){workDir.getFilename(filename);return filename;};
 
@@ -55,10 +79,30 @@ private:
   Sd2Card card;
   SdVolume volume;
   SdFile file;
+  #ifdef ISR_TRACE
+  SdFile traceFile; //written next to the file being printed or saved
+  #endif
   uint32_t filesize;
   //int16_t n;
   unsigned long autostart_atmillis;
   uint32_t sdpos ;
+  uint32_t startpos; //sdpos when the print was started, timeLeft() goes by the moves read since
+  float startMotionTime; //plan_executed_time() when the print was started
+  #if SD_READ_BUFFER_SIZE > 0
+  #ifdef SD_READ_AHEAD
+  uint8_t readBlocks[2][512]; //readBuffer points to one, the other holds the next aheadCount bytes of the file
+  uint8_t *readBuffer;
+  uint16_t aheadCount;
+  uint32_t aheadPos; //file position of the next block from the card
+  uint32_t aheadBlock, aheadLeft; //that block and the blocks left in its run
+  void stopReadAhead();
+  #else
+  uint8_t readBuffer[SD_READ_BUFFER_SIZE]; //the file from readStart on, get() hands out readBuffer[readIndex]
+  #endif
+  uint32_t readStart;
+  uint16_t readIndex, readCount;
+  bool fillReadBuffer();
+  #endif
 
   bool autostart_stilltocheck; //the sd start is delayed, because otherwise the serial cannot answer fast enought to make contact with the hostsoftware.
   
@@ -0,0 +1,22 @@
+/*
+  Print.h - minimal Arduino Print base class for the host build (SdFile only)
+*/
+#ifndef HOST_PRINT_H
+#define HOST_PRINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+class Print
+{
+  public:
+#if ARDUINO >= 100
+    virtual size_t write(uint8_t) = 0;
+#else
+    virtual void write(uint8_t) = 0;
+#endif
+    virtual void write(const char *str) { while (*str) write((uint8_t)*str++); }
+    virtual void write(const uint8_t *buffer, size_t size) { while (size--) write(*buffer++); }
+};
+
+#endif
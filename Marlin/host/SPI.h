@@ -0,0 +1 @@
+/* SPI.h - the SPI library is not used by the host build */
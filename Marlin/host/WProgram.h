@@ -0,0 +1,61 @@
+/*
+  WProgram.h - the subset of the Arduino core API used by Marlin, for the
+  host build.  Time is the simulated clock of host_sim.cpp.
+*/
+#ifndef HOST_WPROGRAM_H
+#define HOST_WPROGRAM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <stdio.h>
+
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#include "WString.h"
+
+#define HIGH 0x1
+#define LOW  0x0
+#define INPUT 0x0
+#define OUTPUT 0x1
+
+#define PI 3.1415926535897932384626433832795
+#define HALF_PI 1.5707963267948966192313216916398
+#define TWO_PI 6.283185307179586476925286766559
+#define DEG_TO_RAD 0.017453292519943295769236907684886
+#define RAD_TO_DEG 57.295779513082320876798154814105
+
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+#define radians(deg) ((deg)*DEG_TO_RAD)
+#define degrees(rad) ((rad)*RAD_TO_DEG)
+#define sq(x) ((x)*(x))
+
+// avr-libc extension to math.h
+static inline double square(double x) { return x * x; }
+
+// SdBaseFile.h declares its own fpos_t, which clashes with the one of stdio.h
+#define fpos_t sd_fpos_t
+
+typedef uint8_t boolean;
+typedef uint8_t byte;
+typedef unsigned int word;
+
+#define A0 54
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int val);
+
+#endif
@@ -0,0 +1,19 @@
+/*
+  WString.h - minimal String for the host build (MarlinSerial::print only)
+*/
+#ifndef HOST_WSTRING_H
+#define HOST_WSTRING_H
+
+#include <string.h>
+
+class String
+{
+  public:
+    String(const char *s = "") : str(s) {}
+    unsigned int length() const { return strlen(str); }
+    char operator[](unsigned int i) const { return str[i]; }
+  private:
+    const char *str;
+};
+
+#endif
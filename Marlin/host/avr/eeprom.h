@@ -0,0 +1,12 @@
+/*
+  avr/eeprom.h - EEPROM of the host build, backed by a RAM array
+*/
+#ifndef HOST_AVR_EEPROM_H
+#define HOST_AVR_EEPROM_H
+
+#include <avr/io.h>
+
+uint8_t eeprom_read_byte(const uint8_t *addr);
+void eeprom_write_byte(uint8_t *addr, uint8_t value);
+
+#endif
@@ -0,0 +1,19 @@
+/*
+  avr/interrupt.h - interrupt vectors of the host build
+
+  An ISR becomes a plain C function named after its vector; host_sim.cpp
+  calls it when the simulated peripheral raises the interrupt.
+*/
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define ISR(vector, ...) extern "C" void vector(void); extern "C" void vector(void)
+#define SIGNAL(vector) ISR(vector)
+
+void host_sei();
+#define cli() do { SREG &= ~0x80; } while (0)
+#define sei() host_sei()
+
+#endif
@@ -0,0 +1,164 @@
+/*
+  avr/io.h - register file of the host build
+
+  Plain GPIO and timer registers are ordinary variables so that fastio.h,
+  Sd2PinMap.h and the stepper code compile unchanged.  The registers whose
+  access has a side effect on real hardware (USART data/status, SPI data)
+  are small objects that forward to the simulated peripherals in host_sim.cpp.
+*/
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+#define E2END 0x0FFF
+#define _SFR_BYTE(sfr) (sfr)
+
+#define HOST_REG8(name) extern volatile uint8_t name;
+#define HOST_PORT(p) HOST_REG8(PIN##p) HOST_REG8(PORT##p) HOST_REG8(DDR##p)
+HOST_PORT(A) HOST_PORT(B) HOST_PORT(C) HOST_PORT(D) HOST_PORT(E) HOST_PORT(F)
+HOST_PORT(G) HOST_PORT(H) HOST_PORT(J) HOST_PORT(K) HOST_PORT(L)
+
+HOST_REG8(SREG) HOST_REG8(MCUSR)
+HOST_REG8(TCCR0A) HOST_REG8(TCCR0B) HOST_REG8(TIMSK0) HOST_REG8(OCR0A) HOST_REG8(OCR0B)
+HOST_REG8(TCNT0) HOST_REG8(TIFR0)
+HOST_REG8(TCCR1A) HOST_REG8(TCCR1B) HOST_REG8(TCCR1C) HOST_REG8(TIMSK1) HOST_REG8(TIFR1)
+HOST_REG8(TCCR2A) HOST_REG8(TCCR2B) HOST_REG8(OCR2A) HOST_REG8(OCR2B)
+HOST_REG8(TCCR3A) HOST_REG8(TCCR3B) HOST_REG8(TIMSK3)
+HOST_REG8(TCCR4A) HOST_REG8(TCCR4B) HOST_REG8(TIMSK4)
+HOST_REG8(TCCR5A) HOST_REG8(TCCR5B) HOST_REG8(TIMSK5)
+HOST_REG8(OCR3AL) HOST_REG8(OCR3BL) HOST_REG8(OCR3CL)
+HOST_REG8(OCR4AL) HOST_REG8(OCR4BL) HOST_REG8(OCR4CL)
+HOST_REG8(OCR5AL) HOST_REG8(OCR5BL) HOST_REG8(OCR5CL)
+HOST_REG8(ADCSRA) HOST_REG8(ADCSRB) HOST_REG8(ADMUX) HOST_REG8(DIDR0) HOST_REG8(DIDR2)
+HOST_REG8(UCSR0B) HOST_REG8(UCSR0C) HOST_REG8(UBRR0H) HOST_REG8(UBRR0L)
+HOST_REG8(SPCR) HOST_REG8(SPSR)
+#undef HOST_PORT
+#undef HOST_REG8
+
+extern volatile uint16_t OCR1A;
+extern volatile uint16_t OCR1B;
+extern volatile uint16_t TCNT1;
+extern volatile uint16_t OCR3A;
+extern volatile uint16_t TCNT3;
+extern volatile uint16_t ADC;
+#define ADCW ADC
+
+// USART0 status register A, computed from the simulated line on every read.
+class host_ucsra
+{
+  public:
+    operator uint8_t() const;
+    host_ucsra &operator=(uint8_t v);
+    host_ucsra &operator|=(uint8_t v) { return *this = (uint8_t)(*this | v); }
+    host_ucsra &operator&=(uint8_t v) { return *this = (uint8_t)(*this & v); }
+};
+
+// USART0 data register: writing transmits a byte, reading pops the receiver.
+class host_udr
+{
+  public:
+    operator uint8_t() const;
+    host_udr &operator=(uint8_t c);
+};
+
+// SPI data register: writing clocks a byte out, reading returns the reply.
+class host_spdr
+{
+  public:
+    operator uint8_t() const;
+    host_spdr &operator=(uint8_t c);
+};
+
+extern host_ucsra UCSR0A;
+extern host_udr UDR0;
+extern host_spdr SPDR;
+
+// MarlinSerial.h probes for the USART with #ifdef, as avr-libc defines them
+#define UBRR0H UBRR0H
+#define UDR0 UDR0
+
+// Bits of the ports, named the way fastio.h expects them
+#define HOST_PORT_BITS(p) \
+  enum { PIN##p##0, PIN##p##1, PIN##p##2, PIN##p##3, PIN##p##4, PIN##p##5, PIN##p##6, PIN##p##7 };
+HOST_PORT_BITS(A) HOST_PORT_BITS(B) HOST_PORT_BITS(C) HOST_PORT_BITS(D)
+HOST_PORT_BITS(E) HOST_PORT_BITS(F) HOST_PORT_BITS(G) HOST_PORT_BITS(H)
+HOST_PORT_BITS(J) HOST_PORT_BITS(K) HOST_PORT_BITS(L)
+#undef HOST_PORT_BITS
+
+// Timers
+#define WGM10 0
+#define WGM11 1
+#define WGM12 3
+#define WGM13 4
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define COM1B0 4
+#define COM1B1 5
+#define COM1A0 6
+#define COM1A1 7
+#define OCIE1A 1
+#define OCIE1B 2
+#define OCIE0B 2
+#define TOV0 0
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define CS30 0
+#define CS31 1
+#define CS32 2
+#define CS40 0
+#define CS41 1
+#define CS42 2
+#define CS50 0
+#define CS51 1
+#define CS52 2
+#define WGM30 0
+#define WGM31 1
+#define WGM32 3
+#define WGM33 4
+#define OCIE3A 1
+
+// ADC
+#define ADEN 7
+#define ADSC 6
+#define ADIF 4
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define REFS0 6
+#define MUX5 3
+
+// USART0
+#define RXC0 7
+#define TXC0 6
+#define UDRE0 5
+#define FE0 4
+#define DOR0 3
+#define UPE0 2
+#define U2X0 1
+#define RXCIE0 7
+#define TXCIE0 6
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+
+// SPI
+#define SPIE 7
+#define SPE 6
+#define DORD 5
+#define MSTR 4
+#define CPOL 3
+#define CPHA 2
+#define SPR1 1
+#define SPR0 0
+#define SPIF 7
+#define WCOL 6
+#define SPI2X 0
+
+#endif
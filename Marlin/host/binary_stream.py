@@ -0,0 +1,210 @@
+#!/usr/bin/env python
+
+""" Convert G-code to the BINARY_PROTOCOL packets and write or stream them.
+
+M580 switches the firmware to packets, an EXIT packet back to G-code lines.
+A packet is
+
+  0xA5, opcode, sequence number, argument, payload, CRC16
+
+with the CRC16-CCITT (polynomial 0x1021, start 0xFFFF) over opcode to payload.
+The sequence number starts at 0 after M580 and counts every packet. Values
+are little endian.
+
+  1 MOVE_ABS  argument: axes present, bits 0-3 XYZE, bit 4 F
+              payload: int32 position in um per axis, uint16 F in mm/min
+  2 MOVE_REL  the same with int16 distances in um
+  3 TEXT      argument: length, payload: a G-code line
+  4 EXIT
+
+G0/G1 with nothing but XYZEF become MOVE_REL where the positions are known
+and the distances fit, MOVE_ABS otherwise; everything else goes as TEXT. The
+firmware acknowledges each packet with "ok", a broken or lost one with
+"Resend: <sequence number>" and "ok". Packet moves bypass the firmware
+retraction of FWRETRACT.
+
+With -o the file gets exactly the bytes sent over the line, for
+marlin_replay -B. Copied to the SD card it prints like G-code (M23/M24),
+the firmware reads the packets after the M580 line straight into its
+command buffer. Tool changes stay T lines. With -p the packets are sent to
+the printer one per "ok" (needs pyserial).
+"""
+
+from __future__ import print_function
+
+import argparse
+import re
+import struct
+import sys
+
+SYNC = 0xA5
+MOVE_ABS, MOVE_REL, TEXT, EXIT = 1, 2, 3, 4
+F_BIT = 0x10
+AXES = 'XYZE'
+TEXT_MAX = 91  # MAX_CMD_SIZE - 5
+
+def crc16(data, crc=0xFFFF):
+    for byte in bytearray(data):
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+def packet(opcode, seq, arg, payload=b''):
+    body = struct.pack('<BBB', opcode, seq & 0xFF, arg) + payload
+    return struct.pack('<B', SYNC) + body + struct.pack('<H', crc16(body))
+
+class Encoder(object):
+    """ Follows the modes and positions of the G-code, so that moves can go as distances """
+
+    def __init__(self):
+        self.seq = 0
+        self.relative = False
+        self.relative_e = False
+        self.position = [None] * 4  # um, None where the firmware may be anywhere
+        self.moves = self.texts = self.bytes = 0
+
+    def next_packet(self, opcode, arg, payload=b''):
+        data = packet(opcode, self.seq, arg, payload)
+        self.seq += 1
+        self.bytes += len(data)
+        return data
+
+    def text(self, line):
+        line = line.encode('ascii')
+        if len(line) > TEXT_MAX:
+            raise ValueError('line too long: %s' % line)
+        self.texts += 1
+        return self.next_packet(TEXT, len(line), line)
+
+    def move(self, words):
+        targets = {}
+        for i, axis in enumerate(AXES):
+            if axis not in words:
+                continue
+            value = int(round(words[axis] * 1000))
+            if self.relative or (axis == 'E' and self.relative_e):
+                if self.position[i] is None:
+                    return None
+                value += self.position[i]
+            targets[i] = value
+        mask = 0
+        payload = b''
+        if all(self.position[i] is not None and abs(v - self.position[i]) < 32768 for i, v in targets.items()):
+            opcode = MOVE_REL
+            for i in sorted(targets):
+                if targets[i] != self.position[i]:
+                    mask |= 1 << i
+                    payload += struct.pack('<h', targets[i] - self.position[i])
+        else:
+            opcode = MOVE_ABS
+            for i in sorted(targets):
+                mask |= 1 << i
+                payload += struct.pack('<i', targets[i])
+        if 'F' in words:
+            mask |= F_BIT
+            payload += struct.pack('<H', max(0, min(65535, int(round(words['F'])))))
+        for i, v in targets.items():
+            self.position[i] = v
+        self.moves += 1
+        return self.next_packet(opcode, mask, payload)
+
+    def encode(self, line):
+        """ Packet for a G-code line without comment, None for an empty line """
+        line = re.sub(r'\*\d+$', '', line.split(';')[0]).strip()
+        line = re.sub(r'^N\d+\s*', '', line)
+        if not line or line.startswith('M580'):
+            return None
+        words = {}
+        for letter, value in re.findall(r'([A-Za-z])\s*([-+]?[0-9.]*)', line):
+            # The first one counts, later letters may be part of a file name (M23 gcode.gco)
+            try:
+                words.setdefault(letter.upper(), float(value))
+            except ValueError:
+                words.setdefault(letter.upper(), None)
+        if words.get('G') is not None and int(words['G']) in (0, 1) and set(words) <= set('GXYZEF') and \
+                all(v is not None for v in words.values()):
+            data = self.move(words)
+            if data:
+                return data
+        self.follow(words)
+        return self.text(line)
+
+    def follow(self, words):
+        g = words.get('G')
+        m = words.get('M')
+        if g == 90:
+            self.relative = False
+        elif g == 91:
+            self.relative = True
+        elif g == 92:
+            given = [i for i, axis in enumerate(AXES) if axis in words]
+            for i in given or range(4):
+                value = words.get(AXES[i]) or 0.0
+                self.position[i] = int(round(value * 1000))
+        elif m == 82:
+            self.relative_e = False
+        elif m == 83:
+            self.relative_e = True
+        elif g is not None or 'T' in words:
+            # Homing, arcs, tool changes and the like leave the axes somewhere the encoder doesn't follow
+            self.position = [None] * 4
+
+    def exit(self):
+        return self.next_packet(EXIT, 0)
+
+def encode_file(f, encoder):
+    for line in f:
+        data = encoder.encode(line)
+        if data:
+            yield data
+    yield encoder.exit()
+
+def stream(port, packets):
+    """ One packet per "ok", resending the ones the firmware asks for """
+    sent = {}
+    def wait_ok():
+        resend = None
+        while True:
+            reply = port.readline().decode('ascii', 'replace').strip()
+            if reply.startswith('Resend:'):
+                resend = int(reply.split(':')[1])
+            elif reply.startswith('ok'):
+                return resend
+            elif reply:
+                print(reply)
+    port.write(b'M580\n')
+    wait_ok()
+    for data in packets:
+        sent[bytearray(data)[2]] = data
+        port.write(data)
+        resend = wait_ok()
+        while resend is not None:
+            port.write(sent[resend])
+            resend = wait_ok()
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-o', '--output', help='write the serial bytes to this file')
+    parser.add_argument('-p', '--port', help='stream to this serial port')
+    parser.add_argument('-b', '--baud', type=int, default=250000, help='baud rate (default 250000)')
+    parser.add_argument('file', nargs='?', help='G-code file (default stdin)')
+    args = parser.parse_args()
+    if not args.output and not args.port:
+        parser.error('need -o or -p')
+
+    encoder = Encoder()
+    f = open(args.file) if args.file else sys.stdin
+    if args.output:
+        with open(args.output, 'wb') as out:
+            out.write(b'M580\n')
+            for data in encode_file(f, encoder):
+                out.write(data)
+    else:
+        import serial
+        stream(serial.Serial(args.port, args.baud, timeout=None), encode_file(f, encoder))
+    print('%d moves, %d text packets, %d bytes' % (encoder.moves, encoder.texts, encoder.bytes), file=sys.stderr)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,248 @@
+/*
+  host_sd.cpp - SD card on the simulated SPI bus, backed by an image file
+
+  Answers the SPI mode commands Sd2Card uses (SDHC, block addressed):
+  initialisation, CSD/CID, single and multiple block reads and writes.
+  The card takes host_sd_read_access_us from a read command to its first
+  data token and host_sd_next_block_us between the blocks of a multiple
+  block read, and is busy for host_sd_write_busy_us after each block
+  written.  That is simulated time on top of the SPI transfer time host_sim
+  charges for every byte; the defaults are typical of class 4-10 cards.
+*/
+#include <deque>
+#include <stdio.h>
+#include <string.h>
+
+#include "WProgram.h"
+#include "host_sim.h"
+
+unsigned long host_sd_read_access_us = 250;
+unsigned long host_sd_next_block_us = 20;
+unsigned long host_sd_write_busy_us = 1000;
+host_sd_stats_t host_sd_stats;
+
+enum sd_state {
+  SD_IDLE,
+  SD_READ,          // single block read, token at ready_at
+  SD_READ_MULTIPLE, // next block at ready_at
+  SD_WRITE_TOKEN,   // waiting for the data token of a write
+  SD_WRITE_DATA     // receiving the block
+};
+
+static FILE *image;
+static uint32_t image_blocks;
+static std::deque<uint8_t> out;     // bytes the card shifts out next
+static uint8_t cmd[6];
+static uint8_t cmd_len;
+static bool app_cmd, idle = true;
+static sd_state state = SD_IDLE;
+static bool write_multiple;
+static uint32_t block;
+static host_ticks_t ready_at;       // next data token of a read
+static host_ticks_t busy_until;     // programming the last block written
+static uint8_t data[512 + 2];
+static uint16_t data_len;
+
+static host_ticks_t us_ticks(unsigned long us)
+{
+  return (host_ticks_t)us * HOST_TICKS_PER_SECOND / 1000000;
+}
+
+static void queue_block(uint32_t n)
+{
+  uint8_t buf[512];
+  memset(buf, 0, sizeof(buf));
+  if(n < image_blocks) {
+    fseeko(image, (off_t)n * 512, SEEK_SET);
+    if(fread(buf, 1, 512, image) != 512)
+      memset(buf, 0, sizeof(buf));
+  }
+  out.push_back(0xFE);
+  out.insert(out.end(), buf, buf + 512);
+  out.push_back(0xFF); // CRC, not checked by Sd2Card
+  out.push_back(0xFF);
+  host_sd_stats.blocks_read++;
+}
+
+static void queue_register(const uint8_t *reg)
+{
+  out.push_back(0xFE);
+  out.insert(out.end(), reg, reg + 16);
+  out.push_back(0xFF);
+  out.push_back(0xFF);
+}
+
+static void execute()
+{
+  uint8_t index = cmd[0] & 0x3F;
+  uint32_t arg = (uint32_t)cmd[1] << 24 | (uint32_t)cmd[2] << 16 | cmd[3] << 8 | cmd[4];
+  bool acmd = app_cmd;
+  app_cmd = false;
+  host_sd_stats.commands++;
+  out.clear();
+  out.push_back(0xFF); // NCR
+  uint8_t r1 = idle ? 0x01 : 0x00;
+  switch(index) {
+  case 0:
+    idle = true;
+    state = SD_IDLE;
+    out.push_back(0x01);
+    break;
+  case 8:
+    out.push_back(r1);
+    out.push_back(0x00); out.push_back(0x00); out.push_back(0x01); out.push_back(0xAA);
+    break;
+  case 55:
+    app_cmd = true;
+    out.push_back(r1);
+    break;
+  case 41:
+    if(acmd)
+      idle = false;
+    out.push_back(acmd ? 0x00 : 0x04);
+    break;
+  case 58: // OCR: powered up, high capacity
+    out.push_back(r1);
+    out.push_back(0xC0); out.push_back(0xFF); out.push_back(0x80); out.push_back(0x00);
+    break;
+  case 9: { // CSD version 2
+    uint8_t csd[16];
+    memset(csd, 0, sizeof(csd));
+    uint32_t c_size = image_blocks / 1024 - 1;
+    csd[0] = 0x40;
+    csd[7] = (c_size >> 16) & 0x3F;
+    csd[8] = c_size >> 8;
+    csd[9] = c_size;
+    csd[10] = 0x40; // erase_blk_en
+    out.push_back(r1);
+    queue_register(csd);
+    break;
+  }
+  case 10: {
+    uint8_t cid[16];
+    memset(cid, 0, sizeof(cid));
+    out.push_back(r1);
+    queue_register(cid);
+    break;
+  }
+  case 12:
+    state = SD_IDLE;
+    out.push_back(0xFF); // stuff byte
+    out.push_back(0x00);
+    host_sd_stats.read_stops++;
+    break;
+  case 13:
+    out.push_back(0x00);
+    out.push_back(0x00);
+    break;
+  case 17:
+  case 18:
+    out.push_back(0x00);
+    state = index == 17 ? SD_READ : SD_READ_MULTIPLE;
+    block = arg;
+    ready_at = host_now + us_ticks(host_sd_read_access_us);
+    if(index == 17)
+      host_sd_stats.single_reads++;
+    else
+      host_sd_stats.multiple_reads++;
+    break;
+  case 24:
+  case 25:
+    out.push_back(0x00);
+    state = SD_WRITE_TOKEN;
+    write_multiple = index == 25;
+    block = arg;
+    break;
+  case 23: // ACMD23 pre-erase count
+  case 32:
+  case 33:
+  case 38:
+    out.push_back(0x00);
+    break;
+  default:
+    out.push_back(r1 | 0x04); // illegal command
+    break;
+  }
+}
+
+static void write_block()
+{
+  if(block < image_blocks) {
+    fseeko(image, (off_t)block * 512, SEEK_SET);
+    fwrite(data, 1, 512, image);
+  }
+  host_sd_stats.blocks_written++;
+  block++;
+  out.push_back(0xE5); // data accepted
+  busy_until = host_now + us_ticks(host_sd_write_busy_us);
+  state = write_multiple ? SD_WRITE_TOKEN : SD_IDLE;
+}
+
+static uint8_t sd_transfer(uint8_t in)
+{
+  // What the card shifts out while `in` comes in
+  uint8_t reply = 0xFF;
+  if(!out.empty()) {
+    reply = out.front();
+    out.pop_front();
+    if(out.empty() && state == SD_READ_MULTIPLE)
+      ready_at = host_now + us_ticks(host_sd_next_block_us);
+  }
+  else if(host_now < busy_until && (state == SD_IDLE || state == SD_WRITE_TOKEN))
+    reply = 0x00; // busy programming
+  else if((state == SD_READ || state == SD_READ_MULTIPLE) && host_now >= ready_at && cmd_len == 0) {
+    queue_block(block++);
+    if(state == SD_READ)
+      state = SD_IDLE;
+    reply = out.front();
+    out.pop_front();
+  }
+
+  if(cmd_len) {
+    cmd[cmd_len++] = in;
+    if(cmd_len == 6) {
+      cmd_len = 0;
+      execute();
+    }
+  }
+  else if(state == SD_WRITE_TOKEN) {
+    if(in == 0xFE || in == 0xFC) {
+      state = SD_WRITE_DATA;
+      data_len = 0;
+    }
+    else if(in == 0xFD) { // stop transmission
+      state = SD_IDLE;
+      busy_until = host_now + us_ticks(host_sd_write_busy_us);
+    }
+    else if((in & 0xC0) == 0x40) {
+      state = SD_IDLE;
+      cmd[0] = in;
+      cmd_len = 1;
+    }
+  }
+  else if(state == SD_WRITE_DATA) {
+    data[data_len++] = in;
+    if(data_len == sizeof(data))
+      write_block();
+  }
+  else if((in & 0xC0) == 0x40) {
+    // A command ends a multiple block read, whatever the card was sending
+    cmd[0] = in;
+    cmd_len = 1;
+    out.clear();
+    if(state == SD_READ || state == SD_READ_MULTIPLE)
+      state = SD_IDLE;
+  }
+  return reply;
+}
+
+bool host_sd_open(const char *path)
+{
+  image = fopen(path, "r+b");
+  if(!image)
+    return false;
+  fseeko(image, 0, SEEK_END);
+  image_blocks = ftello(image) / 512;
+  host_spi_transfer = sd_transfer;
+  return true;
+}
@@ -0,0 +1,521 @@
+/*
+  host_sim.cpp - simulated clock and peripherals of the host build
+
+  Models just enough of the ATmega2560 for the motion code: timer1 in CTC
+  mode driving TIMER1_COMPA_vect, timer3 the same way for TIMER3_COMPA_vect
+  when the firmware has one, USART0 with its receive interrupt and a
+  transmitter that takes one frame time per byte (with the data register
+  empty interrupt if the firmware has one), SPI transfer times, the
+  EEPROM and the Arduino time functions.
+*/
+#include <deque>
+#include <time.h>
+
+#include "WProgram.h"
+#include <avr/eeprom.h>
+#include <util/delay.h>
+#include "host_sim.h"
+
+extern "C" void TIMER1_COMPA_vect(void);
+extern "C" void USART0_RX_vect(void);
+extern "C" void TIMER3_COMPA_vect(void) __attribute__((weak));
+extern "C" void USART0_UDRE_vect(void) __attribute__((weak));
+
+#define HOST_REG8(name) volatile uint8_t name;
+#define HOST_PORT(p) HOST_REG8(PIN##p) HOST_REG8(PORT##p) HOST_REG8(DDR##p)
+HOST_PORT(A) HOST_PORT(B) HOST_PORT(C) HOST_PORT(D) HOST_PORT(E) HOST_PORT(F)
+HOST_PORT(G) HOST_PORT(H) HOST_PORT(J) HOST_PORT(K) HOST_PORT(L)
+
+HOST_REG8(MCUSR)
+HOST_REG8(TCCR0A) HOST_REG8(TCCR0B) HOST_REG8(TIMSK0) HOST_REG8(OCR0A) HOST_REG8(OCR0B)
+HOST_REG8(TCNT0) HOST_REG8(TIFR0)
+HOST_REG8(TCCR1A) HOST_REG8(TCCR1B) HOST_REG8(TCCR1C) HOST_REG8(TIMSK1) HOST_REG8(TIFR1)
+HOST_REG8(TCCR2A) HOST_REG8(TCCR2B) HOST_REG8(OCR2A) HOST_REG8(OCR2B)
+HOST_REG8(TCCR3A) HOST_REG8(TCCR3B) HOST_REG8(TIMSK3)
+HOST_REG8(TCCR4A) HOST_REG8(TCCR4B) HOST_REG8(TIMSK4)
+HOST_REG8(TCCR5A) HOST_REG8(TCCR5B) HOST_REG8(TIMSK5)
+HOST_REG8(OCR3AL) HOST_REG8(OCR3BL) HOST_REG8(OCR3CL)
+HOST_REG8(OCR4AL) HOST_REG8(OCR4BL) HOST_REG8(OCR4CL)
+HOST_REG8(OCR5AL) HOST_REG8(OCR5BL) HOST_REG8(OCR5CL)
+HOST_REG8(ADCSRA) HOST_REG8(ADCSRB) HOST_REG8(ADMUX) HOST_REG8(DIDR0) HOST_REG8(DIDR2)
+HOST_REG8(UCSR0B) HOST_REG8(UCSR0C) HOST_REG8(UBRR0H) HOST_REG8(UBRR0L)
+HOST_REG8(SPCR) HOST_REG8(SPSR)
+#undef HOST_PORT
+#undef HOST_REG8
+
+volatile uint8_t SREG = 0x80; // the Arduino core enables interrupts before setup()
+volatile uint16_t OCR1A, OCR1B, TCNT1, OCR3A, TCNT3, ADC;
+// The timer0 overflow count of wiring.c, which millis() and micros() start from on the AVR
+volatile unsigned long timer0_overflow_count;
+
+host_ucsra UCSR0A;
+host_udr UDR0;
+host_spdr SPDR;
+
+// freeMemory() and SdFatUtil::FreeRam() reference the avr-libc heap symbols
+extern "C" {
+  unsigned int __bss_end;
+  unsigned int __heap_start;
+  void *__brkval;
+}
+
+host_ticks_t host_now;
+
+unsigned long host_stepper_isr_count;
+unsigned long host_rx_isr_count;
+unsigned long host_timer3_isr_count;
+unsigned long host_udre_isr_count;
+unsigned long host_rx_overruns;
+uint64_t host_isr_wall_ns;
+host_ticks_t host_tx_wait_ticks;
+bool host_serial_xoff;
+unsigned long host_xoff_count;
+
+void (*host_before_stepper_isr)();
+void (*host_after_stepper_isr)();
+void (*host_on_advance)(host_ticks_t from, host_ticks_t to);
+void (*host_on_serial_line)(const char *line, host_ticks_t done);
+uint8_t (*host_spi_transfer)(uint8_t out);
+
+static host_ticks_t timer1_last_match;   // TCNT1 was cleared here
+static bool timer1_flag;                 // OCF1A, compare match pending
+static host_ticks_t timer3_last_match;
+static bool timer3_flag;
+static bool in_stepper_isr, in_rx_isr, in_timer3_isr, in_udre_isr;
+
+struct rx_byte { host_ticks_t at; uint8_t c; };
+static std::deque<rx_byte> rx_line;      // bytes on their way to the MCU
+static host_ticks_t rx_line_free;        // end of the last queued frame
+static std::deque<uint8_t> rx_held;      // held back by the host after an XOFF
+static uint8_t rx_data;
+static bool rx_full;                     // RXC0
+static bool rx_dor;                      // DOR0, a byte arrived while rx_full
+static uint8_t ucsr0a_u2x;
+
+static host_ticks_t tx_done;             // end of the last transmitted frame
+static char tx_text[256];
+static int tx_len;
+
+// Time the data register frees up: at most one frame left in the shifter
+static host_ticks_t udre_at()
+{
+  host_ticks_t frame = host_serial_byte_ticks();
+  return tx_done > frame ? tx_done - frame : 0;
+}
+
+static bool udre_enabled()
+{
+  return USART0_UDRE_vect && (UCSR0B & (1 << UDRIE0));
+}
+
+static uint8_t spi_reply = 0xff;
+static uint8_t eeprom[E2END + 1];
+static bool eeprom_ready;
+
+uint64_t host_wall_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//===========================================================================
+// Event scheduling
+//===========================================================================
+
+static bool timer1_running()
+{
+  return (TCCR1B & (0x07 << CS10)) != 0;
+}
+
+// Next compare match; follows OCR1A writes made since the last match.
+static host_ticks_t timer1_next_match()
+{
+  return timer1_last_match + (host_ticks_t)OCR1A + 1;
+}
+
+static bool timer3_running()
+{
+  return TIMER3_COMPA_vect && (TCCR3B & (0x07 << CS30)) != 0;
+}
+
+static host_ticks_t timer3_next_match()
+{
+  return timer3_last_match + (host_ticks_t)OCR3A + 1;
+}
+
+static void run_stepper_isr()
+{
+  timer1_flag = false;
+  in_stepper_isr = true;
+  uint8_t sreg = SREG;
+  SREG &= ~0x80;
+  if(host_before_stepper_isr) host_before_stepper_isr();
+  uint64_t t0 = host_wall_ns();
+  TIMER1_COMPA_vect();
+  host_isr_wall_ns += host_wall_ns() - t0;
+  host_stepper_isr_count++;
+  if(host_after_stepper_isr) host_after_stepper_isr();
+  SREG = sreg;
+  in_stepper_isr = false;
+}
+
+static void run_rx_isr()
+{
+  in_rx_isr = true;
+  uint8_t sreg = SREG;
+  SREG &= ~0x80;
+  uint64_t t0 = host_wall_ns();
+  USART0_RX_vect();
+  host_isr_wall_ns += host_wall_ns() - t0;
+  host_rx_isr_count++;
+  SREG = sreg;
+  in_rx_isr = false;
+}
+
+static void run_udre_isr()
+{
+  in_udre_isr = true;
+  uint8_t sreg = SREG;
+  SREG &= ~0x80;
+  uint64_t t0 = host_wall_ns();
+  USART0_UDRE_vect();
+  host_isr_wall_ns += host_wall_ns() - t0;
+  host_udre_isr_count++;
+  SREG = sreg;
+  in_udre_isr = false;
+}
+
+static void run_timer3_isr()
+{
+  timer3_flag = false;
+  in_timer3_isr = true;
+  uint8_t sreg = SREG;
+  SREG &= ~0x80;
+  uint64_t t0 = host_wall_ns();
+  TIMER3_COMPA_vect();
+  host_isr_wall_ns += host_wall_ns() - t0;
+  host_timer3_isr_count++;
+  SREG = sreg;
+  in_timer3_isr = false;
+}
+
+// Fire every enabled interrupt whose flag is set, in the priority order of
+// the vectors. Returns true if any ran.
+static bool dispatch_pending()
+{
+  if(!(SREG & 0x80))
+    return false;
+  if(timer1_flag && (TIMSK1 & (1 << OCIE1A)) && !in_stepper_isr) {
+    run_stepper_isr();
+    return true;
+  }
+  if(rx_full && (UCSR0B & (1 << RXCIE0)) && !in_rx_isr) {
+    run_rx_isr();
+    return true;
+  }
+  if(udre_enabled() && udre_at() <= host_now && !in_udre_isr) {
+    run_udre_isr();
+    return true;
+  }
+  if(timer3_flag && (TIMSK3 & (1 << OCIE3A)) && !in_timer3_isr) {
+    run_timer3_isr();
+    return true;
+  }
+  return false;
+}
+
+static void move_clock(host_ticks_t t)
+{
+  if(t <= host_now)
+    return;
+  if(host_on_advance) host_on_advance(host_now, t);
+  host_now = t;
+  // Timer0 counts F_CPU/64 and its overflow interrupt is never late, so TOV0 stays clear
+  host_ticks_t timer0 = host_now / 8;
+  TCNT0 = (uint8_t)timer0;
+  timer0_overflow_count = (unsigned long)(timer0 >> 8);
+}
+
+// Process all events up to and including time `until`.
+static void run_until(host_ticks_t until)
+{
+  for(;;) {
+    while(dispatch_pending())
+      ;
+    host_ticks_t next = until + 1;
+    if(timer1_running() && timer1_next_match() < next)
+      next = timer1_next_match();
+    if(timer3_running() && timer3_next_match() < next)
+      next = timer3_next_match();
+    if(!rx_line.empty() && rx_line.front().at < next)
+      next = rx_line.front().at;
+    // A level, not an edge: only its arrival in the future is an event
+    if(udre_enabled() && udre_at() > host_now && udre_at() < next)
+      next = udre_at();
+    if(next > until)
+      break;
+    move_clock(next);
+    if(timer1_running() && timer1_next_match() <= host_now) {
+      timer1_last_match = timer1_next_match();
+      timer1_flag = true;
+    }
+    if(timer3_running() && timer3_next_match() <= host_now) {
+      // A compare value lowered below the count matches right away
+      timer3_last_match = host_now;
+      timer3_flag = true;
+    }
+    while(!rx_line.empty() && rx_line.front().at <= host_now) {
+      if(rx_full) {
+        host_rx_overruns++;
+        rx_dor = true;
+      }
+      else {
+        rx_data = rx_line.front().c;
+        rx_full = true;
+      }
+      rx_line.pop_front();
+    }
+  }
+  move_clock(until);
+}
+
+void host_advance(host_ticks_t ticks)
+{
+  run_until(host_now + ticks);
+}
+
+void host_idle()
+{
+  host_ticks_t next = host_now + HOST_TICKS_PER_MS;
+  if(timer1_running() && timer1_next_match() < next)
+    next = timer1_next_match();
+  if(timer3_running() && timer3_next_match() < next)
+    next = timer3_next_match();
+  if(!rx_line.empty() && rx_line.front().at < next)
+    next = rx_line.front().at;
+  if(udre_enabled() && udre_at() < next)
+    next = udre_at();
+  run_until(next > host_now ? next : host_now);
+}
+
+void host_sei()
+{
+  SREG |= 0x80;
+  run_until(host_now);
+}
+
+//===========================================================================
+// USART0
+//===========================================================================
+
+// One frame (start, 8 data, stop) in timer ticks, from the baud rate
+// register the way MarlinSerial::begin() programmed it.
+host_ticks_t host_serial_byte_ticks()
+{
+  host_ticks_t ubrr = ((host_ticks_t)UBRR0H << 8 | UBRR0L) + 1;
+  return 10 * ubrr * (ucsr0a_u2x ? 1 : 2);
+}
+
+// Frames the host still sends after an XOFF has arrived (USB adapter FIFO)
+#define HOST_XOFF_LATENCY 16
+
+void host_serial_send(const char *data, size_t length, host_ticks_t at)
+{
+  if(host_serial_xoff) {
+    rx_held.insert(rx_held.end(), data, data + length);
+    return;
+  }
+  host_ticks_t t = at > rx_line_free ? at : rx_line_free;
+  if(t < host_now)
+    t = host_now;
+  for(size_t i = 0; i < length; i++) {
+    t += host_serial_byte_ticks();
+    rx_byte b = { t, (uint8_t)data[i] };
+    rx_line.push_back(b);
+  }
+  rx_line_free = t;
+}
+
+void host_serial_send(const char *line, host_ticks_t at)
+{
+  host_serial_send(line, strlen(line), at);
+}
+
+size_t host_serial_queued()
+{
+  return rx_line.size() + rx_held.size();
+}
+
+// The host stops sending shortly after an XOFF and resumes with what it held
+// back on XON.
+static void serial_flow_control(bool xoff)
+{
+  if(xoff == host_serial_xoff)
+    return;
+  host_serial_xoff = xoff;
+  if(xoff) {
+    host_xoff_count++;
+    host_ticks_t cutoff = tx_done + HOST_XOFF_LATENCY * host_serial_byte_ticks();
+    while(!rx_line.empty() && rx_line.back().at > cutoff) {
+      rx_held.push_front(rx_line.back().c);
+      rx_line.pop_back();
+    }
+    if(rx_line_free > cutoff)
+      rx_line_free = cutoff;
+  }
+  else {
+    host_ticks_t t = tx_done > rx_line_free ? tx_done : rx_line_free;
+    for(; !rx_held.empty(); rx_held.pop_front()) {
+      t += host_serial_byte_ticks();
+      rx_byte b = { t, rx_held.front() };
+      rx_line.push_back(b);
+    }
+    rx_line_free = t;
+  }
+}
+
+host_ucsra::operator uint8_t() const
+{
+  // The data register is free once at most one frame is left in the shifter.
+  // Each poll of a busy transmitter costs a tick, so busy-wait loops on UDRE
+  // spend simulated time until it frees up. A poll is also where pending
+  // interrupts get their turn, like between any two instructions.
+  bool udre = udre_at() <= host_now;
+  if(!udre) {
+    host_tx_wait_ticks++;
+    host_advance(1);
+  }
+  else
+    run_until(host_now);
+  return (rx_full ? (1 << RXC0) : 0) | (udre ? (1 << UDRE0) : 0) | (rx_dor ? (1 << DOR0) : 0) |
+    (ucsr0a_u2x ? (1 << U2X0) : 0);
+}
+
+host_ucsra &host_ucsra::operator=(uint8_t v)
+{
+  ucsr0a_u2x = v & (1 << U2X0);
+  return *this;
+}
+
+host_udr::operator uint8_t() const
+{
+  rx_full = false;
+  rx_dor = false;
+  return rx_data;
+}
+
+host_udr &host_udr::operator=(uint8_t c)
+{
+  tx_done = (tx_done > host_now ? tx_done : host_now) + host_serial_byte_ticks();
+  if(c == 0x13 || c == 0x11) // XOFF, XON
+    serial_flow_control(c == 0x13);
+  else if(c == '\n' || tx_len == (int)sizeof(tx_text) - 1) {
+    tx_text[tx_len] = 0;
+    tx_len = 0;
+    if(host_on_serial_line) host_on_serial_line(tx_text, tx_done);
+  }
+  else if(c != '\r')
+    tx_text[tx_len++] = c;
+  return *this;
+}
+
+//===========================================================================
+// SPI
+//===========================================================================
+
+host_spdr::operator uint8_t() const
+{
+  return spi_reply;
+}
+
+// A byte takes 8 SCK periods, i.e. as many timer ticks as the clock divider.
+host_spdr &host_spdr::operator=(uint8_t c)
+{
+  static const uint8_t divider[4] = { 4, 16, 64, 128 };
+  host_ticks_t ticks = divider[SPCR & 0x03];
+  if(SPSR & (1 << SPI2X))
+    ticks /= 2;
+  spi_reply = host_spi_transfer ? host_spi_transfer(c) : 0xff;
+  host_advance(ticks);
+  SPSR |= (1 << SPIF);
+  return *this;
+}
+
+//===========================================================================
+// EEPROM
+//===========================================================================
+
+uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+  if(!eeprom_ready) {
+    memset(eeprom, 0xff, sizeof(eeprom));
+    eeprom_ready = true;
+  }
+  return eeprom[(uintptr_t)addr & E2END];
+}
+
+void eeprom_write_byte(uint8_t *addr, uint8_t value)
+{
+  eeprom_read_byte(addr);
+  eeprom[(uintptr_t)addr & E2END] = value;
+}
+
+//===========================================================================
+// Arduino core
+//===========================================================================
+
+unsigned long millis(void)
+{
+  return host_now / HOST_TICKS_PER_MS;
+}
+
+unsigned long micros(void)
+{
+  return host_now * 1000 / HOST_TICKS_PER_MS;
+}
+
+void delay(unsigned long ms)
+{
+  host_advance((host_ticks_t)ms * HOST_TICKS_PER_MS);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  host_advance((host_ticks_t)us * HOST_TICKS_PER_MS / 1000);
+}
+
+// Cycle counter of ISR_PROFILER: host time in cycles of the simulated part
+unsigned short isr_profiler_clock()
+{
+  return (unsigned short)(host_wall_ns() * (F_CPU / 1000000) / 1000);
+}
+
+void host_delay_us(double us)
+{
+  host_advance((host_ticks_t)(us * HOST_TICKS_PER_MS / 1000));
+}
+
+static uint8_t pin_level[256];
+
+void pinMode(uint8_t, uint8_t) {}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+  pin_level[pin] = val;
+}
+
+int digitalRead(uint8_t pin)
+{
+  return pin_level[pin];
+}
+
+int analogRead(uint8_t)
+{
+  return 0;
+}
+
+void analogWrite(uint8_t pin, int val)
+{
+  pin_level[pin] = val ? HIGH : LOW;
+}
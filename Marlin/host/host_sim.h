@@ -0,0 +1,77 @@
+/*
+  host_sim.h - simulated clock and peripherals of the host build
+
+  All simulated time is counted in timer1 ticks (F_CPU/8, 0.5us at 16MHz),
+  the unit the stepper ISR already uses for OCR1A.  Firmware code never
+  advances the clock itself; it advances when the main context waits
+  (manage_heater(), delay(), busy USART/SPI registers) and interrupts fire
+  in time order while it does.
+*/
+#ifndef HOST_SIM_H
+#define HOST_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HOST_TICKS_PER_SECOND (F_CPU/8)
+#define HOST_TICKS_PER_MS (HOST_TICKS_PER_SECOND/1000)
+
+typedef uint64_t host_ticks_t;
+
+extern host_ticks_t host_now;
+
+// Spend the given time in the main context, firing interrupts that fall due.
+void host_advance(host_ticks_t ticks);
+// Wait in the main context until the next interrupt or serial byte.
+void host_idle();
+
+// Interrupt statistics
+extern unsigned long host_stepper_isr_count;
+extern unsigned long host_rx_isr_count;
+extern unsigned long host_timer3_isr_count;
+extern unsigned long host_udre_isr_count;
+extern unsigned long host_rx_overruns;
+extern uint64_t host_isr_wall_ns;   // host time spent inside ISR bodies
+extern host_ticks_t host_tx_wait_ticks; // main context polling a busy transmitter
+
+// Optional hooks of the replay driver
+extern void (*host_before_stepper_isr)();
+extern void (*host_after_stepper_isr)();
+extern void (*host_on_advance)(host_ticks_t from, host_ticks_t to);
+// Called for every complete line the firmware prints, with the time its
+// last byte leaves the USART.
+extern void (*host_on_serial_line)(const char *line, host_ticks_t done);
+// Byte exchanged on SPI; the default is an empty socket (always 0xFF).
+extern uint8_t (*host_spi_transfer)(uint8_t out);
+
+// Queue a line for the firmware; its bytes arrive at the configured baud
+// rate, back to back with anything already queued, not before `at`.
+void host_serial_send(const char *line, host_ticks_t at);
+// The same for binary data, which may contain zero bytes
+void host_serial_send(const char *data, size_t length, host_ticks_t at);
+host_ticks_t host_serial_byte_ticks();
+// Bytes queued that have not reached the MCU yet
+size_t host_serial_queued();
+// Software flow control: set while the firmware's last XON/XOFF was XOFF.
+// Lines sent meanwhile wait on the host side.
+extern bool host_serial_xoff;
+extern unsigned long host_xoff_count;
+
+// SD card in the SPI socket, backed by an image of the whole card (host_sd.cpp)
+bool host_sd_open(const char *path);
+extern unsigned long host_sd_read_access_us;  // read command to first data token
+extern unsigned long host_sd_next_block_us;   // between blocks of a multiple block read
+extern unsigned long host_sd_write_busy_us;   // programming a block written
+typedef struct {
+  unsigned long commands;
+  unsigned long single_reads;   // CMD17
+  unsigned long multiple_reads; // CMD18
+  unsigned long read_stops;     // CMD12
+  unsigned long blocks_read;
+  unsigned long blocks_written;
+} host_sd_stats_t;
+extern host_sd_stats_t host_sd_stats;
+
+uint64_t host_wall_ns();
+
+#endif
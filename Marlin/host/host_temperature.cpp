@@ -0,0 +1,82 @@
+/*
+  host_temperature.cpp - heater stand-in for the host build
+
+  The heaters follow their targets instantly, so M109/M190 only wait for
+  the residency time, and manage_heater() is where the main loop hands
+  the simulated clock over to the interrupts.
+*/
+#include "Marlin.h"
+#include "temperature.h"
+#include "host_sim.h"
+
+int target_temperature[EXTRUDERS] = { 0 };
+int target_temperature_bed = 0;
+float current_temperature[EXTRUDERS] = { 0 };
+float current_temperature_bed = 0;
+
+#if EXTRUDERS > 2
+# define ARRAY_BY_EXTRUDERS(v1, v2, v3) { v1, v2, v3 }
+#elif EXTRUDERS > 1
+# define ARRAY_BY_EXTRUDERS(v1, v2, v3) { v1, v2 }
+#else
+# define ARRAY_BY_EXTRUDERS(v1, v2, v3) { v1 }
+#endif
+
+#ifdef PER_EXTRUDER_FANS
+int fan_pin[EXTRUDERS] = ARRAY_BY_EXTRUDERS(FAN0_PIN, FAN1_PIN, FAN2_PIN);
+#endif
+
+#ifdef PIDTEMP
+  float Kp=DEFAULT_Kp;
+  float Ki=(DEFAULT_Ki*PID_dT);
+  float Kd=(DEFAULT_Kd/PID_dT);
+  #ifdef PID_ADD_EXTRUSION_RATE
+    float Kc=DEFAULT_Kc;
+  #endif
+  #ifdef PID_FUNCTIONAL_RANGE
+    float Kr=PID_FUNCTIONAL_RANGE;
+  #endif
+#endif //PIDTEMP
+
+#ifdef PIDTEMPBED
+  float bedKp=DEFAULT_bedKp;
+  float bedKi=(DEFAULT_bedKi*PID_dT);
+  float bedKd=(DEFAULT_bedKd/PID_dT);
+#endif //PIDTEMPBED
+
+void tp_init()
+{
+}
+
+void manage_heater()
+{
+  for(int e = 0; e < EXTRUDERS; e++)
+    current_temperature[e] = target_temperature[e];
+  current_temperature_bed = target_temperature_bed;
+  host_idle();
+}
+
+int getHeaterPower(int)
+{
+  return 0;
+}
+
+void disable_heater()
+{
+  for(int e = 0; e < EXTRUDERS; e++)
+    setTargetHotend(0, e);
+  setTargetBed(0);
+}
+
+void setWatch()
+{
+}
+
+void updatePID()
+{
+}
+
+void PID_autotune(float, int, int)
+{
+  SERIAL_ECHOLNPGM("PID Autotune is not simulated");
+}
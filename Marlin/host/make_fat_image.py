@@ -0,0 +1,135 @@
+#!/usr/bin/env python
+
+""" Build an SD card image (MBR, one FAT32 partition) holding the given files.
+
+For marlin_replay -s: the files go to the root directory under their 8.3
+names (upper case), e.g. FINE.GCO for fine.gcode. The image is sparse,
+only the FATs, the directory and the files take disk space.
+
+With -f N every N clusters of a file are followed by a free cluster, so a
+read crosses a discontinuity at every N-th cluster boundary.
+"""
+
+from __future__ import print_function
+
+import argparse
+import os
+import struct
+import sys
+
+SECTOR = 512
+PARTITION_START = 2048
+RESERVED = 32
+MIN_FAT32_CLUSTERS = 65525
+
+def short_name(path):
+    base = os.path.basename(path).upper()
+    name, _, ext = base.partition('.')
+    name = ''.join(c for c in name if c.isalnum() or c in '_-~')[:8]
+    ext = ''.join(c for c in ext if c.isalnum())[:3]
+    return name, ext, '%-8s%-3s' % (name, ext)
+
+def layout(total_sectors, spc):
+    """ FAT size in sectors and cluster count of the partition """
+    sectors = total_sectors - PARTITION_START
+    fat = 1
+    while True:
+        clusters = (sectors - RESERVED - 2 * fat) // spc
+        need = ((clusters + 2) * 4 + SECTOR - 1) // SECTOR
+        if need <= fat:
+            return fat, clusters
+        fat = need
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-o', '--output', required=True, help='image file to write')
+    parser.add_argument('-c', '--cluster-kb', type=int, default=32, help='cluster size in KB (default 32)')
+    parser.add_argument('-s', '--size-mb', type=int, help='card size in MB (default: smallest FAT32 volume)')
+    parser.add_argument('-f', '--fragment', type=int, default=0, help='free cluster after every N clusters of a file')
+    parser.add_argument('files', nargs='+')
+    args = parser.parse_args()
+
+    spc = args.cluster_kb * 1024 // SECTOR
+    if spc < 1 or spc > 128 or spc & (spc - 1):
+        parser.error('cluster size must be a power of 2 from 1 to 64 KB')
+    cluster_bytes = spc * SECTOR
+    if args.size_mb:
+        total = args.size_mb * 2048
+    else:
+        total = PARTITION_START + RESERVED + (MIN_FAT32_CLUSTERS + 64) * spc + 2 * ((MIN_FAT32_CLUSTERS + 66) * 4 // SECTOR + 1)
+    fat_sectors, clusters = layout(total, spc)
+    if clusters < MIN_FAT32_CLUSTERS:
+        parser.error('%d clusters is too small for FAT32, the card needs at least %d MB' %
+                     (clusters, (MIN_FAT32_CLUSTERS * cluster_bytes) >> 20))
+    data_start = PARTITION_START + RESERVED + 2 * fat_sectors
+
+    fat = [0x0FFFFFF8, 0x0FFFFFFF, 0x0FFFFFFF]  # media, reserved, root directory
+    entries = []
+    contents = []
+    for path in args.files:
+        with open(path, 'rb') as f:
+            data = f.read()
+        chain = []
+        needed = (len(data) + cluster_bytes - 1) // cluster_bytes
+        while len(chain) < needed:
+            chain.append(len(fat))
+            fat.append(0)
+            if args.fragment and len(chain) % args.fragment == 0 and len(chain) < needed:
+                fat.append(0)  # left free
+        for a, b in zip(chain, chain[1:]):
+            fat[a] = b
+        if chain:
+            fat[chain[-1]] = 0x0FFFFFFF
+        if len(fat) > clusters + 2:
+            sys.exit('the files don\'t fit, use a bigger -s')
+        name, ext, raw = short_name(path)
+        first = chain[0] if chain else 0
+        entries.append(struct.pack('<11sBBBHHHHHHHI', raw.encode('ascii'), 0x20, 0, 0, 0, 0x21, 0x21,
+                                   first >> 16, 0, 0x21, first & 0xFFFF, len(data)))
+        contents.append((chain, data))
+        print('%s -> %s.%s, %d clusters' % (path, name, ext, len(chain)), file=sys.stderr)
+    if len(entries) * 32 > cluster_bytes:
+        sys.exit('too many files for one directory cluster')
+
+    with open(args.output, 'wb') as img:
+        img.truncate(total * SECTOR)
+
+        def write(sector, data):
+            img.seek(sector * SECTOR)
+            img.write(data)
+
+        mbr = bytearray(SECTOR)
+        mbr[446:462] = struct.pack('<B3sB3sII', 0, b'\xfe\xff\xff', 0x0C, b'\xfe\xff\xff',
+                                   PARTITION_START, total - PARTITION_START)
+        mbr[510:512] = b'\x55\xaa'
+        write(0, mbr)
+
+        boot = bytearray(SECTOR)
+        boot[0:90] = struct.pack('<3s8sHBHBHHBHHHIIIHHIHH12sBBBI11s8s',
+                                 b'\xeb\x58\x90', b'MSWIN4.1', SECTOR, spc, RESERVED, 2, 0, 0, 0xF8, 0,
+                                 63, 255, PARTITION_START, total - PARTITION_START, fat_sectors, 0, 0, 2, 1, 6,
+                                 b'\0' * 12, 0x80, 0, 0x29, 0x12345678, b'MARLIN     ', b'FAT32   ')
+        boot[510:512] = b'\x55\xaa'
+        write(PARTITION_START, boot)
+        write(PARTITION_START + 6, boot)
+
+        fsinfo = bytearray(SECTOR)
+        fsinfo[0:4] = struct.pack('<I', 0x41615252)
+        fsinfo[484:496] = struct.pack('<III', 0x61417272, 0xFFFFFFFF, 0xFFFFFFFF)
+        fsinfo[508:512] = struct.pack('<I', 0xAA550000)
+        write(PARTITION_START + 1, fsinfo)
+
+        table = struct.pack('<%dI' % len(fat), *fat)
+        for copy in range(2):
+            write(PARTITION_START + RESERVED + copy * fat_sectors, table)
+
+        def cluster_sector(cluster):
+            return data_start + (cluster - 2) * spc
+
+        write(cluster_sector(2), b''.join(entries))
+        for chain, data in contents:
+            for i, cluster in enumerate(chain):
+                write(cluster_sector(cluster), data[i * cluster_bytes:(i + 1) * cluster_bytes])
+
+if __name__ == '__main__':
+    main()
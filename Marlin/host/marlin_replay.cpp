@@ -0,0 +1,676 @@
+/*
+  marlin_replay.cpp - G-code replay benchmark for the host build
+
+  Streams a G-code file into the firmware over the simulated serial line the
+  way a host program does (one line, wait for "ok", next line) and runs
+  setup()/loop() and the stepper ISR against the simulated clock.  Reports
+  the host time spent planning each block, stepper interrupts per step
+  event, planner buffer occupancy over the print, the time the main loop
+  spent waiting on the serial transmitter and the predicted print time
+  next to the motion time the planner expected (M78).  Every block the stepper picks up is also checked against the
+  single precision float trapezoid the planner used to compute, and every
+  number of the G-code against strtod().  Built with
+  ISR_PROFILER (make host HOST_DEFINES=ISR_PROFILER) it also dumps the
+  interrupt cycle counts, taken in host time.
+
+  usage: marlin_replay [-n] [-v] [-x] [-a] [-B] [-s card.img [-S FILE.GCO | -R FILE.GCO [-w us]]] [-o occupancy.csv] [-i ms] [file.gcode|-]
+         marlin_replay -T blocks.txt
+    -n  send line numbers and checksums
+    -v  echo the firmware output
+    -x  stream the lines without waiting for "ok", relying on XON/XOFF
+        (SERIAL_XON_XOFF); no resends, so best without -n
+    -a  keep as many lines in flight as the "ok"s report free command
+        buffer slots (ADVANCED_OK); no resends either
+    -B  the file is the output of host/binary_stream.py: M580, then move
+        packets, one sent per "ok" (BINARY_PROTOCOL)
+    -s  put this card image (host/make_fat_image.py) in the SD socket
+    -S  print this file from the card (M23, M24) instead of sending one;
+        the name goes out in lower case, M23 would take the G of TT.GCO
+        for a G-code
+    -R  only read this file from the card, a byte at a time with get() as
+        the SD printing does, and report the rate and the longest get()
+    -w  time the firmware waits on a full planner after each line of -R,
+        in simulated us (default 0, the file is read back to back)
+    -o  write the planner buffer occupancy as CSV (time_ms,blocks)
+    -i  sampling interval of the CSV in simulated ms (default 100)
+    -T  only compute the trapezoids of the blocks listed in this file
+        (host/trapezoid_blocks.txt, make host-test) and exit with 3 if any
+        is off by more than one step from float
+*/
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "Marlin.h"
+#include "planner.h"
+#include "stepper.h"
+#include "temperature.h"
+#include "ultralcd.h"
+#include "language.h"
+#include "cardreader.h"
+#include "isr_profiler.h"
+#include "host_sim.h"
+
+void setup();
+void loop();
+void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exit_factor);
+
+// Time given to the firmware to boot and give up on the SD autostart
+// before the first line is sent.
+#define REPLAY_WARMUP_MS 6000
+// Give up when no "ok" arrives for this long.
+#define REPLAY_STALL_MS (10UL*60*1000)
+// Bytes the host keeps queued when streaming (-x), its serial driver buffer
+#define REPLAY_STREAM_WINDOW 512
+
+static std::vector<std::string> lines;
+static size_t next_line;
+static bool line_numbers, verbose, streaming, advanced_ok, binary;
+static size_t binary_first, binary_end; // lines[] that are packets, not text
+static const char *sd_file;             // printed from the card
+static bool sd_done;
+static const char *card_image;
+static size_t lines_acked;
+static bool printing, finished;
+static host_ticks_t print_start, print_end, last_ok;
+static unsigned long serial_errors;
+
+static unsigned long blocks_planned;
+static uint64_t plan_ns, plan_ns_max;
+
+static unsigned long active_isrs;
+static unsigned long blocks_done;
+static unsigned long underruns;
+static uint64_t step_events;
+static unsigned char isr_tail;
+static bool isr_busy, isr_tail_busy;
+
+static unsigned long trapezoids_checked, trapezoids_off_by_one, trapezoids_off;
+static unsigned long numbers_checked, numbers_off;
+
+static host_ticks_t occupancy_ticks[BLOCK_BUFFER_SIZE];
+static host_ticks_t motion_ticks;
+static FILE *csv;
+static host_ticks_t csv_interval = 100 * HOST_TICKS_PER_MS, csv_next;
+
+//===========================================================================
+// Planner timing
+//===========================================================================
+
+// planner.cpp is compiled with plan_buffer_line renamed to this (see the
+// Makefile), so the declaration follows planner.h. Should the two get out of
+// step, the link fails on one of the names.
+extern decltype(plan_buffer_line) host_plan_buffer_line;
+
+// The plan_buffer_line() the rest of the firmware calls. Waits for a free
+// slot the same way plan_buffer_line() does, so that only the planning work
+// itself is timed, minus any interrupt that fires meanwhile.
+void plan_buffer_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder)
+{
+  while(block_buffer_tail == ((block_buffer_head + 1) & (BLOCK_BUFFER_SIZE - 1))) {
+    manage_heater();
+    manage_inactivity();
+    lcd_update();
+  }
+  unsigned char head = block_buffer_head;
+  uint64_t isr_ns = host_isr_wall_ns;
+  uint64_t t0 = host_wall_ns();
+  host_plan_buffer_line(x, y, z, e, feed_rate, extruder);
+  uint64_t dt = host_wall_ns() - t0 - (host_isr_wall_ns - isr_ns);
+  if(head != block_buffer_head) {
+    blocks_planned++;
+    plan_ns += dt;
+    if(dt > plan_ns_max)
+      plan_ns_max = dt;
+  }
+}
+
+//===========================================================================
+// Trapezoid check
+//===========================================================================
+
+// accelerate_until and decelerate_after the way calculate_trapezoid_for_block()
+// computed them in float, from the rates the block ended up with.
+static void float_trapezoid(const block_t *block, long &accelerate_until, long &decelerate_after)
+{
+  float acceleration = block->acceleration_st;
+  float initial_rate = block->initial_rate;
+  float final_rate = block->final_rate;
+  float target_rate = block->nominal_rate;
+  long accelerate_steps = 0, decelerate_steps = 0;
+  if(acceleration != 0) {
+    accelerate_steps = ceil((target_rate*target_rate - initial_rate*initial_rate) / (2.0f*acceleration));
+    decelerate_steps = floor((target_rate*target_rate - final_rate*final_rate) / (2.0f*acceleration));
+  }
+  long plateau_steps = block->step_event_count - accelerate_steps - decelerate_steps;
+  if(plateau_steps < 0) {
+    accelerate_steps = 0;
+    if(acceleration != 0)
+      accelerate_steps = ceil((2.0f*acceleration*block->step_event_count - initial_rate*initial_rate + final_rate*final_rate) /
+        (4.0f*acceleration));
+    accelerate_steps = max(accelerate_steps, 0L);
+    accelerate_steps = min(accelerate_steps, (long)block->step_event_count);
+    plateau_steps = 0;
+  }
+  accelerate_until = accelerate_steps;
+  decelerate_after = accelerate_steps + plateau_steps;
+}
+
+static void check_trapezoid(const block_t *block)
+{
+  long accelerate_until, decelerate_after;
+  float_trapezoid(block, accelerate_until, decelerate_after);
+  long diff = max(labs(accelerate_until - block->accelerate_until), labs(decelerate_after - block->decelerate_after));
+  trapezoids_checked++;
+  if(diff == 1)
+    trapezoids_off_by_one++;
+  else if(diff > 1) {
+    trapezoids_off++;
+    if(verbose)
+      printf("trapezoid: %lu steps %lu/%lu/%lu rate %lu acc: until %ld/%ld after %ld/%ld (float/int)\n",
+        block->step_event_count, (unsigned long)block->initial_rate, (unsigned long)block->nominal_rate,
+        (unsigned long)block->final_rate, block->acceleration_st,
+        accelerate_until, block->accelerate_until, decelerate_after, block->decelerate_after);
+  }
+}
+
+// Runs calculate_trapezoid_for_block() over the blocks of a corpus file, one per
+// line: step_event_count initial_rate nominal_rate final_rate acceleration_st,
+// '#' starts a comment. Returns the exit code, 3 when a block is off by more
+// than one step.
+static int trapezoid_test(const char *name)
+{
+  FILE *f = fopen(name, "r");
+  if(!f) {
+    perror(name);
+    return 1;
+  }
+  verbose = true;
+  char line[256];
+  unsigned lineno = 0;
+  while(fgets(line, sizeof(line), f)) {
+    lineno++;
+    char *comment = strchr(line, '#');
+    if(comment)
+      *comment = 0;
+    unsigned long steps, initial_rate, nominal_rate, final_rate, acceleration;
+    int fields = sscanf(line, "%lu %lu %lu %lu %lu", &steps, &initial_rate, &nominal_rate, &final_rate, &acceleration);
+    if(fields <= 0)
+      continue;
+    if(fields != 5 || steps == 0 || nominal_rate == 0 || nominal_rate > 0xFFFF || acceleration == 0) {
+      fprintf(stderr, "%s:%u: expected steps initial_rate nominal_rate final_rate acceleration\n", name, lineno);
+      fclose(f);
+      return 1;
+    }
+    // The slot at the head is not queued, the planner fills it the same way
+    block_t *block = &block_buffer[block_buffer_head];
+    memset(block, 0, sizeof(*block));
+    block->step_event_count = steps;
+    block->nominal_rate = nominal_rate;
+    block->acceleration_st = acceleration;
+    calculate_trapezoid_for_block(block, initial_rate / (float)nominal_rate, final_rate / (float)nominal_rate);
+    check_trapezoid(block);
+  }
+  fclose(f);
+  printf("trapezoids        : %lu checked, %lu off by one step, %lu off by more (vs. float)\n",
+    trapezoids_checked, trapezoids_off_by_one, trapezoids_off);
+  return trapezoids_off ? 3 : 0;
+}
+
+//===========================================================================
+// Number check
+//===========================================================================
+
+// Numbers that take parse_float() beyond 9 digits or its power of ten table
+static const char *const edge_numbers[] = {
+  "0.0000000000", "0.0000000001234", "-0.0000000001234", "12345678901234567890",
+  "0.000000000000000000000000000000000000000000000000000000000000000000000001",
+  "1000000000000000000000000000000000000000000000000000000000000000000000000",
+  "000000000000.5", "123456789.987654321", "4294967296", "-.5", "+3.", "", "-"
+};
+
+// parse_float() against strtod() on the same digits, without an exponent
+static void check_number(const char *p)
+{
+  char digits[128];
+  size_t n = 0;
+  while(*p == ' ' || *p == '\t') p++;
+  if(*p == '-' || *p == '+') digits[n++] = *p++;
+  for(; n < sizeof(digits) - 1 && ((*p >= '0' && *p <= '9') || *p == '.'); p++)
+    digits[n++] = *p;
+  digits[n] = 0;
+  float expected = strtod(digits, NULL);
+  float value = parse_float(digits);
+  numbers_checked++;
+  if(value != expected) {
+    numbers_off++;
+    fprintf(stderr, "number: \"%s\" parsed as %.9g, strtod() %.9g\n", digits, value, expected);
+  }
+}
+
+// Every number after a letter, the way parse_command() scans a line
+static void check_numbers()
+{
+  for(size_t i = 0; i < sizeof(edge_numbers) / sizeof(edge_numbers[0]); i++)
+    check_number(edge_numbers[i]);
+  for(size_t i = 0; i < lines.size(); i++)
+    for(const char *p = lines[i].c_str(); *p; p++)
+      if(*p >= 'A' && *p <= 'Z')
+        check_number(p + 1);
+}
+
+//===========================================================================
+// Simulation hooks
+//===========================================================================
+
+static void before_stepper_isr()
+{
+  isr_tail = block_buffer_tail;
+  isr_busy = blocks_queued();
+  isr_tail_busy = isr_busy && block_buffer[isr_tail].busy;
+}
+
+static void after_stepper_isr()
+{
+  if(isr_busy)
+    active_isrs++;
+  // The trapezoid of a block is final once the stepper has picked it up
+  if(isr_busy && !isr_tail_busy && (block_buffer[isr_tail].busy || isr_tail != block_buffer_tail))
+    check_trapezoid(&block_buffer[isr_tail]);
+  if(isr_tail != block_buffer_tail) {
+    step_events += block_buffer[isr_tail].step_event_count;
+    blocks_done++;
+    // The machine stops here because the next move has not been planned in time
+    if(!blocks_queued() && printing && !finished)
+      underruns++;
+  }
+}
+
+static void on_advance(host_ticks_t from, host_ticks_t to)
+{
+  if(!printing)
+    return;
+  uint8_t queued = movesplanned();
+  occupancy_ticks[queued < BLOCK_BUFFER_SIZE ? queued : BLOCK_BUFFER_SIZE - 1] += to - from;
+  if(queued)
+    motion_ticks += to - from;
+  if(csv) {
+    for(; csv_next < to; csv_next += csv_interval)
+      if(csv_next >= from)
+        fprintf(csv, "%.1f,%d\n", (csv_next - print_start) / (double)HOST_TICKS_PER_MS, queued);
+  }
+}
+
+static void send_next(host_ticks_t at)
+{
+  if(next_line >= lines.size()) {
+    if(streaming || (sd_file && !sd_done))
+      return;
+    finished = true;
+    print_end = at;
+    return;
+  }
+  if(next_line >= binary_first && next_line < binary_end) {
+    const std::string &data = lines[next_line++];
+    host_serial_send(data.data(), data.size(), at);
+    return;
+  }
+  std::string text = lines[next_line++];
+  if(line_numbers) {
+    char prefix[16];
+    sprintf(prefix, "N%u ", (unsigned)next_line);
+    text = prefix + text;
+    uint8_t checksum = 0;
+    for(size_t i = 0; i < text.size(); i++)
+      checksum ^= text[i];
+    sprintf(prefix, "*%u", checksum);
+    text += prefix;
+  }
+  text += '\n';
+  host_serial_send(text.c_str(), at);
+}
+
+// Streaming keeps the host side queue topped up, flow control does the rest
+static void stream_lines(host_ticks_t at)
+{
+  while(next_line < lines.size() && host_serial_queued() < REPLAY_STREAM_WINDOW)
+    send_next(at);
+}
+
+static void on_serial_line(const char *line, host_ticks_t done)
+{
+  if(verbose)
+    printf("< %s\n", line);
+  // M29 is answered with MSG_FILE_SAVED instead of an "ok"
+  if(strncmp(line, MSG_OK, strlen(MSG_OK)) == 0 || strcmp(line, MSG_FILE_SAVED) == 0) {
+    last_ok = done;
+    if(printing && !finished) {
+      if(!streaming && !advanced_ok)
+        send_next(done);
+      else if(++lines_acked == lines.size()) {
+        finished = true;
+        print_end = done;
+      }
+      else if(streaming)
+        stream_lines(done);
+      else {
+        // One line more than there are free slots: the oldest one in flight frees its slot on the way
+        const char *b = strstr(line, " B");
+        size_t free_commands = b ? strtoul(b + 2, NULL, 10) : 0;
+        while(next_line < lines.size() && next_line - lines_acked <= free_commands)
+          send_next(done);
+      }
+    }
+  }
+  else if(strncmp(line, MSG_RESEND, strlen(MSG_RESEND)) == 0) {
+    unsigned long n = strtoul(line + strlen(MSG_RESEND), NULL, 10);
+    if(next_line > binary_first && next_line <= binary_end) {
+      // The sequence number of a packet is its index after M580, modulo 256
+      size_t k = next_line - 1 - binary_first;
+      next_line = binary_first + k - ((k - n) & 0xFF);
+    }
+    else
+      next_line = n - 1;
+  }
+  else if(sd_file && strncmp(line, MSG_FILE_PRINTED, strlen(MSG_FILE_PRINTED)) == 0) {
+    // Completes when the last move has been executed
+    sd_done = true;
+    lines.push_back("M400");
+    send_next(done);
+  }
+  else if(sd_file && strncmp(line, MSG_SD_OPEN_FILE_FAIL, strlen(MSG_SD_OPEN_FILE_FAIL)) == 0) {
+    fprintf(stderr, "%s\n", line);
+    exit(1);
+  }
+  else if(strncmp(line, "Error:", 6) == 0) {
+    serial_errors++;
+    fprintf(stderr, "line %u: %s\n", (unsigned)next_line, line);
+    if(strstr(line, MSG_ERR_KILLED)) {
+      fprintf(stderr, "firmware killed at %.3f s\n", host_now / (double)HOST_TICKS_PER_SECOND);
+      exit(2);
+    }
+  }
+}
+
+//===========================================================================
+// Replay
+//===========================================================================
+
+static void read_gcode(FILE *f)
+{
+  char buf[512];
+  while(fgets(buf, sizeof(buf), f)) {
+    char *c = strchr(buf, ';');
+    if(c) *c = 0;
+    char *start = buf;
+    while(*start == ' ' || *start == '\t') start++;
+    char *end = start + strlen(start);
+    while(end > start && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) end--;
+    *end = 0;
+    if(*start)
+      lines.push_back(start);
+  }
+  // Completes when the last move has been executed
+  lines.push_back("M400");
+}
+
+// M580, the packets and a text M400 after the EXIT packet
+static void read_binary(FILE *f)
+{
+  std::string data;
+  char buf[4096];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    data.append(buf, n);
+  size_t pos = data.find('\n');
+  if(pos == std::string::npos) {
+    fprintf(stderr, "no M580 line\n");
+    exit(1);
+  }
+  lines.push_back(data.substr(0, pos));
+  binary_first = lines.size();
+  for(pos++; pos + 4 <= data.size(); ) {
+    uint8_t opcode = data[pos + 1], arg = data[pos + 3];
+    size_t length = 4 + 2;
+    if(opcode == 1 || opcode == 2) {
+      for(int i = 0; i < 4; i++)
+        if(arg & (1 << i))
+          length += opcode == 1 ? 4 : 2;
+      if(arg & 0x10)
+        length += 2;
+    }
+    else if(opcode == 3)
+      length += arg;
+    lines.push_back(data.substr(pos, length));
+    pos += length;
+  }
+  binary_end = lines.size();
+  lines.push_back("M400");
+}
+
+static void print_time(const char *label, host_ticks_t ticks)
+{
+  double s = ticks / (double)HOST_TICKS_PER_SECOND;
+  int h = (int)(s / 3600);
+  int m = (int)(s / 60) % 60;
+  printf("%-18s: %d:%02d:%06.3f (%.3f s)\n", label, h, m, s - h * 3600 - m * 60, s);
+}
+
+// -R: the file read the way get_command() does, with `wait` after each line spent
+// in manage_inactivity() and idle, as while the planner is full
+static int read_benchmark(const char *name, host_ticks_t wait)
+{
+  char path[LONG_FILENAME_LENGTH];
+  snprintf(path, sizeof(path), "%s", name);
+  card.openFile(path, true);
+  if(!card.isFileOpen()) {
+    fprintf(stderr, "%s: not on the card\n", name);
+    return 1;
+  }
+  card.startFileprint();
+  host_sd_stats_t before = host_sd_stats;
+  host_ticks_t start = host_now, in_get = 0, longest = 0;
+  unsigned long bytes = 0, line_count = 0, waits = 0;
+  while(!card.eof()) {
+    host_ticks_t t = host_now;
+    int16_t c = card.get();
+    host_ticks_t d = host_now - t;
+    in_get += d;
+    if(c < 0) {
+      if(card.eof()) // get() has returned the last byte and noticed the end of the file with the next
+        break;
+      fprintf(stderr, "read error at byte %lu\n", bytes);
+      return 1;
+    }
+    bytes++;
+    if(d)
+      waits++;
+    if(d > longest)
+      longest = d;
+    if(c == '\n') {
+      line_count++;
+      if(wait) {
+        host_ticks_t until = host_now + wait;
+        manage_inactivity();
+        if(host_now < until)
+          host_advance(until - host_now);
+      }
+    }
+  }
+  card.pauseSDPrint();
+  host_ticks_t total = host_now - start;
+  printf("read              : %lu bytes, %lu lines\n", bytes, line_count);
+  print_time("elapsed", total);
+  print_time("in get()", in_get);
+  if(in_get)
+    printf("get() rate        : %.0f bytes/s\n", bytes * (double)HOST_TICKS_PER_SECOND / in_get);
+  printf("longest get()     : %.0f us, %lu of them waited on the card\n",
+    longest * 1e6 / HOST_TICKS_PER_SECOND, waits);
+  printf("card              : %lu commands, %lu single and %lu multiple block reads, %lu blocks\n",
+    host_sd_stats.commands - before.commands, host_sd_stats.single_reads - before.single_reads,
+    host_sd_stats.multiple_reads - before.multiple_reads, host_sd_stats.blocks_read - before.blocks_read);
+  return 0;
+}
+
+static void report()
+{
+  host_ticks_t total = print_end - print_start;
+  printf("lines             : %u\n", (unsigned)lines.size() - 1);
+  printf("serial errors     : %lu, %lu rx overruns, %lu dropped by the firmware\n", serial_errors,
+    host_rx_overruns, rx_dropped);
+  if(streaming)
+    printf("flow control      : %lu XOFF\n", host_xoff_count);
+  printf("blocks planned    : %lu\n", blocks_planned);
+  if(blocks_planned)
+    printf("planner           : %.2f us/block avg, %.2f us max (host time)\n",
+      plan_ns / 1000.0 / blocks_planned, plan_ns_max / 1000.0);
+  printf("stepper ISR       : %lu calls, %lu while moving, %llu step events\n",
+    host_stepper_isr_count, active_isrs, (unsigned long long)step_events);
+  if(step_events)
+    printf("ISR per step event: %.3f\n", active_isrs / (double)step_events);
+  if(host_timer3_isr_count)
+    printf("E timer ISR       : %lu calls\n", host_timer3_isr_count);
+  if(host_udre_isr_count)
+    printf("serial TX ISR     : %lu calls\n", host_udre_isr_count);
+  print_time("serial TX wait", host_tx_wait_ticks);
+  printf("trapezoids        : %lu checked, %lu off by one step, %lu off by more (vs. float)\n",
+    trapezoids_checked, trapezoids_off_by_one, trapezoids_off);
+  if(numbers_checked)
+    printf("numbers           : %lu checked, %lu differ from strtod()\n", numbers_checked, numbers_off);
+  if(total) {
+    double mean = 0;
+    for(int i = 0; i < BLOCK_BUFFER_SIZE; i++)
+      mean += i * (double)occupancy_ticks[i] / total;
+    printf("buffer occupancy  : %.2f of %d blocks on average\n", mean, BLOCK_BUFFER_SIZE - 1);
+    for(int i = 0; i < BLOCK_BUFFER_SIZE; i++)
+      if(occupancy_ticks[i])
+        printf("  %2d blocks       : %5.1f%%\n", i, 100.0 * occupancy_ticks[i] / total);
+  }
+  printf("underruns         : %lu (stopped with lines left to send)\n", underruns);
+  print_time("motion time", motion_ticks);
+  print_time("planned motion", lround(plan_executed_time() * HOST_TICKS_PER_SECOND));
+  print_time("print time", total);
+  if(card_image)
+    printf("card              : %lu commands, %lu single and %lu multiple block reads, %lu blocks, %lu written\n",
+      host_sd_stats.commands, host_sd_stats.single_reads, host_sd_stats.multiple_reads, host_sd_stats.blocks_read,
+      host_sd_stats.blocks_written);
+#ifdef ISR_PROFILER
+  static const char *const names[ISR_PROFILE_COUNT] = { "stepper", "temperature", "serial rx" };
+  for(int i = 0; i < ISR_PROFILE_COUNT; i++) {
+    const volatile isr_profile_t &p = isr_profile[i];
+    if(!p.calls)
+      continue;
+    printf("ISR %-13s : %lu calls, %u/%lu/%u cycles min/avg/max (host time)\n", names[i],
+      p.calls, p.min_cycles, p.cycles / p.calls, p.max_cycles);
+    printf("  histogram       :");
+    for(int b = 0; b < ISR_PROFILE_BUCKETS; b++)
+      printf(" %s%u:%lu", b < ISR_PROFILE_BUCKETS - 1 ? "<" : ">=",
+        64u << (b < ISR_PROFILE_BUCKETS - 1 ? b : b - 1), p.histogram[b]);
+    printf("\n");
+  }
+  printf("ISR missed steps  : %lu\n", isr_missed_steps);
+#endif
+}
+
+int main(int argc, char **argv)
+{
+  const char *csv_name = NULL;
+  int opt;
+  const char *read_file = NULL;
+  host_ticks_t line_wait = 0;
+  while((opt = getopt(argc, argv, "nvxaBs:S:R:w:o:i:T:")) != -1) {
+    switch(opt) {
+    case 'n': line_numbers = true; break;
+    case 'v': verbose = true; break;
+    case 'x': streaming = true; break;
+    case 'a': advanced_ok = true; break;
+    case 'B': binary = true; break;
+    case 's': card_image = optarg; break;
+    case 'S': sd_file = optarg; break;
+    case 'R': read_file = optarg; break;
+    case 'w': line_wait = strtoul(optarg, NULL, 10) * HOST_TICKS_PER_SECOND / 1000000; break;
+    case 'o': csv_name = optarg; break;
+    case 'i': csv_interval = strtoul(optarg, NULL, 10) * HOST_TICKS_PER_MS; break;
+    case 'T': return trapezoid_test(optarg);
+    default:
+      fprintf(stderr, "usage: %s [-n] [-v] [-x] [-a] [-B] [-s card.img [-S FILE.GCO | -R FILE.GCO [-w us]]] [-o occupancy.csv] [-i ms] [file.gcode|-]\n       %s -T blocks.txt\n", argv[0], argv[0]);
+      return 1;
+    }
+  }
+  if(optind != argc - (sd_file || read_file ? 0 : 1) || ((sd_file || read_file) && !card_image)) {
+    fprintf(stderr, "usage: %s [-n] [-v] [-x] [-a] [-B] [-s card.img [-S FILE.GCO | -R FILE.GCO [-w us]]] [-o occupancy.csv] [-i ms] [file.gcode|-]\n       %s -T blocks.txt\n", argv[0], argv[0]);
+    return 1;
+  }
+  if(card_image && !host_sd_open(card_image)) {
+    perror(card_image);
+    return 1;
+  }
+  if(sd_file) {
+    std::string name = sd_file;
+    for(size_t i = 0; i < name.size(); i++)
+      name[i] = tolower((unsigned char)name[i]);
+    lines.push_back("M23 " + name);
+    lines.push_back("M24");
+  }
+  else if(!read_file) {
+    FILE *f = strcmp(argv[optind], "-") ? fopen(argv[optind], binary ? "rb" : "r") : stdin;
+    if(!f) {
+      perror(argv[optind]);
+      return 1;
+    }
+    if(binary)
+      read_binary(f);
+    else {
+      read_gcode(f);
+      check_numbers();
+    }
+  }
+  if(csv_name) {
+    csv = fopen(csv_name, "w");
+    if(!csv) {
+      perror(csv_name);
+      return 1;
+    }
+    fprintf(csv, "time_ms,blocks\n");
+  }
+
+  host_before_stepper_isr = before_stepper_isr;
+  host_after_stepper_isr = after_stepper_isr;
+  host_on_advance = on_advance;
+  host_on_serial_line = on_serial_line;
+
+  setup();
+  // Files are benchmarked without their heat-up, so do not drop E moves
+  allow_cold_extrudes(true);
+  while(host_now < REPLAY_WARMUP_MS * HOST_TICKS_PER_MS)
+    loop();
+  if(read_file)
+    return read_benchmark(read_file, line_wait);
+
+  printing = true;
+  plan_reset_executed_time();
+#ifdef ISR_PROFILER
+  isr_profiler_reset();
+#endif
+  print_start = last_ok = csv_next = host_now;
+  send_next(host_now);
+  while(!finished) {
+    loop();
+    if(streaming)
+      stream_lines(host_now);
+    if(host_now > last_ok + REPLAY_STALL_MS * HOST_TICKS_PER_MS) {
+      fprintf(stderr, "no ok for line %u after %lu s, giving up\n", (unsigned)next_line, REPLAY_STALL_MS / 1000);
+      return 2;
+    }
+  }
+  printing = false;
+  if(csv)
+    fclose(csv);
+  report();
+  return 0;
+}
@@ -0,0 +1 @@
+/* pins_arduino.h - not used by the host build */
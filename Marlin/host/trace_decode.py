@@ -0,0 +1,80 @@
+#!/usr/bin/env python
+
+""" Convert Marlin ISR_TRACE records to CSV.
+
+Reads a serial log with "trace:" lines (other lines are skipped, a "< "
+prefix from marlin_replay -v is fine) or, with -b, the binary file M578 S2
+wrote to the SD card. Writes event,time_us,<arguments> rows, one per record.
+The records hold timer0 ticks (64 CPU cycles), -f gives the clock to convert
+them with.
+"""
+
+from __future__ import print_function
+
+import argparse
+import binascii
+import struct
+import sys
+
+RECORD = struct.Struct('<BIiiii')  # trace_record_t, 21 bytes
+
+# Event id -> (name, argument names), as in trace.h
+EVENTS = {
+    0: ('dropped', ['records']),
+    1: ('stepper_too_high', ['step_rate']),
+    2: ('accel_steps', ['step_events', 'accelerate_until', 'decelerate_after', 'nominal_rate']),
+    3: ('c_comp_advance', ['old_advance', 'initial_advance', 'target_advance', 'final_advance']),
+    4: ('c_comp_rate', ['advance_step_rate', 'us_per_advance_step']),
+    5: ('c_comp_steps', ['extruder', 'timer', 'timer_leftover', 'e_steps', 'advance_steps']),
+    6: ('c_comp_steps_2', ['desired_advance_steps', 'old_advance', 'advance', 'step_events_completed']),
+}
+
+def records_from_log(f):
+    for line in f:
+        pos = line.find('trace:')
+        if pos < 0:
+            continue
+        data = binascii.unhexlify(line[pos + 6:].strip())
+        if len(data) == RECORD.size:
+            yield RECORD.unpack(data)
+
+def records_from_binary(f):
+    while True:
+        data = f.read(RECORD.size)
+        if len(data) < RECORD.size:
+            break
+        yield RECORD.unpack(data)
+
+def decode(record, f_cpu):
+    event, ticks, a, b, c, d = record
+    time = ticks * 64 * 1000000 // f_cpu
+    name, arg_names = EVENTS.get(event, ('event%d' % event, ['a', 'b', 'c', 'd']))
+    args = [a, b, c, d]
+    if event == 5:  # extruder << 16 | timer
+        args = [a >> 16, a & 0xffff, b, c, d]
+    return name, time, args[:len(arg_names)], arg_names
+
+parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+parser.add_argument('-b', '--binary', action='store_true', help='input is the SD card trace file')
+parser.add_argument('-f', '--f-cpu', type=int, default=16000000, help='CPU clock in Hz (default 16000000)')
+parser.add_argument('-e', '--event', help='only output this event, the header then names its arguments')
+parser.add_argument('file', nargs='?', help='input file (default stdin)')
+args = parser.parse_args()
+
+if args.binary:
+    f = open(args.file, 'rb') if args.file else getattr(sys.stdin, 'buffer', sys.stdin)
+    records = records_from_binary(f)
+else:
+    f = open(args.file) if args.file else sys.stdin
+    records = records_from_log(f)
+
+header = ['event', 'time_us', 'a', 'b', 'c', 'd', 'e']
+for name, arg_names in EVENTS.values():
+    if name == args.event:
+        header = ['event', 'time_us'] + arg_names
+print(','.join(header))
+for record in records:
+    name, time, values, arg_names = decode(record, args.f_cpu)
+    if args.event and name != args.event:
+        continue
+    print(','.join([name, str(time)] + [str(v) for v in values]))
@@ -0,0 +1,11 @@
+/*
+  util/delay.h - busy waits of the host build, charged to the simulated clock
+*/
+#ifndef HOST_UTIL_DELAY_H
+#define HOST_UTIL_DELAY_H
+
+void host_delay_us(double us);
+#define _delay_us(us) host_delay_us(us)
+#define _delay_ms(ms) host_delay_us((ms) * 1000.0)
+
+#endif
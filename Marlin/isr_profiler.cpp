@@ -0,0 +1,84 @@
+/*
+  isr_profiler.cpp - cycle counts of the interrupt handlers
+*/
+#include "Marlin.h"
+#include "isr_profiler.h"
+
+#ifdef ISR_PROFILER
+
+#if defined(__AVR__) && !defined(__AVR_ATmega1280__) && !defined(__AVR_ATmega2560__)
+#error "ISR_PROFILER needs timer5 (ATmega1280/2560)"
+#endif
+
+volatile isr_profile_t isr_profile[ISR_PROFILE_COUNT];
+volatile unsigned long isr_missed_steps;
+
+void isr_profiler_init()
+{
+  #ifdef __AVR__
+  // Timer5 runs free at F_CPU: normal mode, outputs disconnected, no prescaler
+  TCCR5A = 0;
+  TCCR5B = (1<<CS50);
+  #endif
+  isr_profiler_reset();
+}
+
+void isr_profiler_reset()
+{
+  CRITICAL_SECTION_START;
+  for(unsigned char i = 0; i < ISR_PROFILE_COUNT; i++) {
+    volatile isr_profile_t *profile = &isr_profile[i];
+    profile->calls = 0;
+    profile->cycles = 0;
+    profile->min_cycles = 0xFFFF;
+    profile->max_cycles = 0;
+    for(unsigned char b = 0; b < ISR_PROFILE_BUCKETS; b++) {
+      profile->histogram[b] = 0;
+    }
+  }
+  isr_missed_steps = 0;
+  CRITICAL_SECTION_END;
+}
+
+// One line per interrupt:
+// ISR stepper calls:N min:N avg:N max:N cycles <64:N <128:N ... >=4096:N
+void isr_profiler_report()
+{
+  static const char names[ISR_PROFILE_COUNT][12] PROGMEM = { "stepper", "temperature", "serial rx" };
+  for(unsigned char i = 0; i < ISR_PROFILE_COUNT; i++) {
+    isr_profile_t profile;
+    CRITICAL_SECTION_START;
+    memcpy(&profile, (const void *)&isr_profile[i], sizeof(profile));
+    CRITICAL_SECTION_END;
+    SERIAL_PROTOCOLPGM("ISR ");
+    serialprintPGM(names[i]);
+    SERIAL_PROTOCOLPGM(" calls:");
+    SERIAL_PROTOCOL(profile.calls);
+    if(profile.calls != 0) {
+      SERIAL_PROTOCOLPGM(" min:");
+      SERIAL_PROTOCOL(profile.min_cycles);
+      SERIAL_PROTOCOLPGM(" avg:");
+      SERIAL_PROTOCOL(profile.cycles / profile.calls);
+      SERIAL_PROTOCOLPGM(" max:");
+      SERIAL_PROTOCOL(profile.max_cycles);
+      SERIAL_PROTOCOLPGM(" cycles");
+      for(unsigned char b = 0; b < ISR_PROFILE_BUCKETS; b++) {
+        if(b < ISR_PROFILE_BUCKETS - 1) {
+          SERIAL_PROTOCOLPGM(" <");
+          SERIAL_PROTOCOL(64U << b);
+        }
+        else {
+          SERIAL_PROTOCOLPGM(" >=");
+          SERIAL_PROTOCOL(64U << (b - 1));
+        }
+        SERIAL_PROTOCOL(':');
+        SERIAL_PROTOCOL(profile.histogram[b]);
+      }
+    }
+    SERIAL_PROTOCOLLNPGM("");
+  }
+  SERIAL_PROTOCOLPGM("ISR stepper missed:");
+  SERIAL_PROTOCOLLN(isr_missed_steps);
+}
+
+#endif // ISR_PROFILER
@@ -0,0 +1,73 @@
+/*
+  isr_profiler.h - cycle counts of the interrupt handlers
+
+  With ISR_PROFILER the stepper, temperature and serial receive interrupts
+  read a free running timer (timer5 at F_CPU) on entry and exit and keep
+  min/avg/max cycles and a histogram per interrupt. The stepper interrupt
+  also counts the times it left OCR1A behind TCNT1, i.e. missed the next
+  step. M577 prints the numbers, M577 R clears them.
+*/
+#ifndef isr_profiler_h
+#define isr_profiler_h
+
+#include "Marlin.h"
+
+#ifdef ISR_PROFILER
+
+#define ISR_PROFILE_STEPPER     0
+#define ISR_PROFILE_TEMPERATURE 1
+#define ISR_PROFILE_SERIAL_RX   2
+#define ISR_PROFILE_COUNT       3
+
+// Histogram bucket i counts the calls that took less than 64 << i cycles, the last one the rest
+#define ISR_PROFILE_BUCKETS     8
+
+typedef struct {
+  unsigned long calls;
+  unsigned long cycles;                     // Total of the calls, halved together with calls on overflow
+  unsigned short min_cycles;
+  unsigned short max_cycles;
+  unsigned long histogram[ISR_PROFILE_BUCKETS];
+} isr_profile_t;
+
+extern volatile isr_profile_t isr_profile[ISR_PROFILE_COUNT];
+extern volatile unsigned long isr_missed_steps;  // Stepper interrupt exits with TCNT1 past OCR1A
+
+#ifdef __AVR__
+  #define isr_profiler_clock() TCNT5
+#else
+  // The host build has no cycle counter, it times the bodies in host time (as cycles at F_CPU)
+  unsigned short isr_profiler_clock();
+#endif
+
+void isr_profiler_init();
+void isr_profiler_reset();
+void isr_profiler_report();
+
+FORCE_INLINE unsigned short isr_profile_start()
+{
+  return isr_profiler_clock();
+}
+
+// Called at the end of an interrupt handler (with interrupts off) with the clock read at its start
+FORCE_INLINE void isr_profile_end(unsigned char isr, unsigned short start)
+{
+  unsigned short cycles = isr_profiler_clock() - start;
+  volatile isr_profile_t *profile = &isr_profile[isr];
+  if(profile->cycles >= 0x80000000UL) { // Keeps the average
+    profile->cycles >>= 1;
+    profile->calls >>= 1;
+  }
+  profile->calls++;
+  profile->cycles += cycles;
+  if(cycles < profile->min_cycles) profile->min_cycles = cycles;
+  if(cycles > profile->max_cycles) profile->max_cycles = cycles;
+  unsigned char bucket = 0;
+  for(unsigned short limit = cycles >> 6; limit != 0 && bucket < ISR_PROFILE_BUCKETS - 1; limit >>= 1) {
+    bucket++;
+  }
+  profile->histogram[bucket]++;
+}
+
+#endif // ISR_PROFILER
+#endif
@@ -23,8 +23,10 @@
 #include "stepper.h"
 #include "planner.h"
 
+float arc_tolerance;
+
 // The arc is approximated by generating a huge number of tiny, linear segments. The length of each 
-// segment is configured in settings.mm_per_arc_segment.  
+// segment follows from arc_tolerance, the radius and, while the planner buffer runs low, the feed rate.
 void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8_t axis_1, 
   uint8_t axis_linear, float feed_rate, float radius, uint8_t isclockwise, uint8_t extruder)
 {      
@@ -46,7 +48,22 @@ void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8
   
   float millimeters_of_travel = hypot(angular_travel*radius, fabs(linear_travel));
   if (millimeters_of_travel < 0.001) { return; }
-  uint16_t segments = floor(millimeters_of_travel/MM_PER_ARC_SEGMENT);
+
+  // The longest chord that does not get further than arc_tolerance from the arc
+  float mm_per_arc_segment = millimeters_of_travel;
+  if (arc_tolerance < radius) {
+    mm_per_arc_segment = 2*sqrt(arc_tolerance*(2*radius - arc_tolerance));
+  }
+  // Segments shorter than the planner can take them empty the buffer, so while it is low they have 
+  // to last a share of minsegmenttime, the same share SLOWDOWN uses (feed_rate is in mm/sec)
+  unsigned long buffered_time = plan_buffered_time();
+  if (buffered_time < SLOWDOWN_BUFFER_TIME) {
+    float min_mm_per_arc_segment = feed_rate*(minsegmenttime/1000000.0)*
+                                   (SLOWDOWN_BUFFER_TIME - buffered_time)/SLOWDOWN_BUFFER_TIME;
+    mm_per_arc_segment = max(mm_per_arc_segment, min_mm_per_arc_segment);
+  }
+  mm_per_arc_segment = max(mm_per_arc_segment, MIN_MM_PER_ARC_SEGMENT);
+  uint16_t segments = ceil(millimeters_of_travel/mm_per_arc_segment);
   if(segments == 0) segments = 1;
   
   /*  
@@ -28,5 +28,7 @@
 // for vector transformation direction.
 void mc_arc(float *position, float *target, float *offset, unsigned char axis_0, unsigned char axis_1,
   unsigned char axis_linear, float feed_rate, float radius, unsigned char isclockwise, uint8_t extruder);
+
+extern float arc_tolerance; // mm - the furthest an arc segment may be from the arc, M205 A
   
 #endif
@@ -33,7 +33,7 @@
  Distance to reach a specific speed with a constant acceleration:
  
  Solve[{Speed[s, a, t] == m, Travel[s, a, t] == d}, d, t]
- d -> (m^2 - s^2)/(2 a) --> estimate_acceleration_distance()
+ d -> (m^2 - s^2)/(2 a) --> estimate_acceleration_steps()
  
  Speed after a given distance of travel with constant acceleration:
  
@@ -46,7 +46,7 @@
  from initial speed s1 without ever stopping at a plateau:
  
  Solve[{DestinationSpeed[s1, a, di] == DestinationSpeed[s2, a, d - di]}, di]
- di -> (2 a d - s1^2 + s2^2)/(4 a) --> intersection_distance()
+ di -> (2 a d - s1^2 + s2^2)/(4 a) --> intersection_steps()
  
  IntersectionDistance[s1_, s2_, a_, d_] := (2 a d - s1^2 + s2^2)/(4 a)
  */
@@ -74,11 +74,17 @@ float max_xy_jerk; // speed than can be stopped at once, if i understand correct
 float max_z_jerk;
 float mintravelfeedrate;
 uint8_t last_extruder;
+#ifdef JUNCTION_DEVIATION
+float junction_deviation; // mm - distance of the path from the corner at junctions, M205 J
+#endif
 
 // The current position of the tool in absolute steps
 long position[NUM_AXIS];   //rescaled from extern when axis_steps_per_unit are changed by gcode or extruder changes
 static float previous_speed[NUM_AXIS]; // Speed of previous path line segment
 static float previous_nominal_speed; // Nominal speed of previous path line segment
+#ifdef JUNCTION_DEVIATION
+static float previous_unit_vec[3]; // XYZ direction of previous path line segment, zero if it did not move XYZ
+#endif
 static unsigned long axis_steps_per_sqr_second[NUM_AXIS]; // acceleration in steps
 
 #ifdef AUTOTEMP
@@ -94,6 +100,9 @@ bool autotemp_enabled=false;
 block_t block_buffer[BLOCK_BUFFER_SIZE];            // A ring buffer for motion instfructions
 volatile unsigned char block_buffer_head;           // Index of the next block to be pushed
 volatile unsigned char block_buffer_tail;           // Index of the block to process now
+volatile unsigned long block_buffer_time;           // Time the queued blocks take in us
+volatile unsigned long executed_time;               // Time of the discarded blocks in s
+volatile unsigned long executed_time_us;            // and us
 
 //===========================================================================
 //=============================private variables ============================
@@ -109,6 +118,24 @@ static long x_segment_time[3]={MAX_FREQ_TIME + 1,0,0};     // Segment times (in
 static long y_segment_time[3]={MAX_FREQ_TIME + 1,0,0};
 #endif
 
+// Index of the newest block whose entry speed can no longer change. Blocks from
+// the tail up to it are optimally planned, so the lookahead passes stop there.
+static unsigned char block_buffer_planned;
+
+// Number of queued blocks that step each axis, counted up when a block is pushed and down when
+// retire_blocks() finds it discarded, so check_axes_activity() does not have to scan the buffer
+static unsigned char axis_blocks[NUM_AXIS];
+static unsigned char retired_tail;                 // Blocks before this index are counted out
+
+#ifdef AUTOTEMP
+// Extruder speeds (mm/sec) of the queued XYZ blocks that no later block exceeds, in buffer order.
+// The first entry is the highest extruder speed in the buffer.
+static unsigned char autotemp_block[BLOCK_BUFFER_SIZE];
+static float autotemp_e_speed[BLOCK_BUFFER_SIZE];
+static unsigned char autotemp_first;
+static unsigned char autotemp_count;
+#endif
+
 // Returns the index of the next block in the ring buffer
 // NOTE: Removed modulo (%) operator, which uses an expensive divide and multiplication.
 static int8_t next_block_index(int8_t block_index) {
@@ -133,91 +160,182 @@ static int8_t prev_block_index(int8_t block_index) {
 //=============================functions         ============================
 //===========================================================================
 
-// Calculates the distance (not time) it takes to accelerate from initial_rate to target_rate using the 
-// given acceleration:
-FORCE_INLINE float estimate_acceleration_distance(float initial_rate, float target_rate, float acceleration)
+// Step rates are at most 16 bit wide by the time the stepper uses them (see calc_timer()), so their 
+// squares always fit into 32 bits. The trapezoid generator below works on those squares in 
+// integer math only, with fixed width types so that the host build wraps around like the AVR.
+FORCE_INLINE uint32_t rate_squared(uint32_t rate) {
+  if(rate > 0xFFFF) {
+    rate = 0xFFFF;
+  }
+  return rate*rate;
+}
+
+// Integer square root, rounded down, of a squared step rate
+FORCE_INLINE uint32_t rate_sqrt(uint32_t rate_sq)
 {
-  if (acceleration!=0) {
-    return((target_rate*target_rate-initial_rate*initial_rate)/
-      (2.0*acceleration));
+  uint32_t root = 0;
+  uint32_t bit = (uint32_t)1 << 30;
+  while(bit > rate_sq) {
+    bit >>= 2;
   }
-  else {
-    return 0.0;  // acceleration was 0, set acceleration distance to 0
+  while(bit != 0) {
+    if(rate_sq >= root + bit) {
+      rate_sq -= root + bit;
+      root = (root >> 1) + bit;
+    }
+    else {
+      root >>= 1;
+    }
+    bit >>= 2;
   }
+  return root;
+}
+
+// (a * b) >> 16, rounded, from 16 bit partial products. The result has to fit into 32 bits.
+FORCE_INLINE uint32_t mul_fixed16(uint32_t a, uint32_t b)
+{
+  unsigned short a_hi = a >> 16, a_lo = a & 0xFFFF;
+  unsigned short b_hi = b >> 16, b_lo = b & 0xFFFF;
+  return (((uint32_t)a_hi * b_hi) << 16) + (uint32_t)a_hi * b_lo + (uint32_t)a_lo * b_hi +
+         (((uint32_t)a_lo * b_lo + 0x8000) >> 16);
 }
 
-// This function gives you the point at which you must start braking (at the rate of -acceleration) if 
-// you started at speed initial_rate and accelerated until this point and want to end at the final_rate after
-// a total travel of distance. This can be used to compute the intersection point between acceleration and
-// deceleration in the cases where the trapezoid has no plateau (i.e. never reaches maximum speed)
+#ifdef S_CURVE_ACCELERATION
+// Stepper timer ticks (F_CPU/8) per us, 16.16 fixed point, for mul_fixed16()
+#define TICKS_PER_US ((uint32_t)((F_CPU/8) * 65536ULL / 1000000UL))
+#endif // S_CURVE_ACCELERATION
+
+// Calculates the number of steps (not time) it takes to accelerate from initial_rate to target_rate using the 
+// given acceleration, rounded up or down. Negative if target_rate is below initial_rate.
+FORCE_INLINE int32_t estimate_acceleration_steps(uint32_t initial_rate, uint32_t target_rate, 
+                                                 uint32_t acceleration, bool round_up)
+{
+  if (acceleration == 0) {
+    return 0;  // acceleration was 0, set acceleration distance to 0
+  }
+  uint32_t twice_acceleration = acceleration << 1;
+  uint32_t initial_sq = rate_squared(initial_rate);
+  uint32_t target_sq = rate_squared(target_rate);
+  uint32_t steps;
+  if (target_sq >= initial_sq) {
+    steps = (target_sq - initial_sq) / twice_acceleration;
+    if (round_up && steps * twice_acceleration != target_sq - initial_sq) {
+      steps++;
+    }
+    return steps;
+  }
+  steps = (initial_sq - target_sq) / twice_acceleration;
+  if (!round_up && steps * twice_acceleration != initial_sq - target_sq) {
+    steps++;
+  }
+  return -(int32_t)steps;
+}
 
-FORCE_INLINE float intersection_distance(float initial_rate, float final_rate, float acceleration, float distance) 
+// This function gives you the step at which you must start braking (at the rate of -acceleration) if 
+// you started at initial_rate and accelerated until this point and want to end at the final_rate after
+// a total travel of distance steps, rounded up. This can be used to compute the intersection point between 
+// acceleration and deceleration in the cases where the trapezoid has no plateau (i.e. never reaches maximum speed)
+// 2 a d does not fit into 32 bit, so it is evaluated as d/2 + (s2^2 - s1^2)/(4 a) with the remainders 
+// of both divisions deciding the rounding.
+FORCE_INLINE int32_t intersection_steps(uint32_t initial_rate, uint32_t final_rate, 
+                                        uint32_t acceleration, uint32_t distance) 
 {
-  if (acceleration!=0) {
-    return((2.0*acceleration*distance-initial_rate*initial_rate+final_rate*final_rate)/
-      (4.0*acceleration) );
+  if (acceleration == 0) {
+    return 0;  // acceleration was 0, set intersection distance to 0
   }
+  uint32_t four_acceleration = acceleration << 2;
+  uint32_t initial_sq = rate_squared(initial_rate);
+  uint32_t final_sq = rate_squared(final_rate);
+  int32_t steps = distance >> 1;
+  uint32_t quotient, remainder;
+  if (final_sq >= initial_sq) {
+    quotient = (final_sq - initial_sq) / four_acceleration;
+    remainder = (final_sq - initial_sq) - quotient * four_acceleration;
+    steps += quotient;
+    if (distance & 1) {
+      steps += (remainder << 1) > four_acceleration ? 2 : 1;  // ceil(0.5 + remainder/4a)
+    } 
+    else if (remainder != 0) {
+      steps++;
+    }
+  } 
   else {
-    return 0.0;  // acceleration was 0, set intersection distance to 0
+    quotient = (initial_sq - final_sq) / four_acceleration;
+    remainder = (initial_sq - final_sq) - quotient * four_acceleration;
+    steps -= quotient;
+    if ((distance & 1) && (remainder << 1) < four_acceleration) {
+      steps++;  // ceil(0.5 - remainder/4a)
+    }
   }
+  return steps;
 }
 
-// Calculates the maximum allowable speed at this point when you must be able to reach target_velocity using the 
-// acceleration within the allotted distance.
-FORCE_INLINE float max_allowable_speed(float acceleration, float target_velocity, float distance) {
-  return  sqrt(target_velocity*target_velocity-2*acceleration*distance);
+// Calculates the maximum allowable speed at the start of a block when you must be able to reach target_velocity
+// at its acceleration within its length.
+FORCE_INLINE float block_max_allowable_speed(const block_t *block, float target_velocity) {
+  return  sqrt(target_velocity*target_velocity+block->acceleration_distance);
 }
 
 #ifdef C_COMPENSATION
+// The table lists the compensation at rising E speeds, it is linear in between, starts at 0 for
+// 0mm/sec and stays at the last value beyond the last speed. Each segment gets its slope and
+// intercept in steps here, so that the planner does not divide for every block.
+void plan_compile_c_comp()
+{
+  for(uint8_t e = 0; e < EXTRUDERS; e++)
+  {
+    float low_bound = 0;
+    float low_comp = 0;
+    int ii;
+    for(ii = 0; ii < gCComp_size[e]; ii++)
+    {
+      float high_bound = gCComp[ii][e][0] * axis_steps_per_unit[E_AXIS + e];
+      float high_comp = gCComp[ii][e][1] * axis_steps_per_unit[E_AXIS + e];
+      c_comp_segment_t *segment = &gCCompTable[ii][e];
+      segment->high_bound = ceil(high_bound); // s < high_bound for whole step rates
+      segment->slope = (high_comp - low_comp)/(high_bound - low_bound);
+      segment->intercept = low_comp - segment->slope*low_bound;
+      low_bound = high_bound;
+      low_comp = high_comp;
+    }
+    c_comp_segment_t *segment = &gCCompTable[ii][e];
+    segment->high_bound = 0xFFFFFFFF;
+    segment->slope = 0;
+    segment->intercept = low_comp;
+  }
+}
+
+// Compensation (in steps) for the given E speed (in steps/sec)
+FORCE_INLINE long c_comp_for_rate(unsigned long s, uint8_t extruder)
+{
+  c_comp_segment_t *segment = &gCCompTable[0][extruder];
+  while(s >= segment->high_bound) {
+    segment += EXTRUDERS;
+  }
+  return floor(segment->slope*s + segment->intercept);
+}
+
 // Calculate compensation (in steps) for given E speeds and extruder
 FORCE_INLINE void calc_c_comp(unsigned long s1, long &c1, 
                               unsigned long s2, long &c2, 
                               unsigned long s3, long &c3, 
                               uint8_t extruder)
 {
-  float low_bound = 0;
-  float low_comp = 0;
-  c1 = c2 = c3 = 0;
-  for(int ii = 0; ii < gCComp_size[extruder]; ii++) 
-  {
-    if(s1 < low_bound && s2 < low_bound && s3 < low_bound) {
-      break; 
-    }
-    float high_bound = gCComp[ii][extruder][0] * axis_steps_per_unit[E_AXIS + extruder];
-    float high_comp = gCComp[ii][extruder][1] * axis_steps_per_unit[E_AXIS + extruder];
-    float a = (low_comp - high_comp)/(low_bound - high_bound);
-    float b = (high_bound*low_comp - low_bound*high_comp)/(high_bound - low_bound);
-    if(s2 >= low_bound && s2 < high_bound) {
-      c2 = floor(a*s2 + b);
-    } else if(s2 > high_bound) {
-      c2 = floor(high_comp);
-    }
-    #ifdef C_COMPENSATION_IGNORE_ACCELERATION
-    c1 = c3 = c2;
-    #else // C_COMPENSATION_IGNORE_ACCELERATION
-    if(s1 >= low_bound && s1 < high_bound) {
-      c1 = floor(a*s1 + b);
-    } else if(s1 > high_bound) {
-      c1 = floor(high_comp);
-    }
-    if(s3 >= low_bound && s3 < high_bound) {
-      c3 = floor(a*s3 + b);
-    } else if(s3 > high_bound) {
-      c3 = floor(high_comp);
-    }
-    #endif // C_COMPENSATION_IGNORE_ACCELERATION
-    low_bound = high_bound;
-    low_comp = high_comp;
-  }
-  return;
+  c2 = c_comp_for_rate(s2, extruder);
+  #ifdef C_COMPENSATION_IGNORE_ACCELERATION
+  c1 = c3 = c2;
+  #else // C_COMPENSATION_IGNORE_ACCELERATION
+  c1 = c_comp_for_rate(s1, extruder);
+  c3 = c_comp_for_rate(s3, extruder);
+  #endif // C_COMPENSATION_IGNORE_ACCELERATION
 }
 #endif // C_COMPENSATION
 
 // Calculates trapezoid parameters so that the entry- and exit-speed is compensated by the provided factors.
 void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exit_factor) {
-  unsigned long initial_rate = ceil(block->nominal_rate*entry_factor); // (step/min)
-  unsigned long final_rate = ceil(block->nominal_rate*exit_factor); // (step/min)
-  unsigned long target_rate = block->nominal_rate; // (step/min)
+  uint32_t initial_rate = ceil(block->nominal_rate*entry_factor); // (step/min)
+  uint32_t final_rate = ceil(block->nominal_rate*exit_factor); // (step/min)
+  uint32_t target_rate = block->nominal_rate; // (step/min)
 
   // Limit minimal step rate (Otherwise the timer will overflow.)
   if(initial_rate <120) {
@@ -232,11 +350,9 @@ void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exi
     final_rate = target_rate;
   }
 
-  long acceleration = block->acceleration_st;
-  int32_t accelerate_steps =
-    ceil(estimate_acceleration_distance(block->initial_rate, target_rate, acceleration));
-  int32_t decelerate_steps =
-    floor(estimate_acceleration_distance(target_rate, block->final_rate, -acceleration));
+  uint32_t acceleration = block->acceleration_st;
+  int32_t accelerate_steps = estimate_acceleration_steps(initial_rate, target_rate, acceleration, true);
+  int32_t decelerate_steps = estimate_acceleration_steps(final_rate, target_rate, acceleration, false);
 
   // Calculate the size of Plateau of Nominal Rate.
   int32_t plateau_steps = block->step_event_count-accelerate_steps-decelerate_steps;
@@ -244,14 +360,41 @@ void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exi
   // Is the Plateau of Nominal Rate smaller than nothing? That means no cruising, and we will
   // have to use intersection_distance() to calculate when to abort acceleration and start braking
   // in order to reach the final_rate exactly at the end of this block.
+  uint32_t peak_rate = target_rate;
   if (plateau_steps < 0) {
-    accelerate_steps = ceil(intersection_distance(block->initial_rate, block->final_rate, acceleration, block->step_event_count));
+    int32_t nominal_accelerate_steps = accelerate_steps;
+    accelerate_steps = intersection_steps(initial_rate, final_rate, acceleration, block->step_event_count);
     accelerate_steps = max(accelerate_steps,0); // Check limits due to numerical round-off
     accelerate_steps = min((uint32_t)accelerate_steps,block->step_event_count);//(We can cast here to unsigned, because the above line ensures that we are above zero)
-    target_rate = max_allowable_speed(block->initial_rate, -acceleration, accelerate_steps);
+    // The square of the peak rate stays below nominal_rate^2 while the acceleration ends before
+    // nominal_accelerate_steps (rounded up), so it fits into 32 bits
+    if(accelerate_steps < nominal_accelerate_steps) {
+      peak_rate = rate_sqrt(rate_squared(initial_rate) + (acceleration << 1) * accelerate_steps);
+    }
+    #if defined(C_COMPENSATION) || defined(S_CURVE_ACCELERATION)
+    target_rate = peak_rate;
+    #endif // C_COMPENSATION || S_CURVE_ACCELERATION
     plateau_steps = 0;
   }
 
+  // How long the block takes in us, for block_buffer_time and the print time estimate:
+  // plateau_steps/nominal_rate + (peak - initial + peak - final)/acceleration, see step_time and rate_time
+  peak_rate = max(peak_rate, max(initial_rate, final_rate));
+  uint32_t ramp_rates = (peak_rate - initial_rate) + (peak_rate - final_rate);
+  uint32_t segment_time = mul_fixed16(plateau_steps, block->step_time) + mul_fixed16(ramp_rates, block->rate_time);
+
+#ifdef S_CURVE_ACCELERATION
+  // Both ramps take as long as with constant acceleration, the stepper follows the S-curve over 
+  // that time (in timer ticks, F_CPU/8). The inverses are divided out here, not in the critical section.
+  if(target_rate < initial_rate) {
+    target_rate = initial_rate;
+  }
+  uint32_t acceleration_ticks = mul_fixed16(mul_fixed16(target_rate - initial_rate, block->rate_time), TICKS_PER_US);
+  uint32_t deceleration_ticks = mul_fixed16(mul_fixed16(target_rate - final_rate, block->rate_time), TICKS_PER_US);
+  uint32_t acceleration_ticks_inverse = acceleration_ticks ? 0xFFFFFFFFUL / acceleration_ticks : 0;
+  uint32_t deceleration_ticks_inverse = deceleration_ticks ? 0xFFFFFFFFUL / deceleration_ticks : 0;
+#endif // S_CURVE_ACCELERATION
+
 #ifdef C_COMPENSATION
   long initial_advance;
   long target_advance;
@@ -274,6 +417,10 @@ void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exi
 
   CRITICAL_SECTION_START;  // Fill variables used by the stepper in a critical section
   if(block->busy == false) { // Don't update variables if block is busy.
+    if(block != &block_buffer[block_buffer_head]) { // Already counted in block_buffer_time
+      block_buffer_time += segment_time - block->segment_time;
+    }
+    block->segment_time = segment_time;
     block->accelerate_until = accelerate_steps;
     block->decelerate_after = accelerate_steps+plateau_steps;
     block->initial_rate = initial_rate;
@@ -283,6 +430,13 @@ void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exi
     block->final_advance = final_advance;
     block->target_advance = target_advance;
 #endif // C_COMPENSATION
+#ifdef S_CURVE_ACCELERATION
+    block->cruise_rate = target_rate;
+    block->acceleration_ticks = acceleration_ticks;
+    block->acceleration_ticks_inverse = acceleration_ticks_inverse;
+    block->deceleration_ticks = deceleration_ticks;
+    block->deceleration_ticks_inverse = deceleration_ticks_inverse;
+#endif // S_CURVE_ACCELERATION
   }
   CRITICAL_SECTION_END;
 }                    
@@ -305,7 +459,7 @@ void planner_reverse_pass_kernel(block_t *previous, block_t *current, block_t *n
       // for max allowable speed if block is decelerating and nominal length is false.
       if ((!current->nominal_length_flag) && (current->max_entry_speed > next->entry_speed)) {
         current->entry_speed = min( current->max_entry_speed,
-        max_allowable_speed(-current->acceleration,next->entry_speed,current->millimeters));
+        block_max_allowable_speed(current,next->entry_speed));
       } 
       else {
         current->entry_speed = current->max_entry_speed;
@@ -317,20 +471,15 @@ void planner_reverse_pass_kernel(block_t *previous, block_t *current, block_t *n
 }
 
 // planner_recalculate() needs to go over the current plan twice. Once in reverse and once forward. This 
-// implements the reverse pass.
-void planner_reverse_pass() {
+// implements the reverse pass. It stops at the first block of the plan that can still change.
+void planner_reverse_pass(uint8_t start) {
   uint8_t block_index = block_buffer_head;
   
-  //Make a local copy of block_buffer_tail, because the interrupt can alter it
-  CRITICAL_SECTION_START;
-  unsigned char tail = block_buffer_tail;
-  CRITICAL_SECTION_END
-  
-  if(((block_buffer_head-tail + BLOCK_BUFFER_SIZE) & (BLOCK_BUFFER_SIZE - 1)) > 3) {
+  if(((block_buffer_head-start + BLOCK_BUFFER_SIZE) & (BLOCK_BUFFER_SIZE - 1)) > 3) {
     block_index = (block_buffer_head - 3) & (BLOCK_BUFFER_SIZE - 1);
     block_t *block[3] = { 
       NULL, NULL, NULL         };
-    while(block_index != tail) { 
+    while(block_index != start) { 
       block_index = prev_block_index(block_index); 
       block[2]= block[1];
       block[1]= block[0];
@@ -341,9 +490,11 @@ void planner_reverse_pass() {
 }
 
 // The kernel called by planner_recalculate() when scanning the plan from first to last entry.
-void planner_forward_pass_kernel(block_t *previous, block_t *current, block_t *next) {
+// Returns true if the entry speed of the current block got limited by the acceleration 
+// of the previous one.
+bool planner_forward_pass_kernel(block_t *previous, block_t *current, block_t *next) {
   if(!previous) { 
-    return; 
+    return false; 
   }
 
   // If the previous block is an acceleration block, but it is not long enough to complete the
@@ -353,21 +504,25 @@ void planner_forward_pass_kernel(block_t *previous, block_t *current, block_t *n
   if (!previous->nominal_length_flag) {
     if (previous->entry_speed < current->entry_speed) {
       double entry_speed = min( current->entry_speed,
-      max_allowable_speed(-previous->acceleration,previous->entry_speed,previous->millimeters) );
+      block_max_allowable_speed(previous,previous->entry_speed) );
 
       // Check for junction speed change
       if (current->entry_speed != entry_speed) {
         current->entry_speed = entry_speed;
         current->recalculate_flag = true;
+        return true;
       }
     }
   }
+  return false;
 }
 
 // planner_recalculate() needs to go over the current plan twice. Once in reverse and once forward. This 
-// implements the forward pass.
-void planner_forward_pass() {
-  uint8_t block_index = block_buffer_tail;
+// implements the forward pass. It also moves the planned watermark up to the newest block that 
+// either enters at its maximum entry speed or is entered as fast as the previous block can 
+// accelerate. Neither can change when more blocks are added, nor can anything before them.
+void planner_forward_pass(uint8_t start) {
+  uint8_t block_index = start;
   block_t *block[3] = { 
     NULL, NULL, NULL   };
 
@@ -375,10 +530,16 @@ void planner_forward_pass() {
     block[0] = block[1];
     block[1] = block[2];
     block[2] = &block_buffer[block_index];
-    planner_forward_pass_kernel(block[0],block[1],block[2]);
+    if(planner_forward_pass_kernel(block[0],block[1],block[2]) || 
+       (block[1] && block[1]->entry_speed == block[1]->max_entry_speed)) {
+      block_buffer_planned = prev_block_index(block_index);
+    }
     block_index = next_block_index(block_index);
   }
-  planner_forward_pass_kernel(block[1], block[2], NULL);
+  if(planner_forward_pass_kernel(block[1], block[2], NULL) || 
+     (block[2] && block[2]->entry_speed == block[2]->max_entry_speed)) {
+    block_buffer_planned = prev_block_index(block_buffer_head);
+  }
 }
 
 #ifdef ENABLE_DEBUG
@@ -392,8 +553,7 @@ void planner_print_plan() {
     SERIAL_ECHOPAIR(" AE:", (int)current->active_extruder);
     SERIAL_ECHOPAIR(" ES:", current->entry_speed);
     SERIAL_ECHOPAIR(" NS:", current->nominal_speed);
-    SERIAL_ECHOPAIR(" TD:", current->millimeters);
-    SERIAL_ECHOPAIR(" AC:", current->acceleration);
+    SERIAL_ECHOPAIR(" AD:", current->acceleration_distance);
     SERIAL_ECHOPAIR(" SC:", current->step_event_count);
     SERIAL_ECHOPAIR(" SX:", current->steps_x);
     SERIAL_ECHOPAIR(" SY:", current->steps_y);
@@ -411,19 +571,31 @@ void planner_print_plan() {
 }
 #endif // ENABLE_DEBUG
 
-// Recalculates the trapezoid speed profiles for all blocks in the plan according to the 
+// Recalculates the trapezoid speed profiles for the blocks from "start" on according to the 
 // entry_factor for each junction. Must be called by planner_recalculate() after 
 // updating the blocks.
-void planner_recalculate_trapezoids() {
-  int8_t block_index = block_buffer_tail;
+void planner_recalculate_trapezoids(uint8_t start) {
+  int8_t block_index = start;
   block_t *prev = NULL;
   block_t *current = NULL;
   block_t *next = NULL;
+  #ifdef C_COMPENSATION
+  // The planned block before start, if still queued, links its advance to the first one recalculated
+  block_t *planned = NULL;
+  if(start != block_buffer_tail) {
+    planned = &block_buffer[prev_block_index(start)];
+  }
+  #endif // C_COMPENSATION
 
   while(block_index != block_buffer_head) {
     prev = current;
     current = next;
     next = &block_buffer[block_index];
+    #ifdef C_COMPENSATION
+    if(current == &block_buffer[start]) {
+      prev = planned;
+    }
+    #endif // C_COMPENSATION
     if (current) {
       // Recalculate if current block entry or exit junction speed has changed.
       if (current->recalculate_flag || next->recalculate_flag) {
@@ -448,6 +620,9 @@ void planner_recalculate_trapezoids() {
   // Last/newest block in buffer. Exit speed is set with MINIMUM_PLANNER_SPEED. Always recalculated.
   if(next != NULL) {
     #ifdef C_COMPENSATION
+    if(!current) {
+      current = planned;
+    }
     if(current) {
       next->prev_advance = current->final_advance;
     }
@@ -479,22 +654,98 @@ void planner_recalculate_trapezoids() {
 // the set limit. Finally it will:
 //
 //   3. Recalculate trapezoids for all blocks.
+//
+// All three steps start from the planned watermark rather than the buffer tail. The entry speeds 
+// up to the watermark are final, so the work per new block stays constant on long runs of blocks
+// that reach their junction speeds.
 
 void planner_recalculate() {   
-  planner_reverse_pass();
-  planner_forward_pass();
-  planner_recalculate_trapezoids();
+  //Make a local copy of block_buffer_tail, because the interrupt can alter it
+  CRITICAL_SECTION_START;
+  unsigned char tail = block_buffer_tail;
+  CRITICAL_SECTION_END
+  
+  // Start from the tail if the watermark block has already been executed
+  uint8_t start = block_buffer_planned;
+  if(((start - tail) & (BLOCK_BUFFER_SIZE - 1)) >= ((block_buffer_head - tail) & (BLOCK_BUFFER_SIZE - 1))) {
+    start = tail;
+    block_buffer_planned = tail;
+  }
+#ifdef STEP_SEGMENT_BUFFER
+  // The trapezoids of the blocks st_prepare_segments() has started on are final, so is the entry 
+  // speed of the block after the last of them. Plan from there on.
+  if(block_buffer[start].busy) {
+    while(start != block_buffer_head && block_buffer[start].busy) {
+      start = next_block_index(start);
+    }
+    block_buffer_planned = start;
+  }
+#endif // STEP_SEGMENT_BUFFER
+
+  planner_reverse_pass(start);
+  planner_forward_pass(start);
+  planner_recalculate_trapezoids(start);
 }
 
 void plan_init() {
   block_buffer_head = 0;
   block_buffer_tail = 0;
+  block_buffer_planned = 0;
+  retired_tail = 0;
+  memset(axis_blocks, 0, sizeof(axis_blocks));
+#ifdef AUTOTEMP
+  autotemp_count = 0;
+#endif
+  block_buffer_time = 0;
+  plan_reset_executed_time();
   memset(position, 0, sizeof(position)); // clear position
   previous_speed[0] = 0.0;
   previous_speed[1] = 0.0;
   previous_speed[2] = 0.0;
   previous_speed[3] = 0.0; // should stay unused
   previous_nominal_speed = 0.0;
+#ifdef JUNCTION_DEVIATION
+  memset(previous_unit_vec, 0, sizeof(previous_unit_vec));
+#endif
+}
+
+void plan_reset_executed_time() {
+  CRITICAL_SECTION_START;
+  executed_time = 0;
+  executed_time_us = 0;
+  CRITICAL_SECTION_END;
+}
+
+// Takes the blocks the stepper has discarded since the last call out of the counts. Must run before
+// a discarded block is overwritten, plan_buffer_line() calls it before filling a new one.
+static void retire_blocks()
+{
+  unsigned char tail = block_buffer_tail;
+  while(retired_tail != tail) {
+    block_t *block = &block_buffer[retired_tail];
+    if(block->steps_x != 0) axis_blocks[X_AXIS]--;
+    if(block->steps_y != 0) axis_blocks[Y_AXIS]--;
+    if(block->steps_z != 0) axis_blocks[Z_AXIS]--;
+    if(block->steps_e != 0) axis_blocks[E_AXIS]--;
+#ifdef AUTOTEMP
+    if((autotemp_count != 0) && (autotemp_block[autotemp_first] == retired_tail)) {
+      autotemp_first = (autotemp_first + 1) & (BLOCK_BUFFER_SIZE - 1);
+      autotemp_count--;
+    }
+#endif
+    retired_tail = next_block_index(retired_tail);
+  }
+  // The stepper carries at most one second per block, blocks longer than that leave the rest here
+  CRITICAL_SECTION_START;
+  unsigned long time_us = executed_time_us;
+  CRITICAL_SECTION_END;
+  if(time_us >= 1000000) {
+    unsigned long seconds = time_us / 1000000;
+    CRITICAL_SECTION_START;
+    executed_time += seconds;
+    executed_time_us -= seconds * 1000000;
+    CRITICAL_SECTION_END;
+  }
 }
 
 #ifdef AUTOTEMP
@@ -508,22 +759,7 @@ void getHighESpeed()
     return; //do nothing
   }
 
-  float high=0.0;
-  uint8_t block_index = block_buffer_tail;
-
-  while(block_index != block_buffer_head) {
-    if((block_buffer[block_index].steps_x != 0) ||
-      (block_buffer[block_index].steps_y != 0) ||
-      (block_buffer[block_index].steps_z != 0)) {
-      float se=(float(block_buffer[block_index].steps_e)/float(block_buffer[block_index].step_event_count))*block_buffer[block_index].nominal_speed;
-      //se; mm/sec;
-      if(se>high)
-      {
-        high=se;
-      }
-    }
-    block_index = (block_index+1) & (BLOCK_BUFFER_SIZE - 1);
-  }
+  float high = (autotemp_count != 0) ? autotemp_e_speed[autotemp_first] : 0.0;
 
   float g=autotemp_min+high*autotemp_factor;
   float t=g;
@@ -542,33 +778,20 @@ void getHighESpeed()
 
 void check_axes_activity()
 {
-  unsigned char x_active = 0;
-  unsigned char y_active = 0;  
-  unsigned char z_active = 0;
-  unsigned char e_active = 0;
   unsigned char tail_fan_speed[EXTRUDERS];
   block_t *block;
 
+  retire_blocks();
   memcpy(tail_fan_speed, fanSpeed, sizeof(tail_fan_speed));
   if(block_buffer_tail != block_buffer_head)
   {
-    uint8_t block_index = block_buffer_tail;
-    block = &block_buffer[block_index];
+    block = &block_buffer[block_buffer_tail];
     tail_fan_speed[block->active_extruder] = block->fan_speed;
-    while(block_index != block_buffer_head)
-    {
-      block = &block_buffer[block_index];
-      if(block->steps_x != 0) x_active++;
-      if(block->steps_y != 0) y_active++;
-      if(block->steps_z != 0) z_active++;
-      if(block->steps_e != 0) e_active++;
-      block_index = (block_index+1) & (BLOCK_BUFFER_SIZE - 1);
-    }
   }
-  if((DISABLE_X) && (x_active == 0)) disable_x();
-  if((DISABLE_Y) && (y_active == 0)) disable_y();
-  if((DISABLE_Z) && (z_active == 0)) disable_z();
-  if((DISABLE_E) && (e_active == 0))
+  if((DISABLE_X) && (axis_blocks[X_AXIS] == 0)) disable_x();
+  if((DISABLE_Y) && (axis_blocks[Y_AXIS] == 0)) disable_y();
+  if((DISABLE_Z) && (axis_blocks[Z_AXIS] == 0)) disable_z();
+  if((DISABLE_E) && (axis_blocks[E_AXIS] == 0))
   {
     disable_e0();
     disable_e1();
@@ -640,7 +863,6 @@ void check_axes_activity()
 }
 
 
-float junction_deviation = 0.1;
 // Add a new linear movement to the buffer. steps_x, _y and _z is the absolute position in 
 // mm. Microseconds specify how many microseconds the move should take to perform. To aid acceleration
 // calculation the caller must also provide the physical length of the line in millimeters.
@@ -657,6 +879,7 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
     manage_inactivity(); 
     lcd_update();
   }
+  retire_blocks();
   
   // The target position of the tool in absolute steps
   // Calculate target position in absolute steps
@@ -782,10 +1005,11 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
   delta_mm[E_AXIS] = ((target[E_AXIS]-position[E_AXIS])/axis_steps_per_unit[E_AXIS + extruder]) *
                      extrudemultiply / 100.0;
 
+  float millimeters;
   block->retract = block->restore = false;
   if ( block->steps_x <= dropsegments && block->steps_y <= dropsegments && block->steps_z <= dropsegments )
   {
-    block->millimeters = fabs(delta_mm[E_AXIS]);
+    millimeters = fabs(delta_mm[E_AXIS]);
     no_move = true;
     // If retracting/returning mark the block as such
     if(block->steps_e != 0) {
@@ -799,10 +1023,10 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
   } 
   else
   {
-    block->millimeters = sqrt(square(delta_mm[X_AXIS]) + square(delta_mm[Y_AXIS]) + square(delta_mm[Z_AXIS]));
+    millimeters = sqrt(square(delta_mm[X_AXIS]) + square(delta_mm[Y_AXIS]) + square(delta_mm[Z_AXIS]));
     no_move = false;
   }
-  float inverse_millimeters = 1.0/block->millimeters;  // Inverse millimeters to remove multiple divides 
+  float inverse_millimeters = 1.0/millimeters;  // Inverse millimeters to remove multiple divides 
   // Calculate speed in mm/second for each axis. No divide by zero due to previous checks.
   float inverse_second = feed_rate * inverse_millimeters;
   int moves_queued = num_blocks_queued();
@@ -813,11 +1037,13 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
   {
     //  segment time im micro seconds
     unsigned long segment_time = lround(1000000.0/inverse_second);
-    if ((moves_queued > 1) && (moves_queued < (BLOCK_BUFFER_SIZE * 0.5)))
+    unsigned long buffered_time = plan_buffered_time();
+    if ((moves_queued > 1) && (buffered_time < SLOWDOWN_BUFFER_TIME))
     {
       if (segment_time < minsegmenttime)
       { // buffer is draining, add extra time.  The amount of time added increases if the buffer is still emptied more.
-        inverse_second=1000000.0/(segment_time+lround(2*(minsegmenttime-segment_time)/moves_queued));
+        inverse_second=1000000.0/(segment_time+lround((float)(minsegmenttime-segment_time)*
+                                                      (SLOWDOWN_BUFFER_TIME-buffered_time)/SLOWDOWN_BUFFER_TIME));
         #ifdef XY_FREQUENCY_LIMIT
            segment_time = lround(1000000.0/inverse_second);
         #endif
@@ -826,8 +1052,8 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
   }
 #endif // SLOWDOWN
 
-  block->nominal_speed = block->millimeters * inverse_second; // (mm/sec) Always > 0
-  block->nominal_rate = ceil(block->step_event_count * inverse_second); // (step/sec) Always > 0
+  block->nominal_speed = millimeters * inverse_second; // (mm/sec) Always > 0
+  unsigned long nominal_rate = ceil(block->step_event_count * inverse_second); // (step/sec) Always > 0
 
   // Calculate and limit speed in mm/sec for each axis
   float current_speed[4];
@@ -898,11 +1124,16 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
       current_speed[i] *= speed_factor;
     }
     block->nominal_speed *= speed_factor;
-    block->nominal_rate *= speed_factor;
+    nominal_rate *= speed_factor;
   }
+  // The stepper can't go faster than MAX_STEP_FREQUENCY anyway, this only keeps the rate in 16 bits
+  block->nominal_rate = min(nominal_rate, 0xFFFFUL);
+#if defined(C_COMPENSATION) && defined(C_COMPENSATION_E_TIMER)
+  block->e_step_rate = (float)block->nominal_rate * block->steps_e / block->step_event_count;
+#endif // C_COMPENSATION && C_COMPENSATION_E_TIMER
 
   // Compute and limit the acceleration rate for the trapezoid generator.  
-  float steps_per_mm = block->step_event_count/block->millimeters;
+  float steps_per_mm = block->step_event_count/millimeters;
   if(no_move)
   {
     block->acceleration_st = ceil(retract_acceleration[extruder] * steps_per_mm); // convert to: acceleration steps/sec^2
@@ -927,8 +1158,17 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
     if(((float)block->acceleration_st * (float)block->steps_e / (float)block->step_event_count) > axis_steps_per_sqr_second[E_AXIS])
       block->acceleration_st = axis_steps_per_sqr_second[E_AXIS];
   }
-  block->acceleration = block->acceleration_st / steps_per_mm;
+  float block_acceleration = block->acceleration_st / steps_per_mm;
+  block->acceleration_distance = 2*block_acceleration*millimeters;
   block->acceleration_rate = (long)((float)block->acceleration_st * 8.388608);
+  // The divisions calculate_trapezoid_for_block() needs for the block time, done once here
+  float step_time = 1000000.0 * 65536.0 / block->nominal_rate;
+  block->step_time = (step_time < 4294967295.0) ? (unsigned long)step_time : 0xFFFFFFFFUL;
+  block->rate_time = 0;
+  if(block->acceleration_st != 0) {
+    float rate_time = 1000000.0 * 65536.0 / block->acceleration_st;
+    block->rate_time = (rate_time < 4294967295.0) ? (unsigned long)rate_time : 0xFFFFFFFFUL;
+  }
 
 
   // For E-only moves use the user defined max for E axis otherwise use XY max
@@ -946,9 +1186,28 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
     if(fabs(current_speed[E_AXIS]) > max_e_jerk[extruder]/2) 
       vmax_junction = min(vmax_junction, max_e_jerk[extruder]/2);
     vmax_junction = min(vmax_junction, block->nominal_speed);
-    float safe_speed = vmax_junction;
+    safe_speed = vmax_junction;
 
     if ((moves_queued > 1) && (previous_nominal_speed > 0.0001)) {
+#ifdef JUNCTION_DEVIATION
+      // Take the junction as the arc that touches both segments and passes junction_deviation mm
+      // from the corner, and limit the speed to what the block acceleration allows on that arc:
+      // v = sqrt(a * deviation * sin(theta/2) / (1 - sin(theta/2))), theta being the angle between
+      // the segments. Straight junctions keep the nominal speed, reversals use the safe speed.
+      if (previous_unit_vec[X_AXIS] != 0.0 || previous_unit_vec[Y_AXIS] != 0.0 || previous_unit_vec[Z_AXIS] != 0.0) {
+        float cos_theta = - (previous_unit_vec[X_AXIS] * delta_mm[X_AXIS] + 
+                             previous_unit_vec[Y_AXIS] * delta_mm[Y_AXIS] +
+                             previous_unit_vec[Z_AXIS] * delta_mm[Z_AXIS]) * inverse_millimeters;
+        if (cos_theta < 0.95) {
+          vmax_junction = block->nominal_speed;
+          if (cos_theta > -0.95) {
+            float sin_theta_d2 = sqrt(0.5 * (1.0 - cos_theta)); // Trig half angle identity. Always positive.
+            vmax_junction = min(vmax_junction, 
+                                sqrt(block_acceleration * junction_deviation * sin_theta_d2 / (1.0 - sin_theta_d2)));
+          }
+        }
+      }
+#else // JUNCTION_DEVIATION
       float jerk = sqrt(pow((current_speed[X_AXIS]-previous_speed[X_AXIS]), 2)+pow((current_speed[Y_AXIS]-previous_speed[Y_AXIS]), 2));
       vmax_junction = block->nominal_speed;
       if (jerk > max_xy_jerk) {
@@ -957,6 +1216,7 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
       if(fabs(current_speed[Z_AXIS] - previous_speed[Z_AXIS]) > max_z_jerk) {
         vmax_junction_factor= min(vmax_junction_factor, (max_z_jerk/fabs(current_speed[Z_AXIS] - previous_speed[Z_AXIS])));
       } 
+#endif // JUNCTION_DEVIATION
       if(fabs(current_speed[E_AXIS] - previous_speed[E_AXIS]) + COMP_SPEED > max_e_jerk[extruder]) {
         vmax_junction_factor = min(vmax_junction_factor, (max_e_jerk[extruder]/(fabs(current_speed[E_AXIS] - previous_speed[E_AXIS])) + COMP_SPEED));
       } 
@@ -965,8 +1225,15 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
     block->max_entry_speed = vmax_junction;
 
     // Initialize block entry speed. Compute based on deceleration to user-defined MINIMUM_PLANNER_SPEED.
-    double v_allowable = max_allowable_speed(-block->acceleration,MINIMUM_PLANNER_SPEED,block->millimeters);
+    double v_allowable = block_max_allowable_speed(block,MINIMUM_PLANNER_SPEED);
     block->entry_speed = min(vmax_junction, v_allowable);
+#ifdef STEP_SEGMENT_BUFFER
+    // Once st_prepare_segments() has started on the previous block, it stops at the end of it. 
+    // This block starts from that, its entry speed can't be raised anymore.
+    if((moves_queued > 0) && block_buffer[prev_block_index(block_buffer_head)].busy) {
+      block->entry_speed = min(block->entry_speed, safe_speed);
+    }
+#endif // STEP_SEGMENT_BUFFER
 
 #ifdef C_COMPENSATION
     // Bump up the compensation speed to e-jerk if can
@@ -990,8 +1257,8 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
     else { 
       block->nominal_length_flag = false; 
     }
-    block->recalculate_flag = true; // Always calculate trapezoid for new block
   }
+  block->recalculate_flag = true; // Always calculate trapezoid for new block
   
   calculate_trapezoid_for_block(block, block->entry_speed/block->nominal_speed,
                                 safe_speed/block->nominal_speed);
@@ -999,9 +1266,34 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
   // Update previous path unit_vector and nominal speed
   memcpy(previous_speed, current_speed, sizeof(previous_speed)); // previous_speed[] = current_speed[]
   previous_nominal_speed = block->nominal_speed;
+#ifdef JUNCTION_DEVIATION
+  for(int i=0; i < 3; i++) {
+    previous_unit_vec[i] = no_move ? 0.0 : delta_mm[i] * inverse_millimeters;
+  }
+#endif // JUNCTION_DEVIATION
+
+  if(block->steps_x != 0) axis_blocks[X_AXIS]++;
+  if(block->steps_y != 0) axis_blocks[Y_AXIS]++;
+  if(block->steps_z != 0) axis_blocks[Z_AXIS]++;
+  if(block->steps_e != 0) axis_blocks[E_AXIS]++;
+#ifdef AUTOTEMP
+  if((block->steps_x != 0) || (block->steps_y != 0) || (block->steps_z != 0)) {
+    // Entries this block's extruder speed reaches can never be the highest again
+    float se = (float(block->steps_e)/float(block->step_event_count))*block->nominal_speed;
+    while((autotemp_count != 0) && (autotemp_e_speed[(autotemp_first + autotemp_count - 1) & (BLOCK_BUFFER_SIZE - 1)] <= se))
+      autotemp_count--;
+    unsigned char last = (autotemp_first + autotemp_count) & (BLOCK_BUFFER_SIZE - 1);
+    autotemp_block[last] = block_buffer_head;
+    autotemp_e_speed[last] = se;
+    autotemp_count++;
+  }
+#endif
 
   // Move buffer head
+  CRITICAL_SECTION_START;
+  block_buffer_time += block->segment_time;
   block_buffer_head = next_buffer_head;
+  CRITICAL_SECTION_END;
 
   // Update position
   memcpy(position, target, sizeof(target)); // position[] = target[]
@@ -1025,6 +1317,9 @@ void plan_set_position(const float &x, const float &y, const float &z, const flo
   previous_speed[1] = 0.0;
   previous_speed[2] = 0.0;
   previous_speed[3] = 0.0;
+#ifdef JUNCTION_DEVIATION
+  memset(previous_unit_vec, 0, sizeof(previous_unit_vec));
+#endif
 }
 
 void plan_set_e_position(const float &e)
@@ -28,6 +28,9 @@
 
 // This struct is used when buffering the setup for each linear movement "nominal" values are as specified in 
 // the source g-code and may never actually be reached if acceleration management is active.
+// The stepper interrupt only reads the first part, the planner-only part follows at the end. Step rates 
+// fit into 16 bits (see calc_timer()) and the flags are packed into bit fields to save SRAM. busy stays 
+// a byte of its own, the stepper interrupt sets it while the planner may be writing the flags.
 typedef struct {
   // Fields used by the bresenham algorithm for tracing the line
   long steps_x, steps_y, steps_z, steps_e;  // Step count along each axis
@@ -36,38 +39,67 @@ typedef struct {
   long decelerate_after;                    // The index of the step event on which to start decelerating
   long acceleration_rate;                   // The acceleration rate used for acceleration calculation
   unsigned char direction_bits;             // The direction bit set for this block (refers to *_DIRECTION_BIT in config.h)
-  unsigned char active_extruder;            // Selects the active extruder
-  bool retract;                             // Identified as retract move block (not yet used)
-  bool restore;                             // Identified as return move block
-  bool travel;                              // Identified as travel move block
+  unsigned char active_extruder : 2;        // Selects the active extruder
+  unsigned char retract : 1;                // Identified as retract move block (not yet used)
+  unsigned char restore : 1;                // Identified as return move block
+  unsigned char travel : 1;                 // Identified as travel move block
+  unsigned char recalculate_flag : 1;       // Planner flag to recalculate trapezoids on entry junction
+  unsigned char nominal_length_flag : 1;    // Planner flag for nominal speed always reached
+  volatile char busy;
+  unsigned char fan_speed;                  // fan speed at the block
+
+  // Settings for the trapezoid generator
+  unsigned short nominal_rate;              // The nominal step rate for this block in step_events/sec 
+  unsigned short initial_rate;              // The jerk-adjusted step rate at start of block  
+  unsigned short final_rate;                // The minimal rate at exit
   #ifdef C_COMPENSATION
     long initial_advance;                   // Steps to be ahead when entering the block
     long target_advance;                    // Steps to be ahead when done accelerating
     long final_advance;                     // Steps to be ahead when done with the block
-    long prev_advance;                      // Filled with final_advance of the prev block
     long next_advance;                      // Filled with initial_advance of the next block
     unsigned short advance_step_rate;       // How fast to advance in this block
+    #ifdef C_COMPENSATION_E_TIMER
+    unsigned short e_step_rate;             // E steps/sec at the nominal rate
+    #endif // C_COMPENSATION_E_TIMER
   #endif // C_COMPENSATION
+  #ifdef S_CURVE_ACCELERATION
+    unsigned short cruise_rate;             // The step rate reached at the end of the acceleration
+    unsigned long acceleration_ticks;       // Duration of the acceleration in timer ticks
+    unsigned long acceleration_ticks_inverse; // 2^32 / acceleration_ticks
+    unsigned long deceleration_ticks;       // Duration of the deceleration in timer ticks
+    unsigned long deceleration_ticks_inverse; // 2^32 / deceleration_ticks
+  #endif // S_CURVE_ACCELERATION
+  unsigned long segment_time;               // Duration of the block in us as planned, see plan_buffered_time()
 
   // Fields used by the motion planner to manage acceleration
-//  float speed_x, speed_y, speed_z, speed_e;        // Nominal mm/sec for each axis
-  float nominal_speed;                               // The nominal speed for this block in mm/sec 
-  float entry_speed;                                 // Entry speed at previous-current junction in mm/sec
-  float max_entry_speed;                             // Maximum allowable junction entry speed in mm/sec
-  float millimeters;                                 // The total travel of this block in mm
-  float acceleration;                                // acceleration mm/sec^2
-  unsigned char recalculate_flag;                    // Planner flag to recalculate trapezoids on entry junction
-  unsigned char nominal_length_flag;                 // Planner flag for nominal speed always reached
-
-  // Settings for the trapezoid generator
-  unsigned long nominal_rate;                        // The nominal step rate for this block in step_events/sec 
-  unsigned long initial_rate;                        // The jerk-adjusted step rate at start of block  
-  unsigned long final_rate;                          // The minimal rate at exit
-  unsigned long acceleration_st;                     // acceleration steps/sec^2
-  unsigned char fan_speed;                           // fan speed at the block
-  volatile char busy;
+  float nominal_speed;                      // The nominal speed for this block in mm/sec 
+  float entry_speed;                        // Entry speed at previous-current junction in mm/sec
+  float max_entry_speed;                    // Maximum allowable junction entry speed in mm/sec
+  float acceleration_distance;              // 2 * acceleration * length in mm^2/sec^2, the most the square 
+                                            // of the speed can change within the block
+  unsigned long acceleration_st;            // acceleration steps/sec^2
+  unsigned long step_time;                  // 1000000 / nominal_rate, us per plateau step (16.16 fixed point)
+  unsigned long rate_time;                  // 1000000 / acceleration_st, us per step/sec of ramp (16.16 fixed point)
+  #ifdef C_COMPENSATION
+    long prev_advance;                      // Filled with final_advance of the prev block
+  #endif // C_COMPENSATION
 } block_t;
 
+#ifdef C_COMPENSATION
+// One segment of the compression compensation table in E steps, see plan_compile_c_comp()
+typedef struct {
+  unsigned long high_bound;                 // E step rate the segment ends at (excluded)
+  float slope;                              // Compensation steps per step/sec
+  float intercept;                          // Compensation steps at 0 steps/sec
+} c_comp_segment_t;
+
+// Compiled gCComp table, gCComp_size[e] + 1 segments per extruder, the last open ended
+extern c_comp_segment_t gCCompTable[][EXTRUDERS];
+
+// Compiles gCComp into gCCompTable. Call when the table or the E steps per unit change.
+void plan_compile_c_comp();
+#endif // C_COMPENSATION
+
 // Initialize the motion plan subsystem      
 void plan_init();
 
@@ -97,6 +129,9 @@ extern float max_e_jerk[EXTRUDERS]; // mm/s - initial speed for extruder retract
 extern float max_xy_jerk; //speed than can be stopped at once, if i understand correctly.
 extern float max_z_jerk;
 extern float mintravelfeedrate;
+#ifdef JUNCTION_DEVIATION
+extern float junction_deviation; // mm - distance of the path from the corner at junctions, M205 J
+#endif
 
 #ifdef AUTOTEMP
     extern bool autotemp_enabled;
@@ -111,15 +146,49 @@ extern float mintravelfeedrate;
 extern block_t block_buffer[BLOCK_BUFFER_SIZE];            // A ring buffer for motion instfructions
 extern volatile unsigned char block_buffer_head;           // Index of the next block to be pushed
 extern volatile unsigned char block_buffer_tail; 
+extern volatile unsigned long block_buffer_time;           // Sum of segment_time of the queued blocks in us
+extern volatile unsigned long executed_time;               // Seconds of motion executed since plan_reset_executed_time()
+extern volatile unsigned long executed_time_us;            // and the microseconds on top
 // Called when the current block is no longer needed. Discards the block and makes the memory
 // availible for new blocks.    
 FORCE_INLINE void plan_discard_current_block()  
 {
   if (block_buffer_head != block_buffer_tail) {
+    unsigned long segment_time = block_buffer[block_buffer_tail].segment_time;
+    block_buffer_time -= segment_time;
+    executed_time_us += segment_time;
+    if(executed_time_us >= 1000000) { // Once per block, retire_blocks() carries the rest
+      executed_time_us -= 1000000;
+      executed_time++;
+    }
     block_buffer_tail = (block_buffer_tail + 1) & (BLOCK_BUFFER_SIZE - 1);  
   }
 }
 
+// Returns the time in us the queued blocks take as planned, accelerations included (and including 
+// the one being executed). Unlike the number of blocks this tells how long the buffer lasts if no 
+// more moves come in.
+FORCE_INLINE unsigned long plan_buffered_time()
+{
+  CRITICAL_SECTION_START;
+  unsigned long buffered_time = block_buffer_time;
+  CRITICAL_SECTION_END;
+  return buffered_time;
+}
+
+// Returns the planned time in seconds of the moves executed since plan_reset_executed_time(). 
+// Together with plan_buffered_time() this is the motion time of everything sent so far.
+FORCE_INLINE float plan_executed_time()
+{
+  CRITICAL_SECTION_START;
+  unsigned long time = executed_time;
+  unsigned long time_us = executed_time_us;
+  CRITICAL_SECTION_END;
+  return time + time_us / 1000000.0;
+}
+
+void plan_reset_executed_time();
+
 // Gets the current block. Returns NULL if buffer empty
 FORCE_INLINE block_t *plan_get_current_block() 
 {
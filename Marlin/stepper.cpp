@@ -29,6 +29,8 @@
 #include "language.h"
 #include "cardreader.h"
 #include "speed_lookuptable.h"
+#include "isr_profiler.h"
+#include "trace.h"
 #if DIGIPOTSS_PIN > -1
 #include <SPI.h>
 #endif
@@ -56,8 +58,10 @@ static volatile long advance; // tracks how many steps ahead we need to be to co
 static long initial_advance; // number of steps ahead we need to be when starting the block
 static long target_advance; // number of steps ahead we need to be when done accelerating
 static long final_advance; // number of steps ahead we need to be when done with the block
+#ifndef STEP_SEGMENT_BUFFER
 static long initial_to_target_advance; // difference from initial to target
 static long target_to_final_advance; // difference from target to final
+#endif // !STEP_SEGMENT_BUFFER
 static volatile long e_steps[EXTRUDERS]; // steps scheduled to be done by ISR0
 static unsigned short advance_step_rate; // pre-calculated advance step rate for the last block extruder
 static long us_per_advance_step; // pre-calculated value for ms/advance_step for the last block extruder
@@ -67,16 +71,59 @@ static unsigned short total_e_steps_left; // Keeps the counter of e-steps to do
 static unsigned short total_e_split_time; // Counts time if we need to split E-steps into several cycles
 #endif // C_COMPENSATION_SPLIT_E_STEPS
 static short timer_leftover; // Accumulates time use error
+#ifdef C_COMPENSATION_E_TIMER
+#if !defined(__AVR_ATmega1280__) && !defined(__AVR_ATmega2560__)
+#error "C_COMPENSATION_E_TIMER needs timer3 (ATmega1280/2560), disable it to make the E-steps from the stepper interrupt"
+#endif
+static char e_step_loops; // E-steps per timer3 interrupt
+#endif // C_COMPENSATION_E_TIMER
 #endif // C_COMPENSATION
 static uint8_t current_e; // Current extruder for main stepping ISR (also preserves the last extruder # when block is done)
+#ifndef STEP_SEGMENT_BUFFER
 static long acceleration_time, deceleration_time;
 //static unsigned long accelerate_until, decelerate_after, acceleration_rate, initial_rate, final_rate, nominal_rate;
 static unsigned short acc_step_rate; // needed for deccelaration start point
-static char step_loops;
 static unsigned short OCR1A_nominal;
 static unsigned short step_loops_nominal;
+#endif // !STEP_SEGMENT_BUFFER
+static char step_loops;
 static unsigned short timer;
 
+#ifdef STEP_SEGMENT_BUFFER
+// A segment is a run of step events of one block at a constant step rate. The main loop cuts the
+// blocks into segments ahead of the stepper (st_prepare_segments()), so the interrupt only takes 
+// the OCR1A value, step_loops and the compensation advance from the segment instead of following 
+// the speed ramps itself.
+#define SEGMENT_TICKS ((F_CPU/8) / SEGMENTS_PER_SECOND)
+
+typedef struct {
+  unsigned short step_events;         // Step events in this segment
+  unsigned short timer;               // OCR1A value for the segment
+  char step_loops;                    // Step events per interrupt
+  unsigned char block_index;          // Index of the block in block_buffer
+  unsigned long ticks;                // Duration in timer ticks
+  #ifdef C_COMPENSATION
+  long advance;                       // E-steps to be ahead during the segment (not for travel/restore blocks)
+  #endif // C_COMPENSATION
+} segment_t;
+
+static segment_t segment_buffer[SEGMENT_BUFFER_SIZE];
+static volatile unsigned char segment_buffer_head;  // Index of the next segment to be prepared
+static volatile unsigned char segment_buffer_tail;  // Index of the next segment to be executed
+static volatile unsigned long segment_buffer_ticks; // Duration of the segments not started yet
+// Stepper interrupt side
+static unsigned short segment_steps_left;           // Step events left in the current segment
+static unsigned short segment_timer;
+static char segment_step_loops;
+// Main loop side
+static unsigned char prep_block_index;              // Block being cut into segments
+static unsigned long prep_step_events;              // Step events of that block already in segments
+static unsigned long prep_acceleration_time, prep_deceleration_time;
+static unsigned short prep_acc_step_rate;
+static volatile bool prep_restart;                  // The stepper dropped the block being prepared
+static volatile unsigned long segment_underruns;    // Stepper interrupts that found no segment ready
+#endif // STEP_SEGMENT_BUFFER
+
 volatile long endstops_trigsteps[3]={0,0,0};
 volatile long endstops_stepsTotal,endstops_stepsDone;
 static volatile bool endstop_x_hit=false;
@@ -115,6 +162,7 @@ static bool max_y_endstop_ignore[EXTRUDERS] = { Y0_IGNORE_MAX_ENDSTOP,
 //=============================functions         ============================
 //===========================================================================
 
+#ifdef __AVR__
 // intRes = intIn1 * intIn2 >> 16
 // uses:
 // r26 to store 0
@@ -184,11 +232,42 @@ asm volatile ( \
 : \
 "r26" , "r27" \
 )
+#else
+// Portable versions of the above for the host build. They reproduce the
+// partial products and the rounding of the assembler exactly, so the host
+// computes the same timer values as the AVR.
+FORCE_INLINE unsigned short MultiU16X8toH16_c(unsigned char charIn1, unsigned short intIn2)
+{
+  unsigned short lo = (unsigned short)charIn1 * (intIn2 & 0xff);
+  return (unsigned short)((unsigned short)charIn1 * (intIn2 >> 8) + (lo >> 8) + (lo & 1));
+}
+
+FORCE_INLINE unsigned short MultiU24X24toH16_c(unsigned long longIn1, unsigned long longIn2)
+{
+  unsigned long a0 = longIn1 & 0xff, a1 = (longIn1 >> 8) & 0xff, a2 = (longIn1 >> 16) & 0xff;
+  unsigned long b0 = longIn2 & 0xff, b1 = (longIn2 >> 8) & 0xff, b2 = (longIn2 >> 16) & 0xff;
+  unsigned long acc = (a0 * b1) >> 8;
+  acc |= (a1 * b2) << 8;
+  acc += ((a2 * b2) & 0xff) << 16;
+  acc += (a2 * b1) << 8;
+  acc += a0 * b2 + a1 * b1 + a2 * b0;
+  acc += (a1 * b0) >> 8;
+  acc &= 0xffffff;
+  return (unsigned short)((acc >> 8) + (acc & 1));
+}
+
+#define MultiU16X8toH16(intRes, charIn1, intIn2) intRes = MultiU16X8toH16_c(charIn1, intIn2)
+#define MultiU24X24toH16(intRes, longIn1, longIn2) intRes = MultiU24X24toH16_c(longIn1, longIn2)
+#endif // __AVR__
 
 // Some useful constants
 
 #define ENABLE_STEPPER_DRIVER_INTERRUPT()  TIMSK1 |= (1<<OCIE1A)
 #define DISABLE_STEPPER_DRIVER_INTERRUPT() TIMSK1 &= ~(1<<OCIE1A)
+#if defined(C_COMPENSATION) && defined(C_COMPENSATION_E_TIMER)
+#define ENABLE_E_TIMER_INTERRUPT()  TIMSK3 |= (1<<OCIE3A)
+#define DISABLE_E_TIMER_INTERRUPT() TIMSK3 &= ~(1<<OCIE3A)
+#endif // C_COMPENSATION && C_COMPENSATION_E_TIMER
 
 void checkHitEndstops()
 {
@@ -252,6 +331,7 @@ void enable_endstops(bool check)
 //  first block->accelerate_until step_events_completed, then keeps going at constant speed until 
 //  step_events_completed reaches block->decelerate_after after which it decelerates until the trapezoid generator is reset.
 //  The slope of acceleration is calculated with the leib ramp alghorithm.
+//  With S_CURVE_ACCELERATION the ramps follow 3u^2 - 2u^3 of the normalized ramp time u instead. 
 
 void st_wake_up() {
   //  TCNT1 = 0;
@@ -264,46 +344,92 @@ void step_wait(){
 }
   
 
-FORCE_INLINE unsigned short calc_timer(unsigned short step_rate) {
+#ifdef S_CURVE_ACCELERATION
+// Progress along the S-curve (0..65536) at the given time into a ramp of the given duration
+FORCE_INLINE uint32_t s_curve_fraction(uint32_t time, uint32_t ticks, uint32_t ticks_inverse) {
+  if(time >= ticks) {
+    return 65536;
+  }
+  uint32_t u = (time * ticks_inverse) >> 16;  // time/ticks as 0.16 fixed point, can't overflow for time < ticks 
+  uint32_t u2 = (u * u) >> 16;
+  uint32_t u3 = (u2 * u) >> 16;
+  return 3 * u2 - 2 * u3;
+}
+#endif // S_CURVE_ACCELERATION
+
+FORCE_INLINE unsigned short calc_timer(unsigned short step_rate, char &loops) {
   unsigned short t;
   if(step_rate > MAX_STEP_FREQUENCY) step_rate = MAX_STEP_FREQUENCY;
   
   if(step_rate > 20000) { // If steprate > 20kHz >> step 4 times
     step_rate = (step_rate >> 2)&0x3fff;
-    step_loops = 4;
+    loops = 4;
   }
   else if(step_rate > 10000) { // If steprate > 10kHz >> step 2 times
     step_rate = (step_rate >> 1)&0x7fff;
-    step_loops = 2;
+    loops = 2;
   }
   else {
-    step_loops = 1;
+    loops = 1;
   } 
   
   if(step_rate < (F_CPU/500000)) step_rate = (F_CPU/500000);
   step_rate -= (F_CPU/500000); // Correct for minimal speed
   if(step_rate >= (8*256)){ // higher step rate 
-    unsigned short table_address = (unsigned short)&speed_lookuptable_fast[(unsigned char)(step_rate>>8)][0];
+    const uint16_t *table_address = speed_lookuptable_fast[(unsigned char)(step_rate>>8)];
     unsigned char tmp_step_rate = (step_rate & 0x00ff);
-    unsigned short gain = (unsigned short)pgm_read_word_near(table_address+2);
+    unsigned short gain = (unsigned short)pgm_read_word_near(table_address+1);
     MultiU16X8toH16(t, tmp_step_rate, gain);
     t = (unsigned short)pgm_read_word_near(table_address) - t;
   }
   else { // lower step rates
-    unsigned short table_address = (unsigned short)&speed_lookuptable_slow[0][0];
-    table_address += ((step_rate)>>1) & 0xfffc;
+    const uint16_t *table_address = speed_lookuptable_slow[(step_rate)>>3];
     t = (unsigned short)pgm_read_word_near(table_address);
-    t -= (((unsigned short)pgm_read_word_near(table_address+2) * (unsigned char)(step_rate & 0x0007))>>3);
+    t -= (((unsigned short)pgm_read_word_near(table_address+1) * (unsigned char)(step_rate & 0x0007))>>3);
+  }
+  if(t < 100) { //(20kHz this should never happen)
+    t = 100;
+    #ifdef ISR_TRACE
+    trace_event(TRACE_STEPPER_TOO_HIGH, step_rate);
+    #else
+    MYSERIAL.print(MSG_STEPPER_TO_HIGH); MYSERIAL.println(step_rate);
+    #endif
   }
-  if(t < 100) { t = 100; MYSERIAL.print(MSG_STEPPER_TO_HIGH); MYSERIAL.println(step_rate); }//(20kHz this should never happen)
   return t;
 }
 
+FORCE_INLINE unsigned short calc_timer(unsigned short step_rate) {
+  return calc_timer(step_rate, step_loops);
+}
+
 #ifdef C_COMPENSATION
 #ifdef ENABLE_DEBUG
   static long last_print_done;
 #endif // ENABLE_DEBUG
 
+// Returns the most E-steps scheduled for any of the extruders
+FORCE_INLINE unsigned short e_steps_pending() {
+  unsigned short e_steps_left = labs(e_steps[0]);
+  #if EXTRUDERS > 1
+  e_steps_left = max(e_steps_left, labs(e_steps[1]));
+  #endif //EXTRUDERS > 1
+  #if EXTRUDERS > 2
+  e_steps_left = max(e_steps_left, labs(e_steps[2]));
+  #endif // EXTRUDERS > 2
+  return e_steps_left;
+}
+
+#ifdef C_COMPENSATION_E_TIMER
+// Sets the timer3 interval for making E-steps at the given rate (in steps/sec)
+FORCE_INLINE void set_e_timer(unsigned long rate) {
+  unsigned short t = calc_timer(min(rate, 0xFFFFUL), e_step_loops);
+  OCR3A = t;
+  if(TCNT3 > t) { // The compare match would be missed until the counter wraps
+    TCNT3 = 0;
+  }
+}
+#endif // C_COMPENSATION_E_TIMER
+
 // Calculate how many advance steps to do for the time iterval and 
 // set up variables for making E-steps. The time interval "t" 
 // has to be expressed in 0.5us. "e" is the extruder number.
@@ -325,6 +451,10 @@ FORCE_INLINE void set_up_e_steps_for_cycle(uint8_t e, unsigned short t) {
   if((debug_flags & C_COMP_STEPS_DEBUG) != 0)
   {
     if(last_print_done != (millis() >> DBG_HOW_OFTEN)) {
+         #ifdef ISR_TRACE
+         trace_event(TRACE_C_COMP_STEPS, ((long)e << 16) | t, timer_leftover, e_steps[e], advance_steps_this_cycle);
+         trace_event(TRACE_C_COMP_STEPS_2, desired_advance_steps, old_advance, advance, step_events_completed);
+         #else // ISR_TRACE
          SERIAL_ECHO_START;
          SERIAL_ECHOPAIR(" E#:", (int)e);
          SERIAL_ECHOPAIR(" TI:", t);
@@ -338,6 +468,7 @@ FORCE_INLINE void set_up_e_steps_for_cycle(uint8_t e, unsigned short t) {
          SERIAL_ECHOPAIR(" NA:", advance);
          SERIAL_ECHOPAIR(" SC:", step_events_completed);
          SERIAL_ECHOLN("");
+         #endif // ISR_TRACE
          last_print_done = (millis() >> DBG_HOW_OFTEN);
     }
   }
@@ -381,36 +512,52 @@ FORCE_INLINE void trapezoid_generator_reset() {
       final_advance = current_block->final_advance;
     }
   }
+  #ifndef STEP_SEGMENT_BUFFER
   initial_to_target_advance = target_advance - initial_advance;
   target_to_final_advance = final_advance - target_advance;
+  #endif // !STEP_SEGMENT_BUFFER
   // If extruder changes the old_advance is no longer valid and we assume that 
   // there was no compressed filament in the current extruder or it has run out.
   if(current_e != current_block->active_extruder) {
     old_advance = 0;
   }
   us_per_advance_step = 1000000 / advance_step_rate;
+  #ifdef C_COMPENSATION_E_TIMER
+  set_e_timer((unsigned long)current_block->e_step_rate + advance_step_rate);
+  #endif // C_COMPENSATION_E_TIMER
   #endif // C_COMPENSATION
   #ifdef ENABLE_DEBUG
   if((debug_flags & ACCEL_STEPS_DEBUG) != 0) {
+    #ifdef ISR_TRACE
+    trace_event(TRACE_ACCEL_STEPS, current_block->step_event_count, current_block->accelerate_until,
+                current_block->decelerate_after, current_block->nominal_rate);
+    #else // ISR_TRACE
     SERIAL_ECHO_START;
     SERIAL_ECHOPAIR(" SC:", current_block->step_event_count);
     SERIAL_ECHOPAIR(" AU:", current_block->accelerate_until);
     SERIAL_ECHOPAIR(" DA:", current_block->decelerate_after);
     SERIAL_ECHOLN("");
+    #endif // ISR_TRACE
   }
   #ifdef C_COMPENSATION
   if((debug_flags & C_COMPENSATION_DEBUG) != 0) {
+    #ifdef ISR_TRACE
+    trace_event(TRACE_C_COMP_ADVANCE, old_advance, initial_advance, target_advance, final_advance);
+    trace_event(TRACE_C_COMP_RATE, advance_step_rate, us_per_advance_step);
+    #else // ISR_TRACE
     SERIAL_ECHO_START;
     SERIAL_ECHOPAIR(" OA:", old_advance);
     SERIAL_ECHOPAIR(" IA:", initial_advance);
     SERIAL_ECHOPAIR(" TA:", target_advance);
     SERIAL_ECHOPAIR(" FA:", final_advance);
     SERIAL_ECHOLN("");
+    #endif // ISR_TRACE
   }
   last_print_done = 0;
   #endif // C_COMPENSATION
   #endif // ENABLE_DEBUG
   current_e = current_block->active_extruder;
+  #ifndef STEP_SEGMENT_BUFFER // The segments have the timer values
   deceleration_time = 0;
   // step_rate to timer interval
   OCR1A_nominal = calc_timer(current_block->nominal_rate);
@@ -419,9 +566,241 @@ FORCE_INLINE void trapezoid_generator_reset() {
   acc_step_rate = current_block->initial_rate;
   acceleration_time = calc_timer(acc_step_rate);
   OCR1A = acceleration_time;
-  
+  #endif // !STEP_SEGMENT_BUFFER
 }
 
+#ifdef STEP_SEGMENT_BUFFER
+// Cuts the blocks ahead of the stepper into segments until the segment buffer is full. The 
+// acceleration segments last about 1/SEGMENTS_PER_SECOND and run at the rate the ramp has in 
+// their middle, the plateau is a single segment. Called from the main loop only.
+// The C_COMPENSATION advance of a segment follows the ramp the same way. Whether the block 
+// decelerates its advance to 0 as the last one queued is decided here rather than when it starts.
+// The interrupt still sets up the advance rate and the retract restore per block, those depend 
+// on the filament the blocks before left compressed.
+void st_prepare_segments()
+{
+  unsigned char next_head;
+  while((next_head = (segment_buffer_head + 1) & (SEGMENT_BUFFER_SIZE - 1)) != segment_buffer_tail) {
+    if(prep_restart) {
+      CRITICAL_SECTION_START;
+      prep_restart = false;
+      prep_block_index = block_buffer_tail;
+      CRITICAL_SECTION_END;
+      prep_step_events = 0;
+    }
+    if(prep_block_index == block_buffer_head) {
+      return; // Nothing left to prepare
+    }
+    block_t *block = &block_buffer[prep_block_index];
+    if(prep_step_events >= block->step_event_count) {
+      prep_block_index = (prep_block_index + 1) & (BLOCK_BUFFER_SIZE - 1);
+      prep_step_events = 0;
+      continue;
+    }
+    if(prep_step_events == 0) {
+      // Leave the blocks to the planner as long as enough motion is prepared
+      CRITICAL_SECTION_START;
+      unsigned long prepared_ticks = segment_buffer_ticks;
+      CRITICAL_SECTION_END;
+      if(prepared_ticks >= SEGMENT_LOOKAHEAD_MS * (F_CPU/8000)) {
+        return;
+      }
+      // From here on the planner must not change the trapezoid of the block
+      block->busy = true;
+      prep_acceleration_time = 0;
+      prep_deceleration_time = 0;
+      prep_acc_step_rate = block->initial_rate;
+    }
+
+    segment_t *segment = &segment_buffer[segment_buffer_head];
+    unsigned short step_rate;
+    unsigned long steps_left;
+    unsigned long *phase_time = NULL;
+    #ifdef S_CURVE_ACCELERATION
+    unsigned long fraction;
+    #endif // S_CURVE_ACCELERATION
+    #ifdef C_COMPENSATION
+    long advance_from, advance_to; // The advance over the phase, as the interrupt had it
+    #endif // C_COMPENSATION
+    if(prep_step_events < (unsigned long)block->accelerate_until) {
+      steps_left = block->accelerate_until - prep_step_events;
+      phase_time = &prep_acceleration_time;
+      #ifdef S_CURVE_ACCELERATION
+      fraction = s_curve_fraction(prep_acceleration_time + SEGMENT_TICKS/2, block->acceleration_ticks, 
+                                  block->acceleration_ticks_inverse);
+      step_rate = block->initial_rate + (((block->cruise_rate - block->initial_rate) * fraction) >> 16);
+      #else // S_CURVE_ACCELERATION
+      MultiU24X24toH16(step_rate, prep_acceleration_time + SEGMENT_TICKS/2, block->acceleration_rate);
+      step_rate += block->initial_rate;
+      #endif // S_CURVE_ACCELERATION
+      if(step_rate > block->nominal_rate)
+        step_rate = block->nominal_rate;
+      prep_acc_step_rate = step_rate;
+      #ifdef C_COMPENSATION
+      advance_from = block->initial_advance;
+      #ifdef C_COMPENSATION_IGNORE_ACCELERATION
+      advance_to = advance_from;
+      #else // C_COMPENSATION_IGNORE_ACCELERATION
+      advance_to = block->target_advance;
+      #endif // C_COMPENSATION_IGNORE_ACCELERATION
+      #endif // C_COMPENSATION
+    }
+    else if(prep_step_events < (unsigned long)block->decelerate_after) {
+      steps_left = block->decelerate_after - prep_step_events;
+      step_rate = block->nominal_rate;
+      #ifdef C_COMPENSATION
+      advance_from = advance_to = block->target_advance;
+      #endif // C_COMPENSATION
+    }
+    else {
+      steps_left = block->step_event_count - prep_step_events;
+      phase_time = &prep_deceleration_time;
+      if(prep_deceleration_time == 0) {
+        // Brake from the rate the block reached, not from the middle of the last acceleration segment
+        #ifdef S_CURVE_ACCELERATION
+        prep_acc_step_rate = block->cruise_rate;
+        #else // S_CURVE_ACCELERATION
+        if((unsigned long)block->decelerate_after > (unsigned long)block->accelerate_until) {
+          prep_acc_step_rate = block->nominal_rate;
+        }
+        else if(prep_acceleration_time != 0) {
+          MultiU24X24toH16(step_rate, prep_acceleration_time, block->acceleration_rate);
+          prep_acc_step_rate = min((unsigned long)block->initial_rate + step_rate, block->nominal_rate);
+        }
+        #endif // S_CURVE_ACCELERATION
+      }
+      #ifdef S_CURVE_ACCELERATION
+      fraction = s_curve_fraction(prep_deceleration_time + SEGMENT_TICKS/2, block->deceleration_ticks, 
+                                  block->deceleration_ticks_inverse);
+      if(prep_acc_step_rate > block->final_rate) {
+        step_rate = prep_acc_step_rate - (((prep_acc_step_rate - block->final_rate) * fraction) >> 16);
+      }
+      else {
+        step_rate = block->final_rate;
+      }
+      #else // S_CURVE_ACCELERATION
+      MultiU24X24toH16(step_rate, prep_deceleration_time + SEGMENT_TICKS/2, block->acceleration_rate);
+      if(step_rate > prep_acc_step_rate) { // Check step_rate stays positive
+        step_rate = block->final_rate;
+      }
+      else {
+        step_rate = prep_acc_step_rate - step_rate; // Decelerate from aceleration end point.
+      }
+      #endif // S_CURVE_ACCELERATION
+      if(step_rate < block->final_rate)
+        step_rate = block->final_rate;
+      #ifdef C_COMPENSATION
+      // Go down to 0 at the end of the last block queued
+      advance_to = 0;
+      if(((prep_block_index + 1) & (BLOCK_BUFFER_SIZE - 1)) != block_buffer_head) {
+        advance_to = block->final_advance;
+      }
+      #ifdef C_COMPENSATION_IGNORE_ACCELERATION
+      advance_from = advance_to;
+      #else // C_COMPENSATION_IGNORE_ACCELERATION
+      advance_from = block->target_advance;
+      #endif // C_COMPENSATION_IGNORE_ACCELERATION
+      #endif // C_COMPENSATION
+    }
+
+    unsigned long steps = steps_left;
+    if(phase_time != NULL) {
+      steps = step_rate / SEGMENTS_PER_SECOND;
+      if(steps == 0) 
+        steps = 1;
+      if(steps > steps_left) 
+        steps = steps_left;
+    }
+    if(steps > 0xFFFF) 
+      steps = 0xFFFF;
+
+    #ifdef ISR_TRACE
+    { // calc_timer() may trace, and only an interrupt may write the trace ring
+      CRITICAL_SECTION_START;
+      segment->timer = calc_timer(step_rate, segment->step_loops);
+      CRITICAL_SECTION_END;
+    }
+    #else // ISR_TRACE
+    segment->timer = calc_timer(step_rate, segment->step_loops);
+    #endif // ISR_TRACE
+    segment->step_events = steps;
+    segment->block_index = prep_block_index;
+    #ifdef C_COMPENSATION
+    segment->advance = advance_from;
+    if(advance_from != advance_to) {
+      #if defined(S_CURVE_ACCELERATION)
+      fraction = min(fraction, 0xFFFFUL);
+      #else // S_CURVE_ACCELERATION
+      // How far into the ramp the middle of the segment is
+      unsigned long position = prep_step_events + steps / 2;
+      unsigned long length = block->accelerate_until;
+      if(phase_time == &prep_deceleration_time) {
+        position -= block->decelerate_after;
+        length = block->step_event_count - block->decelerate_after;
+      }
+      while(length > 0xFFFF) { // Keeps position * 0xFFFF within 32 bits
+        length >>= 1;
+        position >>= 1;
+      }
+      unsigned long fraction = min(position * 0xFFFF / length, 0xFFFFUL);
+      #endif // S_CURVE_ACCELERATION
+      segment->advance += ((advance_to - advance_from) * (long)fraction) >> 16;
+    }
+    #endif // C_COMPENSATION
+    // step_loops is 1, 2 or 4, so this is timer * steps / step_loops
+    segment->ticks = ((unsigned long)segment->timer * steps) >> (segment->step_loops >> 1);
+    if(phase_time != NULL) {
+      *phase_time += segment->ticks;
+    }
+    prep_step_events += steps;
+    CRITICAL_SECTION_START;
+    segment_buffer_ticks += segment->ticks;
+    segment_buffer_head = next_head;
+    CRITICAL_SECTION_END;
+  }
+}
+
+// Takes the next segment of the current block. Returns false if the main loop has not prepared 
+// it yet.
+FORCE_INLINE bool pop_segment()
+{
+  while(segment_buffer_tail != segment_buffer_head) {
+    segment_t *segment = &segment_buffer[segment_buffer_tail];
+    segment_buffer_tail = (segment_buffer_tail + 1) & (SEGMENT_BUFFER_SIZE - 1);
+    segment_buffer_ticks -= segment->ticks;
+    // Skip what is left of a block that ended early on an endstop
+    if(segment->block_index == block_buffer_tail) {
+      segment_steps_left = segment->step_events;
+      segment_timer = segment->timer;
+      segment_step_loops = segment->step_loops;
+      #ifdef C_COMPENSATION
+      // Travel and restore blocks keep the advance trapezoid_generator_reset() took from the next block
+      if(!current_block->restore && !current_block->travel) {
+        advance = segment->advance;
+      }
+      #endif // C_COMPENSATION
+      return true;
+    }
+  }
+  return false;
+}
+
+unsigned long st_segment_underruns()
+{
+  CRITICAL_SECTION_START;
+  unsigned long underruns = segment_underruns;
+  CRITICAL_SECTION_END;
+  return underruns;
+}
+
+void st_reset_segment_underruns()
+{
+  CRITICAL_SECTION_START;
+  segment_underruns = 0;
+  CRITICAL_SECTION_END;
+}
+#endif // STEP_SEGMENT_BUFFER
+
 // Called once at each block init time to set the direction of the move
 FORCE_INLINE void set_directions()
 {
@@ -680,6 +1059,9 @@ FORCE_INLINE void make_normal_steps()
   for(int8_t i=0; i < step_loops; i++) { // Take multiple steps per interrupt (for high speed moves) 
     #ifndef AT90USB
     MSerial.checkRx(); // Check for serial chars.
+    #if TX_BUFFER_SIZE > 0
+    MSerial.checkTx(); // Keep the output going too
+    #endif
     #endif
 
     #if !defined(COREXY)
@@ -886,20 +1268,54 @@ FORCE_INLINE void make_comp_e_steps(unsigned short e_steps_left)
       WRITE(E2_STEP_PIN, !INVERT_E_STEP_PIN);
     }
     #endif // EXTRUDERS > 2
+    #ifndef C_COMPENSATION_E_TIMER
     --total_e_steps_left;
+    #endif // !C_COMPENSATION_E_TIMER
     --e_steps_left;
   }
+  #ifdef C_COMPENSATION_E_TIMER
+  total_e_steps_left = e_steps_pending();
+  if(total_e_steps_left == 0) { // Nothing to do until the stepper interrupt schedules more
+    DISABLE_E_TIMER_INTERRUPT();
+  }
+  #endif // C_COMPENSATION_E_TIMER
 
   // Clear the wait for compensation mode if it has settled
   if(old_advance == advance && total_e_steps_left == 0) {
     wait_for_comp = false;
   }
 }
+
+#ifdef C_COMPENSATION_E_TIMER
+// Makes the E-steps scheduled by the stepper interrupt, e_step_loops at a time at 
+// the rate set_e_timer() picked for the block.
+ISR(TIMER3_COMPA_vect)
+{
+  make_comp_e_steps(e_step_loops);
+}
+#endif // C_COMPENSATION_E_TIMER
 #endif //C_COMPENSATION
 
 // "The Stepper Driver Interrupt" - This timer interrupt is the workhorse.  
 // It pops blocks from the block_buffer and executes them by pulsing the stepper pins appropriately. 
+#ifdef ISR_PROFILER
+FORCE_INLINE void stepper_isr();
+
+ISR(TIMER1_COMPA_vect)
+{
+  unsigned short start = isr_profile_start();
+  stepper_isr();
+  uint16_t counter = TCNT1, compare = OCR1A;
+  if(counter >= compare) { // Past the compare value, the next match only comes after the counter wraps
+    isr_missed_steps++;
+  }
+  isr_profile_end(ISR_PROFILE_STEPPER, start);
+}
+
+FORCE_INLINE void stepper_isr()
+#else // ISR_PROFILER
 ISR(TIMER1_COMPA_vect)
+#endif // ISR_PROFILER
 {
   #if defined(C_COMPENSATION) && defined(C_COMPENSATION_SPLIT_E_STEPS)
   // If we split E-steps into cycles and still not done, set the remaining 
@@ -944,6 +1360,9 @@ ISR(TIMER1_COMPA_vect)
       }
       if(advance != old_advance || total_e_steps_left != 0) {
         timer = calc_timer(advance_step_rate);
+        #ifdef C_COMPENSATION_E_TIMER
+        set_e_timer(advance_step_rate);
+        #endif // C_COMPENSATION_E_TIMER
         goto do_e_steps;
       }
       wait_for_comp = false;
@@ -953,25 +1372,50 @@ ISR(TIMER1_COMPA_vect)
     }
   }
 
+  #ifdef STEP_SEGMENT_BUFFER
+  if(segment_steps_left == 0 && !pop_segment()) {
+    segment_underruns++;
+    OCR1A = 200; // The main loop is late, check again in 100us
+    return;
+  }
+  step_loops = min(segment_step_loops, segment_steps_left);
+  #endif // STEP_SEGMENT_BUFFER
+
   // Check for limit switches
   check_endstops();
 
   // Make normal (those that do not have to be adjusted) steps
   make_normal_steps();
 
+  #ifdef STEP_SEGMENT_BUFFER
+  segment_steps_left -= step_loops;
+  timer = segment_timer;
+  #else // STEP_SEGMENT_BUFFER
   // Calculare new timer value
   unsigned short step_rate;
   if (step_events_completed <= (unsigned long int)current_block->accelerate_until) {
     
+    #ifdef S_CURVE_ACCELERATION
+    unsigned long fraction = s_curve_fraction(acceleration_time, current_block->acceleration_ticks, 
+                                              current_block->acceleration_ticks_inverse);
+    acc_step_rate = current_block->initial_rate + 
+                    (((current_block->cruise_rate - current_block->initial_rate) * fraction) >> 16);
+    #else // S_CURVE_ACCELERATION
     MultiU24X24toH16(acc_step_rate, acceleration_time, current_block->acceleration_rate);
     acc_step_rate += current_block->initial_rate;
+    #endif // S_CURVE_ACCELERATION
     
     // upper limit
     if(acc_step_rate > current_block->nominal_rate)
       acc_step_rate = current_block->nominal_rate;
       
     #if defined(C_COMPENSATION) && !defined(C_COMPENSATION_IGNORE_ACCELERATION)
+    #ifdef S_CURVE_ACCELERATION
+    // The advance follows the speed, which is known here without dividing
+    advance = initial_advance + ((initial_to_target_advance * (long)fraction) >> 16);
+    #else // S_CURVE_ACCELERATION
     advance = initial_advance + (step_events_completed*initial_to_target_advance)/current_block->accelerate_until;
+    #endif // S_CURVE_ACCELERATION
     #endif // C_COMPENSATION && !C_COMPENSATION_IGNORE_ACCELERATION
 
     // step_rate to timer interval
@@ -980,6 +1424,16 @@ ISR(TIMER1_COMPA_vect)
     acceleration_time += timer;
   } 
   else if (step_events_completed > (unsigned long int)current_block->decelerate_after) {   
+    #ifdef S_CURVE_ACCELERATION
+    unsigned long fraction = s_curve_fraction(deceleration_time, current_block->deceleration_ticks, 
+                                              current_block->deceleration_ticks_inverse);
+    if(acc_step_rate > current_block->final_rate) { // Decelerate from aceleration end point.
+      step_rate = acc_step_rate - (((acc_step_rate - current_block->final_rate) * fraction) >> 16);
+    }
+    else {
+      step_rate = current_block->final_rate;
+    }
+    #else // S_CURVE_ACCELERATION
     MultiU24X24toH16(step_rate, deceleration_time, current_block->acceleration_rate);
     
     if(step_rate > acc_step_rate) { // Check step_rate stays positive
@@ -988,6 +1442,7 @@ ISR(TIMER1_COMPA_vect)
     else {
       step_rate = acc_step_rate - step_rate; // Decelerate from aceleration end point.
     }
+    #endif // S_CURVE_ACCELERATION
 
     // lower limit
     if(step_rate < current_block->final_rate)
@@ -996,6 +1451,8 @@ ISR(TIMER1_COMPA_vect)
     #ifdef C_COMPENSATION
     #ifdef C_COMPENSATION_IGNORE_ACCELERATION
     advance = final_advance;
+    #elif defined(S_CURVE_ACCELERATION)
+    advance = target_advance + ((target_to_final_advance * (long)fraction) >> 16);
     #else // C_COMPENSATION_IGNORE_ACCELERATION
     long decel_steps_completed = step_events_completed - current_block->decelerate_after;
     long decel_steps_total = current_block->step_event_count - current_block->decelerate_after;
@@ -1015,6 +1472,7 @@ ISR(TIMER1_COMPA_vect)
     advance = target_advance;
     #endif //C_COMPENSATION
   }
+  #endif // STEP_SEGMENT_BUFFER
 
   // If current block is finished, reset pointer 
   if (step_events_completed >= current_block->step_event_count) {
@@ -1024,6 +1482,12 @@ ISR(TIMER1_COMPA_vect)
       advance_step_rate += current_block->nominal_rate; 
     wait_for_comp |= current_block->travel; // Do the same for travel moves, but use pre-calcualted e-speed
     #endif //C_COMPENSATION
+    #ifdef STEP_SEGMENT_BUFFER
+    segment_steps_left = 0;
+    if(prep_block_index == block_buffer_tail) { // Ended before all its segments were prepared
+      prep_restart = true;
+    }
+    #endif // STEP_SEGMENT_BUFFER
     current_block = NULL;
     plan_discard_current_block();
   }
@@ -1039,14 +1503,13 @@ do_split_e_steps:
   #endif // C_COMPENSATION_SPLIT_E_STEPS
   
   // Calculate the number of e-steps left
-  unsigned short e_steps_left = labs(e_steps[0]);
-  #if EXTRUDERS > 1
-  e_steps_left = max(e_steps_left, labs(e_steps[1]));
-  #endif //EXTRUDERS > 1
-  #if EXTRUDERS > 2
-  e_steps_left = max(e_steps_left, labs(e_steps[2]));
-  #endif // EXTRUDERS > 2
+  unsigned short e_steps_left = e_steps_pending();
   total_e_steps_left = e_steps_left;
+  #ifdef C_COMPENSATION_E_TIMER
+  if(e_steps_left != 0) { // Timer3 makes them
+    ENABLE_E_TIMER_INTERRUPT();
+  }
+  #endif // C_COMPENSATION_E_TIMER
   
   #ifdef C_COMPENSATION_SPLIT_E_STEPS
   total_e_split_time = timer; 
@@ -1066,10 +1529,10 @@ do_split_e_steps:
 
   OCR1A = timer;
 
-  #ifdef C_COMPENSATION
+  #if defined(C_COMPENSATION) && !defined(C_COMPENSATION_E_TIMER)
   // Make E-steps if compensation is enabled
   make_comp_e_steps(e_steps_left);
-  #endif //C_COMPENSATION
+  #endif // C_COMPENSATION && !C_COMPENSATION_E_TIMER
 
   return;
 }
@@ -1296,6 +1759,15 @@ void st_init()
   TCNT1 = 0;
   ENABLE_STEPPER_DRIVER_INTERRUPT();  
 
+  #if defined(C_COMPENSATION) && defined(C_COMPENSATION_E_TIMER)
+  // Timer3 makes the E-steps: CTC mode, outputs disconnected, the same 2MHz clock as timer1.
+  // Its interrupt is enabled whenever there are E-steps scheduled.
+  TCCR3A = 0;
+  TCCR3B = (1<<WGM32) | (2<<CS30);
+  OCR3A = 0x4000;
+  TCNT3 = 0;
+  #endif // C_COMPENSATION && C_COMPENSATION_E_TIMER
+
   enable_endstops(true); // Start with endstops active. After homing they can be disabled
   sei();
 }
@@ -1304,6 +1776,9 @@ void st_init()
 // Block until all buffered steps are executed
 void st_synchronize()
 {
+#ifdef COALESCE_MOVES
+  flush_pending_move();
+#endif
   while( blocks_queued() 
          #ifdef C_COMPENSATION
          || total_e_steps_left != 0 
@@ -1360,6 +1835,17 @@ void quickStop()
   while(blocks_queued())
     plan_discard_current_block();
   current_block = NULL;
+  #ifdef COALESCE_MOVES
+  discard_pending_move();
+  #endif
+  #ifdef STEP_SEGMENT_BUFFER
+  segment_buffer_tail = segment_buffer_head;
+  segment_buffer_ticks = 0;
+  segment_steps_left = 0;
+  prep_block_index = block_buffer_tail;
+  prep_step_events = 0;
+  prep_restart = false;
+  #endif // STEP_SEGMENT_BUFFER
   ENABLE_STEPPER_DRIVER_INTERRUPT();
 }
 
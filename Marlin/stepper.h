@@ -59,6 +59,14 @@ extern block_t *current_block;  // A pointer to the block currently being traced
 
 void quickStop();
 
+#ifdef STEP_SEGMENT_BUFFER
+// Cuts the queued blocks into constant rate segments for the stepper interrupt, called by manage_inactivity()
+void st_prepare_segments();
+// Stepper interrupts that found no segment prepared and waited 100us, M576 reports them
+unsigned long st_segment_underruns();
+void st_reset_segment_underruns();
+#endif // STEP_SEGMENT_BUFFER
+
 void digipot_init();
 #ifdef ENABLE_DIGITAL_POT_CONTROL
 void digitalPotWrite(int address, int value);
@@ -33,6 +33,7 @@
 #include "ultralcd.h"
 #include "temperature.h"
 #include "watchdog.h"
+#include "isr_profiler.h"
 
 //===========================================================================
 //=============================public variables============================
@@ -918,7 +919,20 @@ int read_max6675()
 
 
 // Timer 0 is shared with millies
+#ifdef ISR_PROFILER
+FORCE_INLINE void temperature_isr();
+
+ISR(TIMER0_COMPB_vect)
+{
+  unsigned short start = isr_profile_start();
+  temperature_isr();
+  isr_profile_end(ISR_PROFILE_TEMPERATURE, start);
+}
+
+FORCE_INLINE void temperature_isr()
+#else // ISR_PROFILER
 ISR(TIMER0_COMPB_vect)
+#endif // ISR_PROFILER
 {
   //these variables are only accesible from the ISR, but static, so they don't loose their value
   static unsigned char temp_count = 0;
@@ -0,0 +1,81 @@
+/*
+  trace.cpp - binary trace records from the interrupt handlers
+*/
+#include "Marlin.h"
+#include "trace.h"
+#include "cardreader.h"
+
+#ifdef ISR_TRACE
+
+#if (TRACE_BUFFER_SIZE & (TRACE_BUFFER_SIZE - 1)) != 0 || TRACE_BUFFER_SIZE > 128
+#error "TRACE_BUFFER_SIZE must be a power of 2 no bigger than 128"
+#endif
+
+// Records drained per loop() pass, so a busy trace doesn't hold up the commands
+#define TRACE_DRAIN_RECORDS 2
+
+trace_record_t trace_buffer[TRACE_BUFFER_SIZE];
+volatile unsigned char trace_head;
+volatile unsigned char trace_tail;
+volatile unsigned int trace_dropped;
+
+static unsigned char trace_output = TRACE_SERIAL;
+
+// Sets where trace_drain() sends the records. Whatever is queued for the old output goes to the new one.
+void trace_set_output(unsigned char output, char *filename)
+{
+  #ifdef SDSUPPORT
+  if(trace_output == TRACE_SD) {
+    card.closeTrace();
+  }
+  if(output == TRACE_SD && !card.openTrace(filename)) {
+    output = TRACE_OFF;
+  }
+  #else
+  if(output == TRACE_SD) {
+    output = TRACE_OFF;
+  }
+  #endif
+  trace_output = output;
+}
+
+static void trace_write(const trace_record_t *record)
+{
+  #ifdef SDSUPPORT
+  if(trace_output == TRACE_SD) {
+    card.writeTrace(record, sizeof(*record));
+    return;
+  }
+  #endif
+  // trace:<record bytes in hex>
+  SERIAL_PROTOCOLPGM("trace:");
+  const uint8_t *p = (const uint8_t *)record;
+  for(unsigned char i = 0; i < sizeof(*record); i++) {
+    SERIAL_PROTOCOL("0123456789abcdef"[p[i] >> 4]);
+    SERIAL_PROTOCOL("0123456789abcdef"[p[i] & 0xf]);
+  }
+  SERIAL_PROTOCOLLN("");
+}
+
+// Called from loop(). The only place that moves trace_tail, so the interrupts never see a half read record.
+void trace_drain()
+{
+  if(trace_dropped != 0) {
+    trace_record_t record;
+    CRITICAL_SECTION_START;
+    record.args[0] = trace_dropped;
+    trace_dropped = 0;
+    record.time = trace_time();
+    CRITICAL_SECTION_END;
+    record.event = TRACE_DROPPED;
+    record.args[1] = record.args[2] = record.args[3] = 0;
+    if(trace_output != TRACE_OFF) trace_write(&record);
+  }
+  for(unsigned char n = 0; n < TRACE_DRAIN_RECORDS && trace_tail != trace_head; n++) {
+    unsigned char tail = trace_tail;
+    if(trace_output != TRACE_OFF) trace_write(&trace_buffer[tail]);
+    trace_tail = (tail + 1) & (TRACE_BUFFER_SIZE - 1);
+  }
+}
+
+#endif // ISR_TRACE
@@ -0,0 +1,79 @@
+/*
+  trace.h - binary trace records from the interrupt handlers
+
+  Printing from an interrupt busy-waits on the serial port and changes the
+  timing that is being looked at. With ISR_TRACE the interrupts append a
+  fixed size record (event, timer0 time, four arguments) to a small ring
+  buffer instead, and loop() drains it to the serial port as "trace:" hex
+  lines or to a file on the SD card (M578). host/trace_decode.py turns
+  either of them into CSV.
+*/
+#ifndef trace_h
+#define trace_h
+
+#include "Marlin.h"
+
+#ifdef ISR_TRACE
+
+#define TRACE_DROPPED          0  // A: records lost to a full buffer since the last drop record
+#define TRACE_STEPPER_TOO_HIGH 1  // A: step rate
+#define TRACE_ACCEL_STEPS      2  // A: step events, B: accelerate until, C: decelerate after, D: nominal rate
+#define TRACE_C_COMP_ADVANCE   3  // A: old advance, B: initial, C: target, D: final advance
+#define TRACE_C_COMP_RATE      4  // A: advance step rate, B: us per advance step
+#define TRACE_C_COMP_STEPS     5  // A: extruder<<16 | timer, B: timer leftover, C: E-steps, D: advance steps this cycle
+#define TRACE_C_COMP_STEPS_2   6  // A: desired advance steps, B: old advance, C: advance, D: step events completed
+
+#define TRACE_OFF    0
+#define TRACE_SERIAL 1
+#define TRACE_SD     2
+
+// The layout of a record is also the format of the SD file (little endian, 21 bytes)
+typedef struct {
+  uint8_t event;
+  uint32_t time;    // trace_time()
+  int32_t args[4];
+} __attribute__((packed)) trace_record_t;
+
+extern trace_record_t trace_buffer[TRACE_BUFFER_SIZE];
+extern volatile unsigned char trace_head; // Written by the interrupts only
+extern volatile unsigned char trace_tail; // Written by trace_drain() only
+extern volatile unsigned int trace_dropped;
+
+// Defined by the Arduino core (wiring.c), counted by the timer0 overflow interrupt
+extern volatile unsigned long timer0_overflow_count;
+
+// The time in timer0 ticks of 64 CPU cycles (4us at 16MHz). This is what micros() scales,
+// read without its interrupt lock and multiply. Interrupts must be off, as they are in a handler.
+FORCE_INLINE uint32_t trace_time()
+{
+  uint8_t t = TCNT0;
+  uint32_t overflows = timer0_overflow_count;
+  if((TIFR0 & _BV(TOV0)) && t != 255) // Overflowed, its interrupt is waiting for us
+    overflows++;
+  return (overflows << 8) | t;
+}
+
+void trace_set_output(unsigned char output, char *filename);
+void trace_drain();
+
+// Called from interrupt handlers only. Those don't nest, so they are a single producer.
+FORCE_INLINE void trace_event(uint8_t event, int32_t a, int32_t b = 0, int32_t c = 0, int32_t d = 0)
+{
+  unsigned char head = trace_head;
+  unsigned char next = (head + 1) & (TRACE_BUFFER_SIZE - 1);
+  if(next == trace_tail) {
+    trace_dropped++;
+    return;
+  }
+  trace_record_t *record = &trace_buffer[head];
+  record->event = event;
+  record->time = trace_time();
+  record->args[0] = a;
+  record->args[1] = b;
+  record->args[2] = c;
+  record->args[3] = d;
+  trace_head = next;
+}
+
+#endif // ISR_TRACE
+#endif